@@ -0,0 +1,37 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <string>
+#include "hierarchy.h"
+
+using namespace std;
+
+struct batch_stats {
+    unsigned long long ops;
+    unsigned long long ok;
+    unsigned long long failed;
+    unsigned long long bad_lines;
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    double seconds;
+    batch_stats() :
+        ops(0), ok(0), failed(0), bad_lines(0), bytes_in(0), bytes_out(0),
+        seconds(0) {}
+};
+
+/*
+ * Replay a line-delimited request log against the hierarchy.
+ *
+ * The request file is mmap'ed read-only and every line is decoded straight
+ * from the mapping, so nothing is copied on the way in. Responses are
+ * appended to out_path through a large stdio buffer, or dropped when
+ * out_path is empty.
+ *
+ * Returns 0 on success, -1 if the input or output file cannot be opened.
+ */
+int batch_run(hierarchy &h, const string &in_path, const string &out_path,
+              batch_stats &stats);
+
+void batch_report(const batch_stats &stats);
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <cstddef>
+
+/*
+ * Startup benchmark: build a random tree of n nodes by replaying its
+ * add_node stream, snapshot it, then time loading the snapshot into a
+ * fresh hierarchy and check both trees answer the same full query.
+ */
+int bench_snapshot(size_t n);
+
+/*
+ * Stress test of --live-reads: reader threads run lock-free full queries
+ * while a writer adds, deletes and moves nodes for the given time, and each
+ * returned row is checked against the ID it claims and against the parent
+ * and depth it was reached at. IDs and names are too
+ * long for the short string buffer, so in a -fsanitize=address build any
+ * read of a freed node is also reported.
+ */
+int bench_epoch(int seconds, int readers);
+
+/*
+ * ID index microbenchmark over n IDs: the longest single insert while the
+ * index grows, and lookups per second from 1 to 8 reader threads, for
+ * id_index and for an unordered_map behind the shared tree lock.
+ */
+int bench_index(size_t n);
+
+/*
+ * Writer scaling of --subtree-locks: the given number of threads each add,
+ * delete and move nodes in their own top-level subtree, with a few moves
+ * across subtrees, first under the tree lock and then with subtree locks.
+ * Each run is logged, and the log replayed into a fresh hierarchy must
+ * give the same tree.
+ */
+int bench_subtrees(int writers);
+
+/*
+ * The same workload under the tree lock and with --shards <writers>. Each
+ * writer's subtree lands in the shard its name hashes to, and the moves
+ * across subtrees are handoffs when those shards differ.
+ */
+int bench_shards(int writers);
+
+/*
+ * Write latency while a reader runs full queries over a tree of n nodes
+ * without pause: first holding the tree lock for each whole query, then
+ * through jsonDecodeProcess, where queries step out of the lock for waiting
+ * writers. The writer stays in a scratch subtree, so every query must still
+ * return the rest of the tree exactly.
+ */
+int bench_yield(size_t n);
+
+/*
+ * Restart from checkpoints: a random tree of n nodes is checkpointed into a
+ * base, then changed and checkpointed as a few deltas. The base and deltas
+ * are recovered into a fresh hierarchy once in full and once with the base
+ * left on disk below depth 2 and no cache for loaded subtrees, and both
+ * must give the tree that was checkpointed.
+ */
+int bench_restart(size_t n);
+
+#endif
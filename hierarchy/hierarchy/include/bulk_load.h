@@ -0,0 +1,41 @@
+#ifndef BULK_LOAD_H
+#define BULK_LOAD_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "hierarchy.h"
+
+using namespace std;
+
+struct bulk_reject {
+    uint64_t line;
+    string id;
+    string reason;
+};
+
+struct bulk_result {
+    uint64_t rows;
+    uint64_t loaded;
+    vector<bulk_reject> rejected;
+    double seconds;
+    bulk_result() : rows(0), loaded(0), seconds(0) {}
+};
+
+/*
+ * Load flat (id, parent_id, name) rows into the hierarchy in O(n log n).
+ *
+ * The file is either CSV ("id,parent_id,name", optional header line, RFC
+ * 4180 quoting) or NDJSON ({"id":..,"parent_id":..,"name":..} per line),
+ * told apart by the first character. Rows may come in any order and may
+ * hang below nodes already in the tree. All rows are validated together:
+ * IDs must be new and unique, there is at most one root, every parent must
+ * exist and sibling names must be unique. Sibling lists are sorted once,
+ * and a rejected row takes its whole subtree with it.
+ *
+ * The caller must hold h.m_mutex if the hierarchy is already shared.
+ * Accepted nodes are logged to h.m_wal in parent-before-child order.
+ */
+int bulk_load(hierarchy &h, const string &path, bulk_result &res);
+
+#endif
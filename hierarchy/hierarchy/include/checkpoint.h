@@ -0,0 +1,105 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include "nlohmann/json.hpp"
+#include "hierarchy.h"
+#include "wal.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+/*
+ * Incremental checkpoints of the write-ahead log at <wal>:
+ *
+ *   <wal>.base        full snapshot (snapshot.h layout) at some lsn B
+ *   <wal>.delta.<L>   every node added, deleted or moved since the previous
+ *                     checkpoint, as it stands at lsn L (> B)
+ *   <wal>.seg.<L>     log rotated out at checkpoint L, removed as soon as
+ *                     that checkpoint is durable
+ *   <wal>             records after the newest checkpoint
+ *
+ * A delta is itself a log file whose records are all stamped L: add_node
+ * for each changed node that still exists (parents before children) and
+ * delete_node for each one that does not. Recovery loads the base, applies
+ * the deltas and replays only the log records newer than them, so it reads
+ * the changed nodes rather than the whole history.
+ *
+ * Checkpoints are taken by a background thread. It holds the hierarchy
+ * lock only to collect the dirty nodes and rotate the log; the delta, or
+ * every max_deltas-th time a forked base snapshot, is written afterwards
+ * at no more than bytes_per_sec.
+ */
+class checkpointer
+{
+public:
+    checkpointer(hierarchy &h, write_ahead_log &wal, const string &wal_path);
+    ~checkpointer() { stop(); }
+
+    /*
+     * Bring an empty tree (or one holding the given lsn) up to the newest
+     * checkpoint and set lsn to it. With track set (checkpoints will be
+     * taken) dirty tracking starts here, so every log record replayed from
+     * here on reaches the next delta.
+     */
+    int recover(uint64_t &lsn, bool track);
+
+    /*
+     * Rotated segments oldest first, then the live log. Segments a
+     * checkpoint already covers are normally gone; replay skips any left.
+     */
+    vector<string> log_files();
+
+    /*
+     * interval_sec 0 only checkpoints on request(). Turns on dirty tracking
+     * if it is off; the tree may then have changed untracked since the last
+     * checkpoint, so the first one writes a base.
+     */
+    void start(int interval_sec, uint64_t bytes_per_sec, int max_deltas = 8);
+    void stop();
+    void request();
+    json status();
+
+    /* take one checkpoint on the calling thread */
+    int run(json &result);
+
+    /*
+     * Where the chain stands, including the dirty set, for a process taking
+     * over this one; adopt() continues from it instead of recover(). Both
+     * need the hierarchy lock held and the thread stopped.
+     */
+    json handoff_state();
+    void adopt(const json &state);
+    /* restart the thread after a stop() for a handoff that failed */
+    void resume() { start(m_interval_sec, m_rate, m_max_deltas); }
+
+private:
+    hierarchy &m_h;
+    write_ahead_log &m_wal;
+    string m_path;
+    int m_interval_sec = 0;
+    uint64_t m_rate = 0;
+    int m_max_deltas = 8;
+
+    uint64_t m_lsn = 0;     // covered by base + deltas
+    bool m_have_base = false;
+    int m_deltas = 0;       // deltas on top of the base
+
+    mutex m_lock;
+    condition_variable m_cv;
+    thread m_thread;
+    bool m_stop = false;
+    bool m_requested = false;
+    json m_status;
+
+    void loop();
+    int write_delta(const string &path, const string &records);
+    void remove_upto(const string &kind, uint64_t lsn);
+};
+
+#endif
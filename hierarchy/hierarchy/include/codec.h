@@ -0,0 +1,63 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <string>
+#include <cstdint>
+#include "nlohmann/json.hpp"
+#include "hierarchy.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+/*
+ * Wire format negotiated at startup with --protocol.
+ *
+ * text:    one JSON request per line, one JSON response per line.
+ * cbor:    every message is a 4-byte big-endian length followed by a CBOR
+ *          document of that many bytes.
+ * msgpack: same framing, MessagePack payload.
+ *
+ * The binary formats return query rows as [id, name, parent_id] arrays.
+ */
+enum class wire_format {
+    text,
+    cbor,
+    msgpack
+};
+
+/* largest binary frame payload, and longest text line */
+static const uint32_t MAX_FRAME_SIZE = 64 << 20;
+
+bool parse_wire_format(const string &s, wire_format &fmt);
+
+row_format wire_row_format(wire_format fmt);
+
+/*
+ * Decode the next request in [data, data + len).
+ *
+ * Returns 1 and sets j when a request was decoded (j is discarded if the
+ * payload was not valid, null for a blank text line), 0 when more bytes
+ * are needed and -1 when the stream cannot be recovered (a frame or text
+ * line longer than MAX_FRAME_SIZE). consumed is the number of bytes to
+ * drop from the front of the buffer.
+ *
+ * For text, scanned (if given) is how much of data is already known to
+ * hold no newline: the search resumes there, and it is updated when more
+ * bytes are needed and reset once a line is decoded, so a long line that
+ * arrives in many reads is scanned once rather than from its start on
+ * every read.
+ */
+int decode_request(const char *data, size_t len, wire_format fmt, json &j,
+                   size_t &consumed, size_t *scanned = nullptr);
+
+/* Append one encoded response (with its framing) to out. */
+void encode_response(const json &resp, wire_format fmt, string &out);
+
+/*
+ * Unframed payload helpers for transports that carry their own message
+ * boundaries. A payload that does not decode yields a discarded value.
+ */
+json decode_payload(const char *data, size_t len, wire_format fmt);
+void encode_payload(const json &j, wire_format fmt, string &out);
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include "nlohmann/json.hpp"
+#include "hierarchy.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+/*
+ * Epoch-based reclamation, so that queries can walk the live tree without
+ * the lock while writers delete and move nodes (--live-reads).
+ *
+ * A query pins the current epoch for as long as it holds Node pointers.
+ * delete_node() and clear() unlink nodes as before but retire them instead
+ * of deleting them, tagged with the epoch of that moment. A background
+ * reclaimer advances the epoch every interval and frees the retired nodes
+ * whose tag is older than every pinned reader: a query pinned later started
+ * after the node was unlinked and cannot reach it.
+ */
+class epoch_manager
+{
+public:
+    static const int MAX_READERS = 256;
+
+    epoch_manager() {}
+    ~epoch_manager();
+
+    void start(int interval_ms);
+    void stop();
+
+    /* readers; one pin per thread at a time */
+    void enter();
+    void leave();
+    /* writers, after unlinking n; called under the tree lock */
+    void retire(Node *n);
+    /* one reclamation pass, returns the number of nodes freed */
+    size_t collect();
+    json status();
+
+private:
+    static const uint64_t IDLE = UINT64_MAX;
+
+    struct alignas(64) slot {
+        atomic<uint64_t> epoch{IDLE};
+        atomic<bool> used{false};
+    };
+
+    slot m_slots[MAX_READERS];
+    atomic<uint64_t> m_epoch{1};
+
+    mutex m_lock;                           // guards m_retired
+    vector<pair<uint64_t, Node *>> m_retired;
+    atomic<uint64_t> m_freed{0};
+    atomic<uint64_t> m_passes{0};
+
+    thread m_thread;
+    mutex m_run_lock;
+    condition_variable m_wake;
+    bool m_stop = false;
+};
+
+/* Pins the epoch for one query; does nothing without a manager. */
+class epoch_guard
+{
+public:
+    explicit epoch_guard(epoch_manager *m) : m_m(m) { if (m_m) m_m->enter(); }
+    ~epoch_guard() { if (m_m) m_m->leave(); }
+    epoch_guard(const epoch_guard &) = delete;
+    epoch_guard &operator=(const epoch_guard &) = delete;
+
+private:
+    epoch_manager *m_m;
+};
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <chrono>
+#include <sys/types.h>
+#include "nlohmann/json.hpp"
+#include "hierarchy.h"
+#include "wal.h"
+#include "checkpoint.h"
+#include "codec.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+/* A client connection as it stands at the moment of a handoff. */
+struct handoff_conn {
+    int fd;
+    string in;      // received, not yet executed
+    string out;     // responses not yet written
+    bool reading;
+    bool closing;
+};
+
+/* What the serving loop hands over besides the tree. */
+struct handoff_state {
+    wire_format fmt = wire_format::text;
+    int listen_fd = -1;         // the --listen socket, if serving one
+    string listen_path;
+    vector<handoff_conn> conns;
+    string stdin_in;            // stdin read but not yet executed
+};
+
+/*
+ * Zero-downtime restart: a running process hands its tree, its write-ahead
+ * log and its client descriptors to a new one over a Unix socket.
+ *
+ * The old process listens on the handoff socket (--handoff) and its
+ * serving loop calls give() whenever fd() is readable. With a log, this
+ * happens in two steps so that the tree is never rebuilt while nobody is
+ * serving:
+ *
+ *  1. A successor connects (--takeover). give() stops the checkpointer,
+ *     syncs the log and fork()s under the hierarchy lock; the child writes
+ *     the tree as of that lsn into a memfd in snapshot layout, which goes
+ *     to the successor. give() returns at once and the old process keeps
+ *     serving while the successor loads the image and applies the log
+ *     records written since, read from the file.
+ *  2. The successor reports itself ready. give() takes the lock, syncs the
+ *     log and passes the open log, the listening socket, stdin/stdout and
+ *     every client connection with SCM_RIGHTS, together with the bytes
+ *     each connection had buffered. The successor applies the few records
+ *     logged since step 1, so the pause does not grow with the tree.
+ *
+ * Without a log there is nothing to catch up from, and the image is
+ * written under the lock in step 2 instead, an O(n) pause. Once the
+ * successor acknowledges, the old process exits on the spot, still holding
+ * the lock, so no request is answered twice or lost. If anything fails
+ * before the acknowledgement it lets go and carries on serving.
+ *
+ * The successor continues the same log file and checkpoint chain, and
+ * acknowledges with done() before it starts serving; the old process
+ * confirms and exits.
+ */
+class handoff
+{
+public:
+    static const int TIMEOUT_SEC = 10;
+
+    handoff(hierarchy &h, write_ahead_log &wal, checkpointer &ckpt) :
+        m_h(h), m_wal(wal), m_ckpt(ckpt) {}
+    ~handoff();
+
+    /* old process */
+    int listen_on(const string &path);
+    /* to be polled: the handoff socket, or the successor during step 1 */
+    int fd() const { return m_giving >= 0 ? m_giving : m_listen_fd; }
+    /*
+     * fd() is readable. Returns after step 1, or if the handoff failed;
+     * after step 2 the process exits.
+     */
+    void give(const handoff_state &st);
+
+    /*
+     * New process: receive everything from the process at path into an
+     * empty tree and st, and take over stdin/stdout. lsn is the last log
+     * record the tree includes; the log itself is adopted if wal_path
+     * matches the one the old process had open.
+     */
+    int take(const string &path, const string &wal_path, wal_sync policy, int interval_ms,
+             handoff_state &st, uint64_t &lsn);
+    /*
+     * Everything is in place: let the old process go. -1 if it had already
+     * given up and resumed, in which case this process must not serve.
+     */
+    int done();
+
+private:
+    hierarchy &m_h;
+    write_ahead_log &m_wal;
+    checkpointer &m_ckpt;
+    int m_listen_fd = -1;
+    string m_path;
+    int m_peer = -1;
+    double m_take_ms = 0;
+
+    /* old process, between steps 1 and 2 */
+    int m_giving = -1;
+    pid_t m_child = -1;
+    uint64_t m_image_lsn = 0;
+    chrono::steady_clock::time_point m_started;
+
+    void prepare(int peer);
+    void finish(const handoff_state &st, bool prepared);
+    void abandon();
+    int catch_up(const string &wal_path, uint64_t &offset, uint64_t &lsn);
+};
+
+#endif
@@ -6,18 +6,41 @@
 #include <string>
 #include <stack>
 #include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include <mutex>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <pthread.h>
 #include "nlohmann/json.hpp"
+#include "wal.h"
+#include "id_index.h"
 
 using json = nlohmann::json;
 using namespace std;
 
+/*
+ * Fixed-size allocator behind Node's operator new/delete. Nodes are carved
+ * out of large slabs and recycled through a free list, and reserve() lets a
+ * bulk loader get room for a whole tree with a single allocation.
+ */
+class node_pool
+{
+public:
+    static void *alloc(size_t size);
+    static void release(void *p);
+    static void reserve(size_t count);
+};
+
 struct Node {
     string id;
     string name;
     string parent_id;
     Node *next; // sibling
     Node *child;
+    uint32_t snap = UINT32_MAX; // lazy loading: snapshot record of a subtree
+                                // that is faulted in on first use
     Node() :
         id(""), name(""), parent_id(""), next(nullptr), child(nullptr) {}
     Node(const string& x, const string& y) :
@@ -26,33 +49,197 @@ struct Node {
         id(x), name(y), parent_id(z), next(nullptr), child(nullptr)  {}
     Node(const string& x, const string& y, const string& z, Node *next) :
         id(x), name(y), parent_id(z), next(next), child(nullptr)  {}
+
+    static void *operator new(size_t size) { return node_pool::alloc(size); }
+    static void operator delete(void *p) { node_pool::release(p); }
+};
+
+/*
+ * Tree links as read and written while queries may walk the tree without
+ * the lock (--live-reads): a node is fully built before a release store
+ * makes it reachable.
+ */
+inline Node *load_link(Node *const &link) { return __atomic_load_n(&link, __ATOMIC_ACQUIRE); }
+inline void store_link(Node *&link, Node *n) { __atomic_store_n(&link, n, __ATOMIC_RELEASE); }
+
+/* How query() lays out each returned node. */
+enum class row_format {
+    object, // {"name": .., "id": .., "parent_id": ..}
+    array,  // [id, name, parent_id], used by the binary protocols
+    columnar // {"ids": [..], "names": [..], "parents": [..]}, where a parent
+             // already in the result is its row index, otherwise its ID
+};
+
+struct query_control;
+
+/* The state of one query() call, so that queries can run side by side. */
+struct query_context {
+    set<string> names;
+    set<string> ids;
+    int min_depth = 0;
+    int max_depth = INT_MAX;
+    row_format rows = row_format::object;
+    unordered_map<string, size_t> row_index;
+    json out = json::array();
+
+    /*
+     * Yield points. A query that let go of the tree lock walks again from
+     * its start, skipping ahead to seek: the names from there down to the
+     * node it had reached. Siblings are in name order, so everything before
+     * that path has been returned already.
+     */
+    query_control *ctl = nullptr;
+    unsigned visits = 0;
+    bool restart = false;
+    bool seeking = false;
+    vector<string> seek;
+    vector<Node *> path; // the nodes above the current one, below the start
+
+    /* true when the walk must unwind: cut off, or about to restart */
+    bool interrupted() { return ctl && (restart || poll()); }
+    bool poll();
 };
 
+/*
+ * Readers/writer lock around the tree. Queries share it; mutations and
+ * everything else that may change the tree hold it exclusively. Waiting
+ * writers go first, so a stream of queries cannot starve them. lock() and
+ * unlock() make it usable with lock_guard and unique_lock; shared_guard is
+ * the scoped guard for readers.
+ */
+class rw_mutex
+{
+public:
+    rw_mutex();
+    ~rw_mutex() { pthread_rwlock_destroy(&m_lock); }
+    rw_mutex(const rw_mutex &) = delete;
+    rw_mutex &operator=(const rw_mutex &) = delete;
+
+    void lock() {
+        m_writers.fetch_add(1, memory_order_relaxed);
+        pthread_rwlock_wrlock(&m_lock);
+        m_writers.fetch_sub(1, memory_order_relaxed);
+    }
+    void unlock() { pthread_rwlock_unlock(&m_lock); }
+    void lock_shared() { pthread_rwlock_rdlock(&m_lock); }
+    void unlock_shared() { pthread_rwlock_unlock(&m_lock); }
+    bool writers_waiting() const { return m_writers.load(memory_order_relaxed) > 0; }
+
+private:
+    pthread_rwlock_t m_lock;
+    atomic<int> m_writers{0};
+};
+
+class shared_guard
+{
+public:
+    explicit shared_guard(rw_mutex &m) : m_m(m) { m_m.lock_shared(); }
+    ~shared_guard() { m_m.unlock_shared(); }
+    shared_guard(const shared_guard &) = delete;
+    shared_guard &operator=(const shared_guard &) = delete;
+
+private:
+    rw_mutex &m_m;
+};
+
+/*
+ * The limits of one query: a deadline, a flag a cancel request sets, and,
+ * if the query holds the tree lock shared, that lock, so that the walk can
+ * step out of it when writers are waiting. They are checked every
+ * CHECK_EVERY nodes.
+ */
+struct query_control {
+    static const unsigned CHECK_EVERY = 256;
+    static const int SLICE_US = 1000; // the least time between two yields
+
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point::max();
+    atomic<bool> cancelled{false};
+    rw_mutex *yield_lock = nullptr;
+    chrono::steady_clock::time_point slice_start = chrono::steady_clock::now();
+    atomic<const char *> stopped{nullptr}; // why the query was cut off
+    atomic<uint64_t> yields{0};
+
+    bool slice_over() const {
+        return chrono::steady_clock::now() - slice_start >= chrono::microseconds(SLICE_US);
+    }
+};
+
+/*
+ * Append one node to a query result laid out as rows. row_index maps the IDs
+ * already returned to their row, for the columnar parent references.
+ */
+void query_row(json &out, row_format rows, unordered_map<string, size_t> &row_index,
+               const string &id, const string &name, const string &parent_id);
+
+class checkpointer;
+class cold_store;
+class log_shipper;
+class log_follower;
+class version_history;
+class mvcc_tree;
+class epoch_manager;
+class subtree_locks;
+class shard_engine;
+
 class hierarchy
 {
 public:
     json pass = json::parse(R"({"ok": true})");
     json fail = json::parse(R"({"ok": false})");
     Node *root = nullptr;
-    mutex m_mutex;
+    rw_mutex m_mutex;
+    write_ahead_log *m_wal = nullptr; // successful mutations are logged here
+    checkpointer *m_checkpoint = nullptr;
+    cold_store *m_lazy = nullptr; // subtrees left in the snapshot until touched
+    log_shipper *m_shipper = nullptr; // mutations are streamed to followers
+    log_follower *m_follower = nullptr;
+    bool m_read_only = false;     // a follower only answers queries
+    version_history *m_history = nullptr; // past versions for as_of queries
+    mvcc_tree *m_mvcc = nullptr;  // lock-free copy of the tree for queries
+    epoch_manager *m_epochs = nullptr; // retired nodes wait for lock-free queries
+    subtree_locks *m_locks = nullptr;  // writers lock only the nodes they touch
+    shard_engine *m_shards = nullptr;  // the tree, partitioned over shard threads
 
     hierarchy() {}
 
-    void add_node(string, string, string);
-    void delete_node(string);
-    void move_node(string, string);
-    void query(int, int, vector<string>&, vector<string>&, vector<string>&);
-    void preOrder(Node*, int);
+    bool add_node(string, string, string);
+    bool delete_node(string);
+    bool move_node(string, string);
+    json query(int, int, vector<string>&, vector<string>&, vector<string>&,
+               row_format rows = row_format::object, query_control *ctl = nullptr);
+    void preOrder(query_context &, Node*, const string &, int);
+    Node *seek(query_context &, Node *, const string &, int);
     void find_root_id_node(Node *, Node **, string, int&);
+    size_t query_cost(int, vector<string>&, size_t);
     void prn_node();
+    bool apply(wal_record);
+    bool apply_all(vector<wal_record> &, size_t &);
+    void log(wal_record &);
+    void log(vector<wal_record> &);
+    string parent_of(Node *);
+    void clear();
+
+    Node *find(const string &);
+    Node *find_child(Node *, const string &);
+    void link_child(Node *, Node *);
+    void unlink_child(Node *, Node *);
+    void expand(Node *);
+
+    id_index m_index; // ID -> node, every node in the tree
+
+    /* IDs added, deleted or moved since the last checkpoint */
+    bool m_track_dirty = false;
+    unordered_set<string> m_dirty;
+    void mark_dirty(const string &id) {
+        if (m_track_dirty) {
+            lock_guard<mutex> lk(m_dirty_lock);
+            m_dirty.insert(id);
+        }
+    }
 
 private:
-    std::set<string> m_names_set;
-    std::set<string> m_ids_set;
-    std::set<string> m_root_ids_set;
-    int m_max_depth;
-    int m_min_depth;
-    json m_j_arr;
+    mutex m_dirty_lock;
+    mutex m_log_lock;   // one LSN order for the log, followers and history
 };
 
 #endif
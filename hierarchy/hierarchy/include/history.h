@@ -0,0 +1,109 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <unordered_map>
+#include <cstdint>
+#include "nlohmann/json.hpp"
+#include "hierarchy.h"
+#include "wal.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+/*
+ * Past versions of the tree for query "as_of_version" / "as_of_time".
+ *
+ * Version v is the tree right after the v-th logged mutation (its lsn when
+ * there is a write-ahead log). Every version is kept in one shared structure
+ * of "fat" nodes: a node is recorded once, for as long as it exists, and
+ * each parent/child link carries the range of versions [from, to) it was
+ * valid for. A mutation therefore only closes and opens a link or two;
+ * nothing that did not change is copied.
+ *
+ * Versions older than window_sec, or the oldest ones while the structure
+ * uses more than max_bytes, are dropped: links and nodes no version still
+ * sees are freed as their version leaves the window. The tree as it stands
+ * is always retained, so max_bytes bounds the history on top of it.
+ */
+class version_history
+{
+public:
+    version_history(int window_sec, size_t max_bytes) :
+        m_window_ms(int64_t(window_sec) * 1000), m_max_bytes(max_bytes) {}
+    ~version_history();
+
+    /* start from the tree as it stands, as version `version` */
+    void init(hierarchy &h, uint64_t version);
+    /* a mutation that succeeded and was logged; called under the tree lock */
+    void record(const wal_record &rec);
+
+    /* newest version at or before unix time ms; false if none is retained */
+    bool version_at(int64_t time_ms, uint64_t &version);
+    bool retained(uint64_t version) const {
+        return version >= m_oldest && version <= m_version;
+    }
+    /* hierarchy::query() against a retained version */
+    json query(uint64_t version, int min_depth, int max_depth, vector<string> &names,
+               vector<string> &ids, vector<string> &root_ids, row_format rows,
+               query_control *ctl = nullptr);
+    json status();
+
+private:
+    static const uint64_t OPEN = UINT64_MAX;
+
+    struct node;
+    struct link {
+        node *other;        // the child in children, the parent in parents
+        uint64_t from;
+        uint64_t to;        // OPEN while the link exists
+    };
+    struct node {
+        string id;
+        string name;
+        uint64_t born;
+        uint64_t died = OPEN;
+        vector<link> children;
+        vector<link> parents;
+        size_t open_slot = 0;   // index of the open link in the parent's children
+        size_t expired_children = 0;
+        size_t expired_parents = 0;
+    };
+    /* a link or node that stops being visible once `version` is dropped */
+    struct expiry {
+        uint64_t version;
+        node *parent;       // nullptr for a root link
+        node *child;
+        bool died;          // child itself was deleted
+    };
+
+    int64_t m_window_ms;
+    size_t m_max_bytes;
+    uint64_t m_version = 0;
+    uint64_t m_oldest = 0;
+    unordered_map<string, vector<node *>> m_ids;    // every retained node with that ID
+    vector<link> m_roots;
+    size_t m_expired_roots = 0;
+    deque<pair<uint64_t, int64_t>> m_times;         // version, unix ms
+    deque<expiry> m_expiring;
+    size_t m_bytes = 0;
+    size_t m_nodes = 0;
+    size_t m_links = 0;
+
+    node *current(const string &id);
+    node *at(const string &id, uint64_t version);
+    void add(const string &id, const string &name, const string &parent_id);
+    void detach(node *n);
+    void attach(node *n, node *parent);
+    void prune(int64_t now_ms);
+    void compact(vector<link> &links, size_t &expired, bool children);
+
+    void pre_order(query_context &ctx, uint64_t version, node *n, const string &parent_id,
+                   int depth);
+    void children_at(node *n, uint64_t version, vector<node *> &out);
+};
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef ID_INDEX_H
+#define ID_INDEX_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include <cstdint>
+#include <cstdlib>
+
+using namespace std;
+
+struct Node;
+
+/*
+ * ID -> node index that can be read while it is being written.
+ *
+ * Open addressing with linear probing over one word per slot: the Node
+ * pointer, with the top 16 bits of the ID's hash packed above the 48 bits
+ * of address, so most mismatches are rejected without touching the node.
+ * The key is the node's own id. find() takes no lock and never waits.
+ * insert() and erase() lock one of a set of stripes chosen by the ID, so
+ * only writers of the same stripe wait for each other, and claim slots with
+ * compare-and-swap.
+ *
+ * Past half full (counting deleted slots) the table grows into one twice
+ * the size, but entries are moved MIGRATE_SLOTS slots per write rather
+ * than all at once, so no single insert pays for a rehash. During the move
+ * an entry is copied to the new table before its old slot is marked moved;
+ * readers search the old table first and then follow it to the new one.
+ * Old tables are kept until the index is destroyed, since a reader may
+ * still be probing one; being half the size of their successor each, they
+ * add up to less than the current table.
+ */
+class id_index
+{
+public:
+    id_index();
+    ~id_index();
+    id_index(const id_index &) = delete;
+    id_index &operator=(const id_index &) = delete;
+
+    Node *find(const string &id) const;
+    size_t count(const string &id) const { return find(id) ? 1 : 0; }
+    /* keyed by n->id; false if the ID is already present */
+    bool insert(Node *n);
+    bool erase(const string &id);
+    /* point n->id's entry at n instead, with no moment it is missing */
+    bool replace(Node *n);
+    size_t size() const { return m_size.load(memory_order_relaxed); }
+
+    /* writers only, with no other writer running */
+    void reserve(size_t n);
+    void clear();
+    void for_each(const function<void(Node *)> &fn);
+
+private:
+    static const uintptr_t EMPTY = 0;
+    static const uintptr_t DELETED = 1;
+    static const uintptr_t MOVED = 2;
+    static const size_t STRIPES = 32;
+    static const size_t MIGRATE_SLOTS = 64;    // moved per write while growing
+
+    struct table {
+        size_t mask;
+        unique_ptr<atomic<uintptr_t>[], void (*)(void *)> slots{nullptr, free};
+        atomic<size_t> used{0};             // slots ever claimed
+        atomic<table *> next{nullptr};      // set once the table is being replaced
+        explicit table(size_t capacity);
+    };
+
+    atomic<table *> m_cur;
+    atomic<table *> m_old{nullptr};         // being moved into m_cur
+    size_t m_moved = 0;                     // slots of m_old done
+    vector<unique_ptr<table>> m_tables;
+    mutex m_resize_lock;
+    mutex m_stripes[STRIPES];
+    atomic<size_t> m_size{0};
+
+    static size_t hash_id(const string &id) { return hash<string>()(id); }
+    static uintptr_t pack(Node *n, size_t h);
+    static Node *unpack(uintptr_t v) { return reinterpret_cast<Node *>(v & ((uintptr_t(1) << 48) - 1)); }
+
+    static atomic<uintptr_t> *find_in(table *t, const string &id, size_t h, uintptr_t &v);
+    static void insert_into(table *t, Node *n, size_t h);
+    void grow(size_t capacity);
+    void migrate(size_t slots);
+    void migrate_locked(size_t slots);
+};
+
+#endif
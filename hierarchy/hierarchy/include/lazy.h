@@ -0,0 +1,83 @@
+#ifndef LAZY_H
+#define LAZY_H
+
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <cstdint>
+#include "nlohmann/json.hpp"
+#include "hierarchy.h"
+#include "snapshot.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+/*
+ * Keeps the deep part of a snapshot on disk until it is needed.
+ *
+ * Only nodes above max_depth are built when the snapshot is opened. Every
+ * node at depth max_depth - 1 that has children becomes the root of a cold
+ * subtree: its Node carries the snapshot record in Node::snap and the whole
+ * subtree below it is built in one go (a contiguous range of the pre-order
+ * records) the first time something needs its children, i.e. a query
+ * descends into it, or add/move/delete/find touch it. IDs not in memory are
+ * looked up in the snapshot's sorted ID index.
+ *
+ * Loaded subtrees that were never modified are kept in LRU order and
+ * evicted back to disk by trim() once more than max_nodes cold nodes are
+ * resident. A modified subtree stays in memory for good, since the snapshot
+ * no longer describes it.
+ */
+class cold_store
+{
+public:
+    cold_store(int max_depth, size_t max_nodes);
+    ~cold_store();
+
+    int open(hierarchy &h, const string &path, uint64_t &wal_lsn);
+
+    /* fault in the subtree below n if it is on disk */
+    void load(hierarchy &h, Node *n);
+    Node *lookup(hierarchy &h, const string &id);
+    /* the children of n changed: pin the subtree that holds n */
+    void modified(hierarchy &h, Node *n);
+    /* n is about to be deleted */
+    void forget(Node *n);
+    void load_all(hierarchy &h);
+
+    /* evict least recently used clean subtrees; not while a request runs */
+    void trim(hierarchy &h);
+    json stats();
+    /* nodes in the tree, whether in memory or only in the snapshot */
+    size_t size(hierarchy &h) const { return h.m_index.size() + m_cold; }
+
+private:
+    struct unit {
+        bool loaded;
+        bool pinned;
+        size_t nodes;
+        list<Node *>::iterator lru;
+    };
+
+    int m_max_depth;
+    size_t m_max_nodes;
+    const char *m_base = nullptr;
+    size_t m_size = 0;
+    const snap_header *m_hdr = nullptr;
+    const snap_node *m_recs = nullptr;
+    const uint32_t *m_ids = nullptr;
+    const char *m_pool = nullptr;
+
+    unordered_map<Node *, unit> m_units;
+    list<Node *> m_lru;     // loaded, unpinned subtrees, most recent first
+    size_t m_resident = 0;  // nodes in loaded subtrees
+    size_t m_cold = 0;      // nodes in subtrees still on disk
+    uint64_t m_faults = 0;
+    uint64_t m_evictions = 0;
+
+    Node *make_node(uint32_t i, const string &parent_id);
+    uint32_t find_record(const string &id);
+    void evict(hierarchy &h, Node *n);
+};
+
+#endif
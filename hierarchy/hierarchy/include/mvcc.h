@@ -0,0 +1,176 @@
+#ifndef MVCC_H
+#define MVCC_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <cstdint>
+#include "nlohmann/json.hpp"
+#include "hierarchy.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+/*
+ * Immutable ordered map from string keys, as a treap whose priorities are
+ * hashes of the keys. insert() and erase() return a new map that shares all
+ * but O(log n) nodes with this one, which stays valid and unchanged.
+ */
+template <class V>
+class pmap
+{
+public:
+    const V *find(const string &key) const {
+        const node *n = m_root.get();
+        while (n) {
+            if (key < n->key)
+                n = n->l.get();
+            else if (n->key < key)
+                n = n->r.get();
+            else
+                return &n->val;
+        }
+        return nullptr;
+    }
+
+    pmap insert(const string &key, const V &val) const {
+        pmap m;
+        pair<ptr, ptr> lr = split(m_root, key);
+        m.m_root = merge(merge(lr.first, make_shared<const node>(key, val)), lr.second);
+        m.m_size = m_size + (find(key) ? 0 : 1);
+        return m;
+    }
+
+    pmap erase(const string &key) const {
+        if (!find(key))
+            return *this;
+        pmap m;
+        pair<ptr, ptr> lr = split(m_root, key);
+        m.m_root = merge(lr.first, lr.second);
+        m.m_size = m_size - 1;
+        return m;
+    }
+
+    /* in key order */
+    void for_each(const function<void(const V &)> &fn) const { walk(m_root.get(), fn); }
+    size_t size() const { return m_size; }
+
+private:
+    struct node;
+    typedef shared_ptr<const node> ptr;
+    struct node {
+        string key;
+        V val;
+        size_t prio;
+        ptr l;
+        ptr r;
+        node(const string &key, const V &val) :
+            key(key), val(val), prio(hash<string>()(key)) {}
+        node(const node &n, const ptr &l, const ptr &r) :
+            key(n.key), val(n.val), prio(n.prio), l(l), r(r) {}
+    };
+
+    ptr m_root;
+    size_t m_size = 0;
+
+    /* keys below and above key; key itself is dropped */
+    static pair<ptr, ptr> split(const ptr &t, const string &key) {
+        if (!t)
+            return pair<ptr, ptr>();
+        if (t->key < key) {
+            pair<ptr, ptr> s = split(t->r, key);
+            return make_pair(make_shared<const node>(*t, t->l, s.first), s.second);
+        }
+        if (key < t->key) {
+            pair<ptr, ptr> s = split(t->l, key);
+            return make_pair(s.first, make_shared<const node>(*t, s.second, t->r));
+        }
+        return make_pair(t->l, t->r);
+    }
+
+    /* every key of a is below every key of b */
+    static ptr merge(const ptr &a, const ptr &b) {
+        if (!a)
+            return b;
+        if (!b)
+            return a;
+        if (a->prio > b->prio)
+            return make_shared<const node>(*a, a->l, merge(a->r, b));
+        return make_shared<const node>(*b, merge(a, b->l), b->r);
+    }
+
+    static void walk(const node *n, const function<void(const V &)> &fn) {
+        if (n == nullptr)
+            return;
+        walk(n->l.get(), fn);
+        fn(n->val);
+        walk(n->r.get(), fn);
+    }
+};
+
+/*
+ * Multi-version copy of the tree that queries read without any lock.
+ *
+ * Each version is immutable: a node holds its children in a pmap by name,
+ * and a mutation copies only the path from the root down to the nodes it
+ * touches (plus O(log n) treap nodes per level), sharing everything else
+ * with the previous version. Writers, which hold the tree lock, build the
+ * next version and publish it with one atomic pointer store; a query takes
+ * whatever version is current when it starts and works on it to the end.
+ * Versions are reference counted, so one is freed as soon as it is neither
+ * current nor held by a running query.
+ */
+class mvcc_tree
+{
+public:
+    /* copy the tree as it stands; writers must be excluded */
+    void init(hierarchy &h);
+
+    /* called by the hierarchy after each successful mutation */
+    void add(const string &id, const string &name, const string &parent_id);
+    void remove(const string &id);
+    void move(const string &id, const string &new_parent_id);
+    void clear();
+
+    /* keep queries on the current version until release(), for transactions */
+    void hold() { m_held = true; }
+    void release();
+
+    /* hierarchy::query() against the current version, without locking */
+    json query(int min_depth, int max_depth, vector<string> &names, vector<string> &ids,
+               vector<string> &root_ids, row_format rows, query_control *ctl = nullptr);
+    json status();
+
+private:
+    struct node;
+    typedef shared_ptr<const node> node_ptr;
+    struct node {
+        string id;
+        string name;
+        pmap<node_ptr> children;
+    };
+    struct entry {
+        string name;
+        string parent_id;
+    };
+    struct version {
+        uint64_t number = 0;
+        node_ptr root;
+        pmap<entry> index;      // ID -> name and parent
+    };
+    typedef shared_ptr<const version> version_ptr;
+
+    version_ptr m_head;         // the writers' view
+    version_ptr m_published;    // only accessed with atomic_load/atomic_store
+    uint64_t m_number = 0;
+    bool m_held = false;
+
+    static bool path(const version &v, const string &id, vector<node_ptr> &out);
+    static node_ptr replace_path(const vector<node_ptr> &path, node_ptr leaf);
+    static node_ptr build(hierarchy &h, Node *n, pmap<entry> &index);
+    void publish(node_ptr root, const pmap<entry> &index);
+    void pre_order(query_context &ctx, const node *n, const string &parent_id, int depth);
+};
+
+#endif
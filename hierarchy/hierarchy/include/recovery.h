@@ -0,0 +1,84 @@
+#ifndef RECOVERY_H
+#define RECOVERY_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include "hierarchy.h"
+#include "wal.h"
+
+using namespace std;
+
+/*
+ * Replays a sequence of write-ahead log files (rotated segments, then the
+ * live log) with the decoding spread over several threads.
+ *
+ * start() maps the files and hands them to a scanner thread, which only
+ * follows the length prefixes and cuts the records into chunks, and to
+ * worker threads, which verify the checksums and decode the chunks. This
+ * can run while the caller is still loading a snapshot. apply() then
+ * applies the decoded chunks in log order on the calling thread, reporting
+ * progress and throughput on stderr.
+ *
+ * Applying stays sequential: every operation reads and updates the one ID
+ * index, and a move's cycle check walks ancestors that other operations may
+ * have moved, so log order is the only safe order. What runs in parallel is
+ * everything around it.
+ */
+class log_replayer
+{
+public:
+    /* threads 0 uses one per core */
+    explicit log_replayer(int threads = 0);
+    ~log_replayer();
+
+    void start(const vector<string> &paths);
+
+    /*
+     * Apply every record newer than lsn and advance lsn to the last one.
+     * Like write_ahead_log::replay, a torn or corrupt record ends its file.
+     * Returns -1 if a file exists but is not a log.
+     */
+    int apply(hierarchy &h, uint64_t &lsn);
+
+private:
+    struct mapped {
+        string path;
+        const char *data = nullptr;
+        size_t size = 0;
+        bool bad = false;   // exists but is not a log
+    };
+    struct chunk {
+        size_t file;
+        const char *begin;
+        const char *end;
+        vector<wal_record> recs;
+        bool corrupt = false;
+        bool decoded = false;
+    };
+
+    int m_threads;
+    vector<mapped> m_files;
+    vector<thread> m_workers;
+    thread m_scanner;
+
+    mutex m_lock;
+    condition_variable m_cv;
+    deque<unique_ptr<chunk>> m_chunks; // cut but not yet applied
+    size_t m_front = 0;                // sequence number of m_chunks.front()
+    size_t m_next_decode = 0;          // sequence number of the next chunk to decode
+    bool m_scanned = false;
+    bool m_stop = false;
+    uint64_t m_bytes = 0;
+
+    void scan();
+    void decode();
+    void finish();
+};
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <sys/types.h>
+#include "nlohmann/json.hpp"
+#include "hierarchy.h"
+#include "wal.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+/*
+ * Log shipping between processes on one host.
+ *
+ * The stream is a sequence of frames
+ *   u32 length | u8 type | u64 lsn | u64 time_us | payload
+ * where time_us is the primary's steady clock (shared by every process on
+ * the host) and the payload, if any, is a write_ahead_log record:
+ *   'S' start of a bootstrap, lsn = last record it includes
+ *   'B' one node of the bootstrap, in pre-order, as an add_node record
+ *   'R' a mutation applied on the primary
+ *   'H' heartbeat carrying the primary's last lsn
+ * Followers answer with u64 acknowledgements of the last lsn applied.
+ */
+static const uint8_t REPL_START = 'S';
+static const uint8_t REPL_BOOTSTRAP = 'B';
+static const uint8_t REPL_RECORD = 'R';
+static const uint8_t REPL_HEARTBEAT = 'H';
+
+uint64_t repl_now_us();
+
+/*
+ * Primary side: accepts followers on a Unix socket, sends each a bootstrap
+ * of the current tree, then every mutation as it is logged. ship() only
+ * appends to in-memory buffers and is called under the hierarchy lock; a
+ * separate thread does the socket I/O. A follower more than MAX_BACKLOG
+ * bytes behind is dropped and has to bootstrap again.
+ *
+ * The bootstrap is written by a fork()ed child from its copy-on-write
+ * image of the tree, so writers only pause for the fork; what they log
+ * meanwhile is queued and streamed once the child is done.
+ */
+class log_shipper
+{
+public:
+    static const size_t MAX_BACKLOG = 64 << 20;
+
+    explicit log_shipper(hierarchy &h) : m_h(h) {}
+    ~log_shipper();
+
+    int listen_on(const string &path);
+    void start();
+    void stop();
+
+    void ship(wal_record &rec);
+    json status();
+
+private:
+    struct follower {
+        int fd;
+        pid_t bootstrap = 0;    // child still writing the bootstrap
+        chrono::steady_clock::time_point since;
+        string out;
+        size_t out_off = 0;
+        string in;
+        uint64_t acked = 0;
+    };
+
+    hierarchy &m_h;
+    int m_listen_fd = -1;
+    int m_wake[2] = { -1, -1 };
+    string m_path;
+    thread m_thread;
+    atomic<bool> m_stop{false};
+
+    mutex m_lock;
+    vector<follower> m_followers;
+    uint64_t m_lsn = 0;     // last record shipped
+
+    void loop();
+    void accept_follower();
+    bool bootstrapping(follower &f, bool &dead);
+    void drop(follower &f);
+    void wake();
+};
+
+/*
+ * Follower side: keeps a read-only copy of the primary's tree. Reconnects
+ * (and bootstraps from scratch) whenever the primary goes away, serving the
+ * last state it had in the meantime.
+ */
+class log_follower
+{
+public:
+    explicit log_follower(hierarchy &h) : m_h(h) {}
+    ~log_follower() { stop(); }
+
+    void start(const string &path);
+    void stop();
+    json status();
+
+private:
+    hierarchy &m_h;
+    string m_path;
+    thread m_thread;
+    atomic<bool> m_stop{false};
+
+    mutex m_lock;
+    bool m_connected = false;
+    uint64_t m_applied = 0;         // last lsn applied
+    uint64_t m_primary_lsn = 0;     // newest lsn the primary announced
+    uint64_t m_lag_us = 0;          // primary append to local apply, last record
+    uint64_t m_bootstraps = 0;
+
+    void loop();
+    int session(int fd);
+};
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef REQUEST_H
+#define REQUEST_H
+
+#include "nlohmann/json.hpp"
+#include "hierarchy.h"
+#include "bulk_load.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+/*
+ * Decode one request object, run it against the hierarchy and return the
+ * response object. Callers are responsible for writing the response out.
+ * A query's deadline_ms counts from received, so that time spent queued or
+ * waiting for the lock counts against it.
+ */
+json jsonDecodeProcess(hierarchy &h, json &j,
+                       row_format rows = row_format::object,
+                       chrono::steady_clock::time_point received =
+                           chrono::steady_clock::now());
+
+/*
+ * Hold the caller until the mutations behind the responses produced so far
+ * are as durable as the write-ahead log policy asks. Transports call this
+ * once before releasing a round of responses, so one sync covers them all.
+ */
+void jsonCommitResponses(hierarchy &h);
+
+/* Rebuild the hierarchy from a write-ahead log, skipping lsn <= after_lsn. */
+int jsonRecoverLog(hierarchy &h, const string &path, uint64_t after_lsn = 0);
+
+/*
+ * Estimated cost of a request in nodes visited, for admission control.
+ * A query walks its start nodes' subtrees, counted down to max_depth but
+ * no further than cap; past that, or where they cannot be walked, the
+ * whole tree is the estimate. A batch or transaction costs the sum of its
+ * requests; anything else costs 1.
+ */
+uint64_t jsonEstimateCost(hierarchy &h, json &j, uint64_t cap);
+
+/* Summarise a bulk load; only the first 100 rejected rows are listed. */
+json jsonBulkLoadResult(const bulk_result &res);
+
+/* Format a response the way the stdin/stdout protocol prints it. */
+string jsonEncodeResponse(const json &resp);
+
+#endif
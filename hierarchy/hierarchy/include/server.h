@@ -0,0 +1,131 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <string>
+#include <map>
+#include <deque>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include "hierarchy.h"
+#include "codec.h"
+#include "handoff.h"
+
+using namespace std;
+
+struct Connection {
+    int fd;
+    string in;      // bytes received but not yet decoded
+    size_t in_scanned = 0; // of in, searched for a newline in vain
+    string out;     // encoded responses not yet written
+    size_t out_off; // bytes of out already written
+    bool reading;   // EPOLLIN is armed; not while busy or backlogged
+    bool closing;   // peer hung up, close once out is drained
+    bool busy = false;   // a query of this connection is on a query thread
+    uint64_t serial = 0; // tells a reused descriptor from the connection
+    /* where each read still in `in` ends, and when it came in */
+    deque<pair<size_t, chrono::steady_clock::time_point>> reads;
+    Connection() : fd(-1), out_off(0), reading(true), closing(false) {}
+    explicit Connection(int fd) :
+        fd(fd), out_off(0), reading(true), closing(false) {}
+};
+
+/*
+ * Request/response server on a Unix domain socket, speaking the wire format
+ * chosen at startup (line-delimited JSON by default).
+ *
+ * A single epoll loop multiplexes every client over one shared hierarchy.
+ * Requests of a connection are executed in the order they arrive and their
+ * responses are queued in the same order; a client that stops reading has
+ * its input paused once its backlog of responses passes MAX_PENDING_OUT.
+ *
+ * Queries run on QUERY_THREADS threads of their own, so that a long one
+ * holds up neither the other clients nor a cancel request aimed at it. The
+ * connection is not read from until the response is in, so what a client
+ * sends meanwhile waits in the socket rather than in the server.
+ *
+ * Admission: each query's cost is estimated first (jsonEstimateCost). Up
+ * to CHEAP_QUERY_COST nodes it joins the high-priority queue, which the
+ * query threads always serve first; costlier ones wait in a low-priority
+ * queue, bounded in requests and in summed cost, and run on at most
+ * QUERY_THREADS - 1 threads, so one is always left for cheap queries.
+ * Past either queue's budget a query is refused at once with an error.
+ * A batch or transaction is estimated as the sum of its requests and, past
+ * CHEAP_QUERY_COST, queued as a costly query. Other writes are O(1) and run
+ * on the loop itself, ahead of any queue.
+ */
+class socket_server
+{
+public:
+    static const size_t MAX_PENDING_OUT = 4 << 20;
+    static const size_t READ_CHUNK = 64 << 10;
+    static const int QUERY_THREADS = 4;
+    static const uint64_t CHEAP_QUERY_COST = 10000;
+    static const size_t MAX_CHEAP_QUEUED = 4096;
+    static const size_t MAX_COSTLY_QUEUED = 32;
+    static const uint64_t MAX_COSTLY_QUEUED_COST = 100000000;
+
+    explicit socket_server(hierarchy &h, wire_format fmt = wire_format::text) :
+        m_h(h), m_format(fmt) {}
+    ~socket_server();
+
+    int listen_on(const string &path);
+    /* serve a listening socket and clients taken over from a predecessor */
+    void adopt(handoff_state &st);
+    /* hand everything to a successor that connects to ho */
+    void set_handoff(handoff *ho) { m_handoff = ho; }
+    int run();
+    void stop() { m_stop = true; }
+
+private:
+    hierarchy &m_h;
+    wire_format m_format;
+    int m_listen_fd = -1;
+    int m_epoll_fd = -1;
+    string m_path;
+    atomic<bool> m_stop{false};
+    map<int, Connection> m_conns;
+    handoff *m_handoff = nullptr;
+    uint64_t m_serial = 0;
+
+    struct query_task {
+        int fd;
+        uint64_t serial;
+        uint64_t cost;
+        chrono::steady_clock::time_point received;
+        json req;
+        json resp;
+    };
+    vector<thread> m_query_threads;
+    mutex m_query_lock;
+    condition_variable m_query_cv;
+    deque<query_task> m_cheap;
+    deque<query_task> m_costly;
+    uint64_t m_costly_cost = 0;   // summed estimate of m_costly
+    int m_costly_running = 0;
+    uint64_t m_rejected = 0;
+    vector<query_task> m_answered;
+    bool m_query_stop = false;
+    int m_answered_fd = -1; // eventfd, signalled as queries finish
+    size_t m_running = 0;   // queries handed out and not yet answered
+
+    void query_loop();
+    bool start_query(Connection &c, json &j, uint64_t cost,
+                     chrono::steady_clock::time_point received);
+    json scheduler_status();
+    void finish_queries();
+    void stop_queries();
+
+    void accept_clients();
+    void give_away();
+    void handle_read(Connection &c);
+    void handle_write(Connection &c);
+    void process_input(Connection &c);
+    void update_events(Connection &c);
+    void close_conn(int fd);
+};
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef SHARDS_H
+#define SHARDS_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cstdint>
+#include "nlohmann/json.hpp"
+#include "hierarchy.h"
+#include "wal.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+/*
+ * The tree partitioned over shard threads, one per core (--shards).
+ *
+ * Every shard has a hierarchy of its own, with its own ID index, and only
+ * the shard's thread touches it: requests are handed to the owning shard
+ * as tasks and run there one after another, without the tree lock. A shard
+ * owns whole subtrees below the root, each placed by the hash of its name,
+ * so top-level siblings that share a name share a shard and the sibling
+ * check stays local. The root is replicated in every shard.
+ *
+ * A routing table maps each ID to its shard. Adds reserve the ID there
+ * first, so IDs stay unique across shards. A task finding that its node has
+ * left the shard in the meantime reports so, and is routed again.
+ *
+ * Moves across shards, and adding or deleting the root, park the shards
+ * involved (their threads wait in a task, taken in ascending shard order)
+ * and then change both trees at once: the subtree is rebuilt under its new
+ * parent in the target shard, deleted in the source, and its routes moved
+ * over. A query without root_ids runs on every shard in parallel; each
+ * returns its top-level subtrees in pre-order, which are merged by name.
+ */
+class shard_engine
+{
+public:
+    explicit shard_engine(int shards);
+    ~shard_engine();
+    shard_engine(const shard_engine &) = delete;
+    shard_engine &operator=(const shard_engine &) = delete;
+
+    /* take over the tree of h, which is left empty, and start the threads */
+    void start(hierarchy &h);
+    void stop();
+
+    /* a mutation, logged to the write-ahead log of h if it succeeded */
+    bool apply(const wal_record &rec);
+    json query(int min_depth, int max_depth, vector<string> &names, vector<string> &ids,
+               vector<string> &root_ids, row_format rows, query_control *ctl = nullptr);
+    json status();
+    /* nodes over all shards, the root once */
+    size_t size();
+
+private:
+    static const uint32_t NONE = UINT32_MAX;    // no such ID
+    static const uint32_t ALL = UINT32_MAX - 1; // the root, in every shard
+    static const size_t ROUTE_STRIPES = 64;
+
+    enum class result { ok, failed, moved };
+
+    struct shard {
+        hierarchy h;
+        thread worker;
+        mutex lock;
+        condition_variable wake;
+        deque<function<void()>> tasks;
+        bool stop = false;
+        atomic<uint64_t> ops{0};
+    };
+
+    struct route_stripe {
+        mutex lock;
+        unordered_map<string, uint32_t> shards;
+    };
+
+    /* rows of one top-level subtree of a shard, for the merge */
+    struct segment {
+        string name;
+        size_t shard;
+        size_t begin;
+        size_t end;
+    };
+
+    /* what one shard contributes to a query that spans them all */
+    struct partial {
+        query_context ctx;
+        vector<segment> segs;
+        bool has_root = false;
+        string root_id;
+        string root_name;
+    };
+
+    vector<unique_ptr<shard>> m_shards;
+    route_stripe m_routes[ROUTE_STRIPES];
+    atomic<uint64_t> m_handoffs{0};
+    atomic<uint64_t> m_retries{0};
+
+    route_stripe &routes(const string &id);
+    uint32_t route(const string &id);
+    bool reserve(const string &id, uint32_t s);
+    void set_route(const string &id, uint32_t s);
+    void drop_route(const string &id, uint32_t s);
+    uint32_t shard_for_name(const string &name) const;
+
+    void run(size_t s);
+    void post(size_t s, function<void()> task);
+    void call(size_t s, const function<void(hierarchy &)> &fn);
+    void call_all(const function<void(size_t, hierarchy &)> &fn);
+
+    struct parking;
+    void park(parking &p, vector<size_t> shards);
+    void release(parking &p);
+
+    void copy_subtree(Node *n, const string &parent_id, hierarchy &to, uint32_t s);
+    bool add_node(const wal_record &rec);
+    bool delete_node(const wal_record &rec);
+    bool move_node(const wal_record &rec);
+    bool add_root(const wal_record &rec);
+    bool delete_root(const wal_record &rec);
+    result handoff(const wal_record &rec, uint32_t from, uint32_t to);
+
+    void top_level(hierarchy &h, size_t s, partial &part);
+    bool gather(query_context &out, bool with_root);
+};
+
+#endif
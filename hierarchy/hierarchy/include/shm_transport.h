@@ -0,0 +1,150 @@
+#ifndef SHM_TRANSPORT_H
+#define SHM_TRANSPORT_H
+
+#include <string>
+#include <atomic>
+#include <cstdint>
+#include "hierarchy.h"
+#include "codec.h"
+
+using namespace std;
+
+/*
+ * Single-producer/single-consumer byte ring living in shared memory.
+ *
+ * head and tail are free-running 32-bit byte counters; the ring holds
+ * head - tail bytes. A side that finds the ring empty (consumer) or full
+ * (producer) spins for a while, then raises its *_waiting flag and sleeps
+ * on the counter the other side advances with FUTEX_WAIT. The other side
+ * only issues FUTEX_WAKE when it sees that flag, so the fast path is a
+ * plain memcpy plus a release store.
+ */
+struct shm_ring {
+    alignas(64) atomic<uint32_t> head;
+    atomic<uint32_t> consumer_waiting;
+    alignas(64) atomic<uint32_t> tail;
+    atomic<uint32_t> producer_waiting;
+};
+
+/*
+ * A client claims the channel by swapping its pid into attached, then asks
+ * for a session by bumping session and waits until the server, which owns
+ * the rings, has emptied them and set ready to that session. Neither side
+ * touches the rings in between, so nothing of an earlier client survives.
+ * The server ends a session it cannot continue (dead client, broken
+ * framing) by clearing attached and ready.
+ */
+struct shm_layout {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;      // bytes per ring, a power of two
+    uint32_t format;        // wire_format of the payloads
+    atomic<uint32_t> attached; // pid of the client, 0 when free
+    atomic<uint32_t> closed;
+    atomic<uint32_t> session;  // last session a client asked for
+    atomic<uint32_t> ready;    // session the rings were reset for
+    uint32_t server_pid;
+    shm_ring req;           // client -> hierarchy
+    shm_ring resp;          // hierarchy -> client
+    /* req data, then resp data, capacity bytes each */
+};
+
+/*
+ * One end of a shared-memory channel. Every message is a 4-byte length
+ * followed by a payload in the channel's wire format; messages larger than
+ * the ring are streamed through it in pieces, up to MAX_FRAME_SIZE.
+ *
+ * Once a message has started, a read or write waits only as long as the
+ * peer process is alive and the session is current.
+ */
+class shm_endpoint
+{
+public:
+    static const uint32_t SHM_MAGIC = 0x68736d31; // "hsm1"
+    static const uint32_t SHM_VERSION = 2;
+    static const uint32_t DEFAULT_CAPACITY = 4 << 20;
+    static const int DEFAULT_SPIN = 4000;
+    static const int PEER_CHECK_MS = 200;
+
+    shm_endpoint() {}
+    ~shm_endpoint();
+
+    /* server side: create and initialise the segment */
+    int create(const string &name, wire_format fmt, uint32_t capacity = DEFAULT_CAPACITY);
+    /* client side: map an existing segment, claim it and start a session */
+    int attach(const string &name);
+
+    /*
+     * Server side: reset the rings for a client that asked for a session.
+     * False, after waiting up to timeout_ms, while there is none to serve.
+     */
+    bool accept_session(int timeout_ms);
+    /* server side: free the channel of a client that died or broke framing */
+    void drop_client(bool only_if_dead);
+
+    /* busy-poll never sleeps; otherwise spin this many rounds first */
+    void set_spin(bool busy_poll, int spin = DEFAULT_SPIN) {
+        m_busy_poll = busy_poll;
+        m_spin = spin;
+    }
+
+    /* Returns false on timeout (0 waits forever) or when the peer closed. */
+    bool recv(string &payload, int timeout_ms = 0);
+    bool send(const char *data, size_t len);
+
+    wire_format format() const { return wire_format(m_layout->format); }
+    void close_channel();
+
+private:
+    shm_layout *m_layout = nullptr;
+    size_t m_map_size = 0;
+    bool m_owner = false;
+    bool m_busy_poll = false;
+    int m_spin = DEFAULT_SPIN;
+    string m_name;
+    shm_ring *m_in = nullptr;
+    shm_ring *m_out = nullptr;
+    char *m_in_data = nullptr;
+    char *m_out_data = nullptr;
+    uint32_t m_session = 0;
+
+    int map_segment(int fd, size_t size);
+    bool stale() const;
+    bool peer_alive() const;
+    bool wait_change(atomic<uint32_t> *word, uint32_t seen, atomic<uint32_t> *waiting,
+                     int timeout_ms);
+    bool read_bytes(char *dst, size_t len, int timeout_ms);
+    bool write_bytes(const char *src, size_t len);
+};
+
+/* Serve one co-located client at a time over a shared-memory channel. */
+class shm_server
+{
+public:
+    shm_server(hierarchy &h, wire_format fmt, bool busy_poll) :
+        m_h(h), m_format(fmt), m_busy_poll(busy_poll) {}
+
+    int create(const string &name);
+    int run();
+    /* also cuts short a read or write that is waiting on the client */
+    void stop() {
+        m_stop = true;
+        m_ep.close_channel();
+    }
+
+private:
+    hierarchy &m_h;
+    wire_format m_format;
+    bool m_busy_poll;
+    atomic<bool> m_stop{false};
+    shm_endpoint m_ep;
+};
+
+/*
+ * Round-trip latency benchmark for add/move/delete as a shm client. Its
+ * nodes hang below the tree's root, or make up the tree if it is empty,
+ * and are deleted again; any request that fails stops it with an error.
+ */
+int shm_bench(const string &name, int count, bool busy_poll);
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <string>
+#include <cstdint>
+#include <chrono>
+#include "nlohmann/json.hpp"
+#include "hierarchy.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+/*
+ * Position-independent snapshot layout. Every reference is a file offset or
+ * a node index, so a mapping can be used wherever it lands.
+ *
+ *   snap_header
+ *   snap_node[node_count]   pre-order; siblings are already in name order
+ *   uint32_t[node_count]    ID index: node indexes sorted by ID
+ *   string pool             IDs and names, not terminated
+ */
+static const uint32_t SNAP_MAGIC = 0x504e5348; // "HSNP"
+static const uint32_t SNAP_VERSION = 1;
+static const uint32_t SNAP_NONE = 0xffffffffu;
+
+struct snap_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t node_count;
+    uint64_t wal_lsn;       // last write-ahead log record included
+    uint64_t nodes_off;
+    uint64_t index_off;
+    uint64_t pool_off;
+    uint64_t pool_size;
+    uint32_t root;          // SNAP_NONE for an empty tree
+    uint32_t header_crc;    // crc32 of the header with this field zeroed
+};
+
+struct snap_node {
+    uint64_t id_off;        // relative to pool_off
+    uint64_t name_off;
+    uint32_t id_len;
+    uint32_t name_len;
+    uint32_t parent;        // node indexes, SNAP_NONE when absent
+    uint32_t first_child;
+    uint32_t next_sibling;
+    uint32_t depth;
+};
+
+/*
+ * write() that keeps to an average of bytes_per_sec (0 = unlimited) by
+ * sleeping between 256 KiB chunks, so background writers leave disk
+ * bandwidth to the write-ahead log.
+ */
+class io_throttle
+{
+public:
+    explicit io_throttle(uint64_t bytes_per_sec = 0);
+    bool write(int fd, const void *data, size_t len);
+
+private:
+    uint64_t m_rate;
+    uint64_t m_written = 0;
+    chrono::steady_clock::time_point m_start;
+};
+
+/*
+ * Write the tree to path (through a temporary file and rename). The caller
+ * must keep the tree still for the duration, i.e. hold h.m_mutex.
+ */
+int snapshot_write(hierarchy &h, const string &path, uint64_t wal_lsn,
+                   uint64_t bytes_per_sec = 0);
+/* the same image written at the current offset of fd, without syncing */
+int snapshot_write_fd(hierarchy &h, int fd, uint64_t wal_lsn, uint64_t bytes_per_sec = 0);
+
+/*
+ * Load a snapshot into an empty hierarchy. The file is mmap'ed and every
+ * Node comes out of one reserved slab, linked straight from the stored
+ * indexes without searching or sorting. With h.m_lazy set the cold store
+ * maps it instead and only the upper levels are built.
+ */
+int snapshot_load(hierarchy &h, const string &path, uint64_t &wal_lsn);
+
+/* load from an open file such as a memfd, always fully */
+int snapshot_load_fd(hierarchy &h, int fd, uint64_t &wal_lsn);
+
+/* mmap path read-only and check its header; base/size are for munmap() */
+int snapshot_map(const string &path, const char *&base, size_t &size);
+int snapshot_map_fd(int fd, const string &path, const char *&base, size_t &size);
+
+/*
+ * Start a copy-on-write background snapshot. Must be called with
+ * h.m_mutex held; the lock is only needed across fork(). The child writes
+ * the frozen image and exits while the parent keeps serving. Returns -1 if
+ * a snapshot is already running or the fork failed; otherwise fills in
+ * the pid and how long the caller was paused.
+ */
+int snapshot_start(hierarchy &h, const string &path, uint64_t wal_lsn, json &resp,
+                   uint64_t bytes_per_sec = 0);
+
+/*
+ * State of the last background snapshot: running, path, and once done
+ * duration_ms, pages_copied (parent minor faults while the child ran, an
+ * upper bound on copy-on-write copies) and rss_overhead_kb (memory private
+ * to the child when it finished: pages copied plus its own buffers).
+ */
+json snapshot_status();
+
+/* Block until the running background snapshot, if any, has finished. */
+bool snapshot_wait();
+
+#endif
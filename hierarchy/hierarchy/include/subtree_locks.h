@@ -0,0 +1,72 @@
+#ifndef SUBTREE_LOCKS_H
+#define SUBTREE_LOCKS_H
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include "nlohmann/json.hpp"
+#include "hierarchy.h"
+#include "wal.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+/*
+ * Per-node locking for writers (--subtree-locks), so that mutations of
+ * disjoint subtrees run in parallel.
+ *
+ * Writers hold the tree lock shared and, below it, lock only the nodes
+ * they touch, in one of STRIPES readers/writer locks chosen by node ID:
+ *   add_node     the new ID and the parent, exclusively
+ *   delete_node  the node and its parent, exclusively
+ *   move_node    the node, its old and its new parent exclusively, and
+ *                every ancestor of the new parent shared, so that no
+ *                ancestor can move while the cycle check runs
+ * Adding or deleting the root also locks the root pointer. A lock set is
+ * worked out first from a snapshot of the parent links, then taken in
+ * ascending stripe order, which makes it deadlock free; if the links
+ * changed in between, it is released and worked out again.
+ *
+ * The mutation is logged before its locks are let go, so the write-ahead
+ * log orders every pair of conflicting mutations the way they happened.
+ * Nodes are retired through epochs, as with --live-reads, and queries walk
+ * the tree without locking; move_node links a copy of the node rather than
+ * rewriting it, and parent_id is read under the node's stripe.
+ */
+class subtree_locks
+{
+public:
+    static const size_t STRIPES = 4096;
+
+    explicit subtree_locks(hierarchy &h) : m_h(h) {}
+
+    /* apply a mutation and log it, locking just the nodes involved */
+    bool apply(wal_record &rec, bool logged = true);
+    /* n->parent_id, safe against a concurrent move of n */
+    string parent_of(Node *n);
+    json status();
+
+private:
+    struct want {
+        size_t stripe;
+        bool exclusive;
+    };
+
+    static const size_t ROOT = STRIPES;     // the root pointer
+
+    hierarchy &m_h;
+    rw_mutex m_stripes[STRIPES + 1];
+    atomic<uint64_t> m_ops{0};
+    atomic<uint64_t> m_retries{0};
+
+    static size_t stripe(const string &id) { return hash<string>()(id) % STRIPES; }
+    void lock(vector<want> &set);
+    void unlock(const vector<want> &set);
+
+    bool lock_add(const wal_record &rec, vector<want> &set);
+    bool lock_delete(const wal_record &rec, vector<want> &set);
+    bool lock_move(const wal_record &rec, vector<want> &set);
+};
+
+#endif
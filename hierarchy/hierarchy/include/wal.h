@@ -0,0 +1,135 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <string>
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <vector>
+
+using namespace std;
+
+enum class wal_op : uint8_t {
+    add_node = 1,
+    delete_node = 2,
+    move_node = 3
+};
+
+/* One successful mutation; parent_id is the new parent for move_node. */
+struct wal_record {
+    wal_op op;
+    uint64_t lsn;
+    string id;
+    string name;
+    string parent_id;
+    wal_record() : op(wal_op::add_node), lsn(0) {}
+    wal_record(wal_op op, const string &id, const string &name, const string &parent_id) :
+        op(op), lsn(0), id(id), name(name), parent_id(parent_id) {}
+};
+
+/*
+ * When a logged mutation counts as durable.
+ *
+ * per_op:   the response is held back until the record has been fsync'ed;
+ *           records appended while a sync is in flight share the next one.
+ * interval: the log is written and fsync'ed every interval_ms.
+ * os:       records are written as soon as possible and left to the page
+ *           cache.
+ */
+enum class wal_sync {
+    per_op,
+    interval,
+    os
+};
+
+uint32_t wal_crc32(const void *data, size_t len, uint32_t crc = 0);
+
+/* fsync the directory holding path, making a rename in it durable */
+void wal_sync_dir(const string &path);
+
+/*
+ * Append-only log of successful add/delete/move operations.
+ *
+ * File layout: an 8-byte header ("HWAL" + version), then records of
+ *   u32 body length | u32 crc32(body) | body
+ * with body = u8 op | varint lsn | varint-prefixed id, name and parent_id.
+ *
+ * append() only encodes into a memory buffer and is meant to be called
+ * under the hierarchy lock, so log order is apply order. A background
+ * thread writes and syncs whatever has accumulated (group commit).
+ */
+class write_ahead_log
+{
+public:
+    static const uint32_t WAL_MAGIC = 0x4c415748; // "HWAL"
+    static const uint32_t WAL_VERSION = 1;
+
+    write_ahead_log() {}
+    ~write_ahead_log() { close(); }
+
+    /* next_lsn continues after min_lsn even if the file holds fewer records */
+    int open(const string &path, wal_sync policy, int interval_ms, uint64_t min_lsn = 0);
+    void close();
+
+    uint64_t append(wal_record &rec);
+    /* records of one transaction, back to back so they are written together */
+    void append(vector<wal_record> &recs);
+    /* Block until everything appended so far satisfies the sync policy. */
+    void commit();
+    void wait_durable(uint64_t lsn);
+
+    uint64_t last_lsn();
+    wal_sync policy() const { return m_policy; }
+    const string &path() const { return m_path; }
+
+    /*
+     * Make everything appended so far durable, move the file to seg_path
+     * and continue in a fresh, empty log at the original path. Called under
+     * the hierarchy lock, so the segment ends exactly at last_lsn().
+     */
+    int rotate(const string &seg_path);
+
+    /*
+     * Read every intact record of path in order. Stops at the first torn
+     * or corrupt record; valid_end is the offset just past the last good
+     * one. Returns -1 if the file exists but is not a log, 0 otherwise.
+     */
+    static int replay(const string &path, const function<void(const wal_record &)> &fn,
+                      uint64_t &last_lsn, uint64_t &valid_end);
+
+    /*
+     * Write out and sync everything appended so far and return the log's
+     * descriptor, positioned at its end, for a successor process to adopt.
+     * Called under the hierarchy lock; the log stays usable.
+     */
+    int quiesce();
+    /* continue the log open on fd, as handed over by quiesce() */
+    int adopt(int fd, const string &path, wal_sync policy, int interval_ms, uint64_t last_lsn);
+
+    static void encode(const wal_record &rec, string &out);
+    /* check and decode one record at p; len is 0 if it is torn or corrupt */
+    static bool decode(const char *p, const char *end, wal_record &rec, size_t &len);
+    static void encode_header(string &out);
+
+private:
+    int m_fd = -1;
+    string m_path;
+    wal_sync m_policy = wal_sync::per_op;
+    int m_interval_ms = 10;
+    mutex m_lock;
+    condition_variable m_flush_cv;
+    condition_variable m_durable_cv;
+    thread m_flusher;
+    bool m_stop = false;
+    bool m_writing = false;
+    string m_buf;
+    string m_flushing;
+    uint64_t m_next_lsn = 1;
+    uint64_t m_durable_lsn = 0;
+
+    void flush_loop();
+};
+
+#endif
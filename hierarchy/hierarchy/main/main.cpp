@@ -3,63 +3,38 @@
 #include <string>
 #include <stack>
 #include <thread>
+#include <cstdlib>
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
 #include "nlohmann/json.hpp"
 #include "hierarchy.h"
+#include "request.h"
+#include "batch.h"
+#include "server.h"
+#include "codec.h"
+#include "shm_transport.h"
+#include "snapshot.h"
+#include "bench.h"
+#include "bulk_load.h"
+#include "checkpoint.h"
+#include "recovery.h"
+#include "lazy.h"
+#include "replication.h"
+#include "handoff.h"
+#include "history.h"
+#include "mvcc.h"
+#include "subtree_locks.h"
+#include "shards.h"
+#include "epoch.h"
 
 using json = nlohmann::json;
 using namespace std;
 
-void jsonDecodeProcess(hierarchy &h, json j) {
-    h.m_mutex.lock();
-    json::iterator it = j.begin();
-    string input_fun = it.key();
-    string id;
-    string name;
-    string parent_id;
-    string new_parent_id;
-    int min_depth = 0;
-    int max_depth = INT_MAX;
-    vector<string> names;
-    vector<string> ids;
-    vector<string> root_ids;
-
-    if (input_fun == "add_node") {
-        if (nullptr != j[input_fun]["id"])
-            id = j[input_fun]["id"];
-        if (nullptr != j[input_fun]["name"])
-            name = j[input_fun]["name"];
-        if (nullptr == j[input_fun]["parent_id"]) {
-            return h.add_node(name, id, "");
-        } else {
-            parent_id = j[input_fun]["parent_id"];
-            h.add_node(name, id, parent_id);
-        }
-    } else if (input_fun == "delete_node") {
-        if (nullptr != j[input_fun]["id"])
-            id = j[input_fun]["id"];
-        h.delete_node(id);
-    } else if (input_fun == "move_node") {
-        if (nullptr != j[input_fun]["id"])
-            id = j[input_fun]["id"];
-        if (nullptr != j[input_fun]["new_parent_id"])
-            new_parent_id = j[input_fun]["new_parent_id"];
-        h.move_node(id, new_parent_id);
-    } else if (input_fun == "query") {
-        if (j[input_fun]["min_depth"] != nullptr)
-            min_depth = j[input_fun]["min_depth"];
-        if (j[input_fun]["max_depth"] != nullptr)
-            max_depth = j[input_fun]["max_depth"];
-        if (j[input_fun]["names"] != nullptr)
-            j[input_fun].at("names").get_to(names);
-        if (j[input_fun]["ids"] != nullptr)
-            j[input_fun].at("ids").get_to(ids);
-        if (j[input_fun]["root_ids"] != nullptr)
-            j[input_fun].at("root_ids").get_to(root_ids);
-        h.query(min_depth, max_depth, names, ids, root_ids);
-    } else {
-        std::cout << h.fail << std::endl;
-    }
-    h.m_mutex.unlock();
+static void jsonProcessPrint(hierarchy &h, json &j) {
+    json resp = jsonDecodeProcess(h, j);
+    jsonCommitResponses(h);
+    std::cout << jsonEncodeResponse(resp) << std::endl;
 }
 
 void hierarchy_test_self() {
@@ -93,74 +68,74 @@ void hierarchy_test_self() {
 
     /* test add_node */
     cout << j0 << endl;
-    jsonDecodeProcess(h, j0);
+    jsonProcessPrint(h, j0);
     h.prn_node();
     cout << j0 << endl;
-    jsonDecodeProcess(h, j0); // No second root
+    jsonProcessPrint(h, j0); // No second root
     h.prn_node();
     cout << j1 << endl;
-    jsonDecodeProcess(h, j1);
+    jsonProcessPrint(h, j1);
     h.prn_node();
     cout << j2 << endl;
-    jsonDecodeProcess(h, j2); // sibling can not have same name
+    jsonProcessPrint(h, j2); // sibling can not have same name
     h.prn_node();
     cout << j3 << endl;
-    jsonDecodeProcess(h, j3); // Add a child node to nonexistent parent.
+    jsonProcessPrint(h, j3); // Add a child node to nonexistent parent.
     h.prn_node();
     cout << j4 << endl;
-    jsonDecodeProcess(h, j4);
+    jsonProcessPrint(h, j4);
     h.prn_node();
     cout << j5 << endl;
-    jsonDecodeProcess(h, j5);
+    jsonProcessPrint(h, j5);
     h.prn_node();
     cout << j6 << endl;
-    jsonDecodeProcess(h, j6);
+    jsonProcessPrint(h, j6);
     h.prn_node();
 
     /* test delete_node */
     cout << j7 << endl;
-    jsonDecodeProcess(h, j7); // delete middle child
+    jsonProcessPrint(h, j7); // delete middle child
     h.prn_node();
     cout << j8 << endl;
-    jsonDecodeProcess(h, j8); // delete first child
+    jsonProcessPrint(h, j8); // delete first child
     h.prn_node();
     cout << j8 << endl;
-    jsonDecodeProcess(h, j8); // delete non-exist
+    jsonProcessPrint(h, j8); // delete non-exist
     h.prn_node();
     cout << j9 << endl;
-    jsonDecodeProcess(h, j9); // delete node who have child
+    jsonProcessPrint(h, j9); // delete node who have child
     h.prn_node();
 
     /* test move_node */
     cout << j10 << endl;
-    jsonDecodeProcess(h, j10);
+    jsonProcessPrint(h, j10);
     h.prn_node();
     cout << j11 << endl;
-    jsonDecodeProcess(h, j11);
+    jsonProcessPrint(h, j11);
     h.prn_node();
     cout << j12 << endl;
-    jsonDecodeProcess(h, j12);
+    jsonProcessPrint(h, j12);
     h.prn_node();
     cout << j13 << endl;
-    jsonDecodeProcess(h, j13); // cycle test
+    jsonProcessPrint(h, j13); // cycle test
     h.prn_node();
     cout << j14 << endl;
-    jsonDecodeProcess(h, j14); // same name test
+    jsonProcessPrint(h, j14); // same name test
     h.prn_node();
     cout << j15 << endl;
-    jsonDecodeProcess(h, j15); // non-exist parent id
+    jsonProcessPrint(h, j15); // non-exist parent id
     h.prn_node();
 
     /* test query */
     cout << j16 << endl;
-    jsonDecodeProcess(h, j16);
+    jsonProcessPrint(h, j16);
     cout << j17 << endl;
-    jsonDecodeProcess(h, j17);
+    jsonProcessPrint(h, j17);
     cout << j18 << endl;
-    jsonDecodeProcess(h, j18); // root_ids with min_depth
+    jsonProcessPrint(h, j18); // root_ids with min_depth
 
     cout << j19 << endl; // add node no id
-    jsonDecodeProcess(h, j19);
+    jsonProcessPrint(h, j19);
     h.prn_node();
 
 #if 0
@@ -176,21 +151,464 @@ void hierarchy_test_self() {
 
 }
 
-void hierarchy_test() {
+/*
+ * Wait until stdin is readable. A successor connecting to the handoff socket
+ * in the meantime is given everything, with in as the unprocessed input.
+ */
+static void wait_stdin(handoff *ho, wire_format fmt, const string &in) {
+    if (ho == nullptr)
+        return;
+    while (true) {
+        struct pollfd p[2] = { { STDIN_FILENO, POLLIN, 0 }, { ho->fd(), POLLIN, 0 } };
+        if (poll(p, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        if (p[1].revents & POLLIN) {
+            handoff_state st;
+            st.fmt = fmt;
+            st.stdin_in = in;
+            ho->give(st);
+        }
+        if (p[0].revents)
+            return;
+    }
+}
 
-    hierarchy h;
-    while (cin){
-        json j;
-        std::cin >> j;
-        jsonDecodeProcess(h, j);
+static void process_line(hierarchy &h, const string &line) {
+    if (line.empty())
+        return;
+    json j = json::parse(line, nullptr, false);
+    if (j.is_discarded()) {
+        std::cout << h.fail << std::endl;
+        return;
+    }
+    jsonProcessPrint(h, j);
+}
+
+void hierarchy_test(hierarchy &h, handoff *ho, string in) {
+
+    char buf[64 << 10];
+    while (true) {
+        size_t start = 0;
+        size_t nl;
+        while ((nl = in.find('\n', start)) != string::npos) {
+            process_line(h, in.substr(start, nl - start));
+            start = nl + 1;
+        }
+        in.erase(0, start);
+
+        wait_stdin(ho, wire_format::text, in);
+        ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        in.append(buf, n);
     }
+    process_line(h, in);
 }
 
-int main()
+/* stdin/stdout loop for the length-prefixed binary protocols */
+void hierarchy_test_binary(hierarchy &h, wire_format fmt, handoff *ho, string in) {
+
+    string out;
+    char buf[64 << 10];
+    while (true) {
+        size_t start = 0;
+        while (start < in.size()) {
+            json j;
+            size_t consumed;
+            int rc = decode_request(in.data() + start, in.size() - start, fmt, j, consumed);
+            if (rc < 0) {
+                cerr << "oversized frame, closing" << endl;
+                return;
+            }
+            if (rc == 0)
+                break;
+            start += consumed;
+            json resp = j.is_discarded() ? h.fail :
+                jsonDecodeProcess(h, j, wire_row_format(fmt));
+            encode_response(resp, fmt, out);
+        }
+        in.erase(0, start);
+        jsonCommitResponses(h);
+
+        size_t off = 0;
+        while (off < out.size()) {
+            ssize_t w = write(STDOUT_FILENO, out.data() + off, out.size() - off);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w <= 0)
+                return;
+            off += w;
+        }
+        out.clear();
+
+        wait_stdin(ho, fmt, in);
+        ssize_t n;
+        do {
+            n = read(STDIN_FILENO, buf, sizeof(buf));
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0)
+            break;
+        in.append(buf, n);
+    }
+}
+
+static void usage(const char *prog) {
+    cerr << "usage: " << prog << " [--protocol json|cbor|msgpack]"
+         << " [--batch <file> [--out <file>] | --listen <path> | --shm <name>]" << endl;
+    cerr << "  --protocol <p>  request/response encoding on stdin/stdout and sockets;" << endl;
+    cerr << "                  cbor and msgpack frames carry a 4-byte big-endian length" << endl;
+    cerr << "  --batch <file>  replay a line-delimited request log and exit" << endl;
+    cerr << "  --out <file>    write batch responses to <file> ('-' for stdout);" << endl;
+    cerr << "                  responses are discarded when omitted" << endl;
+    cerr << "  --listen <path> serve many clients on a Unix domain socket" << endl;
+    cerr << "  --shm <name>    serve a co-located client over shared-memory rings" << endl;
+    cerr << "                  (/dev/shm/<name>); combines with --listen" << endl;
+    cerr << "  --busy-poll     spin instead of sleeping on the futex while idle" << endl;
+    cerr << "  --shm-bench <name>  measure add/move/delete round trips as a client" << endl;
+    cerr << "  --snapshot <file>  load the tree from a snapshot at startup" << endl;
+    cerr << "  --replicate <path>  stream every mutation to followers on this socket" << endl;
+    cerr << "  --follow <path>  keep a read-only replica of the primary at <path>" << endl;
+    cerr << "  --lazy-depth <d>  keep snapshot subtrees below depth <d> on disk until used" << endl;
+    cerr << "  --lazy-cache <n>  evict unmodified subtrees beyond <n> loaded nodes" << endl;
+    cerr << "  --load <file>   bulk load flat id,parent_id,name rows (CSV or NDJSON)" << endl;
+    cerr << "  --wal <file>    replay <file> at startup, then log every mutation to it" << endl;
+    cerr << "  --wal-sync <p>  'op' (fsync before each response, grouped; default)," << endl;
+    cerr << "                  '<N>' (fsync every N ms) or 'os' (no fsync)" << endl;
+    cerr << "  --recovery-threads <n>  log decoding threads at startup (default: cores)" << endl;
+    cerr << "  --checkpoint <s>  fold the log into delta checkpoints every <s> seconds" << endl;
+    cerr << "                  (0: only on request); needs --wal" << endl;
+    cerr << "  --checkpoint-bw <MB/s>  write checkpoints at most this fast (default 32)" << endl;
+    cerr << "  --history <s>   keep past versions for <s> seconds (0: until the memory" << endl;
+    cerr << "                  cap) for query as_of_version / as_of_time" << endl;
+    cerr << "  --history-mem <MB>  memory cap of the version history (default 256)" << endl;
+    cerr << "  --mvcc          answer queries from immutable versions of the tree, so" << endl;
+    cerr << "                  they never wait for writers" << endl;
+    cerr << "  --live-reads    let queries walk the live tree without the lock; deleted" << endl;
+    cerr << "                  nodes are freed once no query can still see them" << endl;
+    cerr << "  --subtree-locks  let add/delete/move of disjoint subtrees run in" << endl;
+    cerr << "                  parallel, locking only the nodes they touch; implies" << endl;
+    cerr << "                  --live-reads" << endl;
+    cerr << "  --shards <n>    partition the tree over <n> shard threads, one per core;" << endl;
+    cerr << "                  not with the options that need the tree in one piece" << endl;
+    cerr << "  --handoff <path>  hand the running state to a process started with" << endl;
+    cerr << "                  --takeover <path>, then exit" << endl;
+    cerr << "  --takeover <path>  continue the process serving --handoff <path>;" << endl;
+    cerr << "                  its tree, log, sockets and stdin/stdout are taken over" << endl;
+    cerr << "  --bench-snapshot <n>  compare add_node replay and snapshot load" << endl;
+    cerr << "  --bench-epoch <s>  run lock-free queries against concurrent deletes and" << endl;
+    cerr << "                  moves for <s> seconds and check every row" << endl;
+    cerr << "  --bench-index <n>  ID index inserts and lookups/s by reader thread count" << endl;
+    cerr << "  --bench-subtrees <n>  ops/s of <n> writers in disjoint subtrees, under" << endl;
+    cerr << "                  the tree lock and with --subtree-locks" << endl;
+    cerr << "  --bench-shards <n>  the same writers under the tree lock and with" << endl;
+    cerr << "                  --shards <n>" << endl;
+    cerr << "  --bench-yield <n>  write latency during full queries of <n> nodes," << endl;
+    cerr << "                  with queries holding the lock and yielding it" << endl;
+    cerr << "  --bench-restart <n>  recover <n> nodes from a base and deltas, in full" << endl;
+    cerr << "                  and with --lazy-depth 2, and check the tree" << endl;
+}
+
+int main(int argc, char *argv[])
 {
-    thread th_hierarchy(hierarchy_test);
+    string batch_path;
+    string out_path;
+    string listen_path;
+    wire_format fmt = wire_format::text;
+    string shm_name;
+    string shm_bench_name;
+    bool busy_poll = false;
+    string wal_path;
+    string snapshot_path;
+    string load_path;
+    long bench_nodes = 0;
+    int bench_epoch_sec = 0;
+    long bench_index_ids = 0;
+    int bench_writers = 0;
+    int bench_shard_writers = 0;
+    long bench_yield_nodes = 0;
+    long bench_restart_nodes = 0;
+    wal_sync sync_policy = wal_sync::per_op;
+    int sync_interval_ms = 0;
+    int recovery_threads = 0;
+    string replicate_path;
+    string follow_path;
+    int lazy_depth = 0;
+    long lazy_cache = 1000000;
+    int checkpoint_sec = -1;
+    long checkpoint_mbps = 32;
+    string handoff_path;
+    string takeover_path;
+    int history_sec = -1;
+    long history_mb = 256;
+    bool mvcc = false;
+    bool live_reads = false;
+    bool subtree_locking = false;
+    int shard_count = 0;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--batch" && i + 1 < argc) {
+            batch_path = argv[++i];
+        } else if (arg == "--out" && i + 1 < argc) {
+            out_path = argv[++i];
+        } else if (arg == "--listen" && i + 1 < argc) {
+            listen_path = argv[++i];
+        } else if (arg == "--shm" && i + 1 < argc) {
+            shm_name = argv[++i];
+        } else if (arg == "--shm-bench" && i + 1 < argc) {
+            shm_bench_name = argv[++i];
+        } else if (arg == "--busy-poll") {
+            busy_poll = true;
+        } else if (arg == "--protocol" && i + 1 < argc) {
+            if (!parse_wire_format(argv[++i], fmt)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--snapshot" && i + 1 < argc) {
+            snapshot_path = argv[++i];
+        } else if (arg == "--load" && i + 1 < argc) {
+            load_path = argv[++i];
+        } else if (arg == "--bench-snapshot" && i + 1 < argc) {
+            bench_nodes = atol(argv[++i]);
+        } else if (arg == "--bench-epoch" && i + 1 < argc) {
+            bench_epoch_sec = atoi(argv[++i]);
+        } else if (arg == "--bench-index" && i + 1 < argc) {
+            bench_index_ids = atol(argv[++i]);
+        } else if (arg == "--bench-subtrees" && i + 1 < argc) {
+            bench_writers = atoi(argv[++i]);
+        } else if (arg == "--bench-shards" && i + 1 < argc) {
+            bench_shard_writers = atoi(argv[++i]);
+        } else if (arg == "--bench-yield" && i + 1 < argc) {
+            bench_yield_nodes = atol(argv[++i]);
+        } else if (arg == "--bench-restart" && i + 1 < argc) {
+            bench_restart_nodes = atol(argv[++i]);
+        } else if (arg == "--wal" && i + 1 < argc) {
+            wal_path = argv[++i];
+        } else if (arg == "--replicate" && i + 1 < argc) {
+            replicate_path = argv[++i];
+        } else if (arg == "--follow" && i + 1 < argc) {
+            follow_path = argv[++i];
+        } else if (arg == "--lazy-depth" && i + 1 < argc) {
+            lazy_depth = atoi(argv[++i]);
+        } else if (arg == "--lazy-cache" && i + 1 < argc) {
+            lazy_cache = atol(argv[++i]);
+        } else if (arg == "--recovery-threads" && i + 1 < argc) {
+            recovery_threads = atoi(argv[++i]);
+        } else if (arg == "--history" && i + 1 < argc) {
+            history_sec = atoi(argv[++i]);
+        } else if (arg == "--history-mem" && i + 1 < argc) {
+            history_mb = atol(argv[++i]);
+        } else if (arg == "--mvcc") {
+            mvcc = true;
+        } else if (arg == "--live-reads") {
+            live_reads = true;
+        } else if (arg == "--subtree-locks") {
+            subtree_locking = true;
+        } else if (arg == "--shards" && i + 1 < argc) {
+            shard_count = atoi(argv[++i]);
+        } else if (arg == "--handoff" && i + 1 < argc) {
+            handoff_path = argv[++i];
+        } else if (arg == "--takeover" && i + 1 < argc) {
+            takeover_path = argv[++i];
+        } else if (arg == "--checkpoint" && i + 1 < argc) {
+            checkpoint_sec = atoi(argv[++i]);
+        } else if (arg == "--checkpoint-bw" && i + 1 < argc) {
+            checkpoint_mbps = atol(argv[++i]);
+        } else if (arg == "--wal-sync" && i + 1 < argc) {
+            string p = argv[++i];
+            if (p == "op") {
+                sync_policy = wal_sync::per_op;
+            } else if (p == "os") {
+                sync_policy = wal_sync::os;
+            } else if (atoi(p.c_str()) > 0) {
+                sync_policy = wal_sync::interval;
+                sync_interval_ms = atoi(p.c_str());
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!shm_bench_name.empty())
+        return shm_bench(shm_bench_name, 100000, busy_poll) < 0 ? 1 : 0;
+
+    if (bench_nodes > 0)
+        return bench_snapshot(bench_nodes) < 0 ? 1 : 0;
+
+    if (bench_epoch_sec > 0)
+        return bench_epoch(bench_epoch_sec, 4) < 0 ? 1 : 0;
+
+    if (bench_index_ids > 0)
+        return bench_index(bench_index_ids) < 0 ? 1 : 0;
+
+    if (bench_writers > 0)
+        return bench_subtrees(bench_writers) < 0 ? 1 : 0;
+
+    if (bench_shard_writers > 0)
+        return bench_shards(bench_shard_writers) < 0 ? 1 : 0;
+
+    if (bench_yield_nodes > 0)
+        return bench_yield(bench_yield_nodes) < 0 ? 1 : 0;
+
+    if (bench_restart_nodes > 0)
+        return bench_restart(bench_restart_nodes) < 0 ? 1 : 0;
+
+    if ((checkpoint_sec >= 0 && wal_path.empty()) ||
+        (!follow_path.empty() && (!replicate_path.empty() || !wal_path.empty())) ||
+        ((!handoff_path.empty() || !takeover_path.empty()) &&
+         (!batch_path.empty() || !shm_name.empty())) ||
+        (!takeover_path.empty() && !snapshot_path.empty()) ||
+        (history_sec >= 0 && (!follow_path.empty() || lazy_depth > 0)) ||
+        ((mvcc || live_reads) && lazy_depth > 0) || (mvcc && live_reads) ||
+        (subtree_locking && (mvcc || lazy_depth > 0 || history_sec >= 0 ||
+                             !follow_path.empty())) ||
+        (shard_count > 0 && (mvcc || live_reads || subtree_locking || lazy_depth > 0 ||
+                             history_sec >= 0 || !follow_path.empty() ||
+                             !replicate_path.empty() || checkpoint_sec >= 0 ||
+                             !handoff_path.empty() || !takeover_path.empty()))) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    hierarchy h;
+    write_ahead_log wal;
+    checkpointer checkpoints(h, wal, wal_path);
+    log_replayer replayer(recovery_threads);
+    cold_store cold(lazy_depth, lazy_cache);
+    if (lazy_depth > 0)
+        h.m_lazy = &cold;
+    uint64_t snapshot_lsn = 0;
+    handoff ho(h, wal, checkpoints);
+    handoff_state handed;
+    if (!takeover_path.empty()) {
+        /* the predecessor keeps serving until done() */
+        if (ho.take(takeover_path, wal_path, sync_policy, sync_interval_ms, handed,
+                    snapshot_lsn) < 0 || ho.done() < 0)
+            return 1;
+        fmt = handed.fmt;
+        if (handed.listen_fd >= 0)
+            listen_path = handed.listen_path;
+    } else {
+        /* the log is decoded while the snapshot and checkpoints load */
+        if (!wal_path.empty())
+            replayer.start(checkpoints.log_files());
+        if (!snapshot_path.empty() && snapshot_load(h, snapshot_path, snapshot_lsn) < 0)
+            return 1;
+        if (!wal_path.empty()) {
+            if (checkpoints.recover(snapshot_lsn, checkpoint_sec >= 0) < 0 ||
+                replayer.apply(h, snapshot_lsn) < 0 ||
+                wal.open(wal_path, sync_policy, sync_interval_ms, snapshot_lsn) < 0)
+                return 1;
+            h.m_wal = &wal;
+        }
+    }
+    if (h.m_lazy)
+        cold.trim(h);
+    if (!handoff_path.empty() && ho.listen_on(handoff_path) < 0)
+        return 1;
+    version_history history(history_sec, size_t(history_mb) << 20);
+    if (history_sec >= 0) {
+        history.init(h, h.m_wal ? wal.last_lsn() : 0);
+        h.m_history = &history;
+    }
+    mvcc_tree versions;
+    if (mvcc) {
+        versions.init(h);
+        h.m_mvcc = &versions;
+    }
+    epoch_manager epochs;
+    if (live_reads || subtree_locking) {
+        epochs.start(10);
+        h.m_epochs = &epochs;
+    }
+    subtree_locks locks(h);
+    if (subtree_locking)
+        h.m_locks = &locks;
+    handoff *successor = handoff_path.empty() ? nullptr : &ho;
+
+    log_shipper shipper(h);
+    log_follower follower(h);
+    if (!replicate_path.empty()) {
+        if (shipper.listen_on(replicate_path) < 0)
+            return 1;
+        shipper.start();
+        h.m_shipper = &shipper;
+    }
+    if (!follow_path.empty()) {
+        h.m_read_only = true;
+        h.m_follower = &follower;
+        follower.start(follow_path);
+    }
+    if (checkpoint_sec >= 0) {
+        checkpoints.start(checkpoint_sec, uint64_t(checkpoint_mbps) << 20);
+        h.m_checkpoint = &checkpoints;
+    }
+    if (!load_path.empty()) {
+        bulk_result res;
+        if (bulk_load(h, load_path, res) < 0)
+            return 1;
+        jsonCommitResponses(h);
+        cerr << jsonBulkLoadResult(res).dump() << endl;
+        fprintf(stderr, "bulk_load: %llu of %llu rows in %.3f s\n",
+                (unsigned long long)res.loaded, (unsigned long long)res.rows, res.seconds);
+    }
+    shard_engine shards(shard_count);
+    if (shard_count > 0) {
+        shards.start(h);
+        h.m_shards = &shards;
+    }
+
+    if (!batch_path.empty()) {
+        batch_stats stats;
+        if (batch_run(h, batch_path, out_path, stats) < 0)
+            return 1;
+        batch_report(stats);
+        return 0;
+    }
+
+    if (!listen_path.empty() || !shm_name.empty()) {
+        shm_server shm(h, fmt, busy_poll);
+        thread th_shm;
+        if (!shm_name.empty()) {
+            if (shm.create(shm_name) < 0)
+                return 1;
+            if (listen_path.empty())
+                return shm.run() < 0 ? 1 : 0;
+            th_shm = thread(&shm_server::run, &shm);
+        }
+
+        socket_server server(h, fmt);
+        server.set_handoff(successor);
+        int rc = 0;
+        if (handed.listen_fd >= 0)
+            server.adopt(handed);
+        else
+            rc = server.listen_on(listen_path);
+        if (rc == 0)
+            rc = server.run();
+        shm.stop();
+        if (th_shm.joinable())
+            th_shm.join();
+        return rc < 0 ? 1 : 0;
+    }
+
+    if (fmt != wire_format::text) {
+        thread th_hierarchy(hierarchy_test_binary, ref(h), fmt, successor, handed.stdin_in);
+        th_hierarchy.join();
+        return 0;
+    }
+
+    thread th_hierarchy(hierarchy_test, ref(h), successor, handed.stdin_in);
     th_hierarchy.join();
 
     return 0;
 }
-
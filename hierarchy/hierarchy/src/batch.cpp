@@ -0,0 +1,129 @@
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "nlohmann/json.hpp"
+#include "hierarchy.h"
+#include "request.h"
+#include "batch.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+static const size_t BATCH_OUT_BUF = 1 << 20;
+
+int batch_run(hierarchy &h, const string &in_path, const string &out_path,
+              batch_stats &stats) {
+    int fd = open(in_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        cerr << "batch: cannot open " << in_path << ": " << strerror(errno) << endl;
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        cerr << "batch: cannot stat " << in_path << ": " << strerror(errno) << endl;
+        close(fd);
+        return -1;
+    }
+
+    FILE *out = nullptr;
+    char *out_buf = nullptr;
+    if (!out_path.empty()) {
+        out = (out_path == "-") ? stdout : fopen(out_path.c_str(), "w");
+        if (out == nullptr) {
+            cerr << "batch: cannot open " << out_path << ": " << strerror(errno) << endl;
+            close(fd);
+            return -1;
+        }
+        out_buf = new char[BATCH_OUT_BUF];
+        setvbuf(out, out_buf, _IOFBF, BATCH_OUT_BUF);
+    }
+
+    size_t size = st.st_size;
+    const char *data = nullptr;
+    if (size > 0) {
+        void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            cerr << "batch: cannot mmap " << in_path << ": " << strerror(errno) << endl;
+            if (out && out != stdout)
+                fclose(out);
+            delete[] out_buf;
+            close(fd);
+            return -1;
+        }
+        madvise(p, size, MADV_SEQUENTIAL);
+        data = static_cast<const char *>(p);
+    }
+
+    auto start = chrono::steady_clock::now();
+    const char *cur = data;
+    const char *end = data + size;
+    while (cur < end) {
+        const char *eol = static_cast<const char *>(memchr(cur, '\n', end - cur));
+        if (eol == nullptr)
+            eol = end;
+        const char *line_end = eol;
+        if (line_end > cur && line_end[-1] == '\r')
+            line_end--;
+
+        if (line_end > cur) {
+            json j = json::parse(cur, line_end, nullptr, false);
+            json resp;
+            if (j.is_discarded()) {
+                stats.bad_lines++;
+                resp = h.fail;
+            } else {
+                try {
+                    resp = jsonDecodeProcess(h, j);
+                } catch (const json::exception &) {
+                    stats.bad_lines++;
+                    resp = h.fail;
+                }
+            }
+            stats.ops++;
+            if (resp.contains("ok") && resp["ok"] == false)
+                stats.failed++;
+            else
+                stats.ok++;
+
+            if (out) {
+                string s = resp.dump();
+                s += '\n';
+                fwrite(s.data(), 1, s.size(), out);
+                stats.bytes_out += s.size();
+            }
+        }
+        cur = eol + 1;
+    }
+    jsonCommitResponses(h);
+    stats.bytes_in = size;
+    stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    if (out) {
+        fflush(out);
+        if (out != stdout)
+            fclose(out);
+    }
+    delete[] out_buf;
+    if (data)
+        munmap(const_cast<char *>(data), size);
+    close(fd);
+    return 0;
+}
+
+void batch_report(const batch_stats &stats) {
+    double secs = stats.seconds > 0 ? stats.seconds : 1e-9;
+    fprintf(stderr,
+            "batch: %llu ops (%llu ok, %llu failed, %llu unparsable) in %.3f s, "
+            "%.0f ops/s, %.1f MB/s in, %.1f MB/s out\n",
+            stats.ops, stats.ok, stats.failed, stats.bad_lines, stats.seconds,
+            stats.ops / secs, stats.bytes_in / secs / 1e6,
+            stats.bytes_out / secs / 1e6);
+}
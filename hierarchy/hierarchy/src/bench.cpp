@@ -0,0 +1,629 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cstdio>
+#include <thread>
+#include <atomic>
+#include <unordered_map>
+#include <unistd.h>
+#include "nlohmann/json.hpp"
+#include "hierarchy.h"
+#include "batch.h"
+#include "snapshot.h"
+#include "bench.h"
+#include "epoch.h"
+#include "id_index.h"
+#include "request.h"
+#include "subtree_locks.h"
+#include "shards.h"
+#include "wal.h"
+#include "checkpoint.h"
+#include "lazy.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+static double seconds_since(chrono::steady_clock::time_point t0) {
+    return chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+}
+
+static json query_all(hierarchy &h) {
+    vector<string> names, ids, root_ids;
+    return h.query(0, INT_MAX, names, ids, root_ids);
+}
+
+int bench_snapshot(size_t n) {
+    string dir = "/tmp";
+    if (getenv("TMPDIR"))
+        dir = getenv("TMPDIR");
+    string log_path = dir + "/hierarchy-bench-" + to_string(getpid()) + ".log";
+    string snap_path = dir + "/hierarchy-bench-" + to_string(getpid()) + ".snap";
+
+    /* random tree: every node hangs below one created before it */
+    FILE *f = fopen(log_path.c_str(), "w");
+    if (f == nullptr) {
+        cerr << "bench: cannot create " << log_path << endl;
+        return -1;
+    }
+    mt19937_64 rng(42);
+    for (size_t i = 0; i < n; i++) {
+        json add = {{"id", "id" + to_string(i)}, {"name", "node" + to_string(i)}};
+        if (i > 0)
+            add["parent_id"] = "id" + to_string(rng() % i);
+        string line = json{{"add_node", add}}.dump();
+        fprintf(f, "%s\n", line.c_str());
+    }
+    fclose(f);
+
+    hierarchy replayed;
+    batch_stats stats;
+    if (batch_run(replayed, log_path, "", stats) < 0)
+        return -1;
+    unlink(log_path.c_str());
+
+    auto t0 = chrono::steady_clock::now();
+    if (snapshot_write(replayed, snap_path, 0) < 0)
+        return -1;
+    double write_secs = seconds_since(t0);
+
+    hierarchy loaded;
+    uint64_t lsn;
+    t0 = chrono::steady_clock::now();
+    if (snapshot_load(loaded, snap_path, lsn) < 0)
+        return -1;
+    double load_secs = seconds_since(t0);
+    unlink(snap_path.c_str());
+
+    bool same = query_all(replayed) == query_all(loaded);
+    fprintf(stderr,
+            "nodes:             %zu\n"
+            "add_node replay:   %.3f s (%.0f nodes/s)\n"
+            "snapshot write:    %.3f s\n"
+            "snapshot load:     %.3f s (%.0f nodes/s, %.1fx faster)\n"
+            "trees identical:   %s\n",
+            n, stats.seconds, n / stats.seconds, write_secs, load_secs,
+            n / load_secs, stats.seconds / load_secs, same ? "yes" : "NO");
+    return same ? 0 : -1;
+}
+
+static string bench_id(size_t i) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "node-%012zu", i);
+    return buf;
+}
+
+static bool bench_row_ok(const string &id, const string &name, const string &parent) {
+    return id.size() == 17 && id.compare(0, 5, "node-") == 0 && name == "name-" + id.substr(5) &&
+           (parent.empty() || parent.compare(0, 5, "node-") == 0);
+}
+
+/*
+ * Like preOrder, but yields now and then between reaching a node and
+ * reading it, and checks that the node names the parent it was reached from.
+ */
+static void bench_walk(Node *n, const string &parent_id, uint64_t &rows, uint64_t &bad) {
+    for (; n; n = load_link(n->next)) {
+        if (++rows % 16 == 0)
+            this_thread::yield();
+        if (!bench_row_ok(n->id, n->name, parent_id) || n->parent_id != parent_id)
+            bad++;
+        bench_walk(load_link(n->child), n->id, rows, bad);
+    }
+}
+
+/*
+ * Rows of a query down to max_depth: each one's parent came before it, at
+ * one level up, and only the first is the root.
+ */
+static uint64_t bench_bad_rows(const json &nodes, int max_depth) {
+    unordered_map<string, int> depth;
+    uint64_t bad = 0;
+    for (size_t k = 0; k < nodes.size(); k++) {
+        const string &id = nodes[k][0].get_ref<const string &>();
+        const string &parent = nodes[k][2].get_ref<const string &>();
+        auto up = depth.find(parent);
+        int d = parent.empty() ? 0 : up == depth.end() ? -1 : up->second + 1;
+        if (!bench_row_ok(id, nodes[k][1].get_ref<const string &>(), parent) ||
+            parent.empty() != (k == 0) || d < 0 || d > max_depth)
+            bad++;
+        else
+            depth[id] = d;
+    }
+    return bad;
+}
+
+int bench_epoch(int seconds, int readers) {
+    hierarchy h;
+    epoch_manager epochs;
+    h.m_epochs = &epochs;
+    epochs.start(1);
+
+    /* the name of node-N is name-N, so a row read from a freed node shows */
+    const size_t TREE = 5000;
+    mt19937_64 rng(42);
+    vector<string> live;
+    for (size_t i = 0; i < TREE; i++) {
+        string id = bench_id(i);
+        h.add_node("name-" + id.substr(5), id, i ? live[rng() % live.size()] : "");
+        live.push_back(id);
+    }
+
+    atomic<bool> stop(false);
+    atomic<uint64_t> queries(0), rows(0), bad(0);
+    auto reader = [&]() {
+        vector<string> names, ids, root_ids;
+        for (uint64_t i = 0; !stop; i++) {
+            uint64_t n = 0, wrong = 0;
+            if (i % 2) {
+                epoch_guard pin(&epochs);
+                bench_walk(load_link(h.root), "", n, wrong);
+            } else {
+                int max_depth = i % 8 ? int(i % 8) * 2 : INT_MAX;
+                json r;
+                {
+                    epoch_guard pin(&epochs);
+                    r = h.query(0, max_depth, names, ids, root_ids, row_format::array);
+                }
+                wrong = bench_bad_rows(r["nodes"], max_depth);
+                n = r["nodes"].size();
+            }
+            rows += n;
+            bad += wrong;
+            queries++;
+        }
+    };
+    vector<thread> threads;
+    for (int i = 0; i < readers; i++)
+        threads.emplace_back(reader);
+
+    /* keep the tree near its size, so there is always something to delete */
+    uint64_t mutations = 0;
+    size_t next_id = TREE;
+    auto t0 = chrono::steady_clock::now();
+    while (seconds_since(t0) < seconds) {
+        lock_guard<rw_mutex> lk(h.m_mutex);
+        uint64_t op = rng() % 100;
+        size_t k = rng() % live.size();
+        if (live.size() < TREE / 2 || op < 40) {
+            string id = bench_id(next_id++);
+            if (h.add_node("name-" + id.substr(5), id, live[k])) {
+                live.push_back(id);
+                mutations++;
+            }
+        } else if (op < 75) {
+            if (k > 0 && h.delete_node(live[k])) {
+                live[k] = live.back();
+                live.pop_back();
+                mutations++;
+            }
+        } else if (h.move_node(live[k], live[rng() % live.size()])) {
+            mutations++;
+        }
+    }
+    stop = true;
+    for (thread &t : threads)
+        t.join();
+    epochs.stop();
+    json st = epochs.status();
+    size_t last = epochs.collect();
+
+    fprintf(stderr,
+            "seconds:           %d\n"
+            "reader threads:    %d\n"
+            "mutations:         %llu\n"
+            "queries:           %llu (%llu rows checked)\n"
+            "nodes retired:     %llu freed while running, %zu after\n"
+            "bad rows:          %llu\n",
+            seconds, readers, (unsigned long long)mutations,
+            (unsigned long long)queries.load(), (unsigned long long)rows.load(),
+            (unsigned long long)st["freed"].get<uint64_t>(), last,
+            (unsigned long long)bad.load());
+    return bad ? -1 : 0;
+}
+
+int bench_index(size_t n) {
+    vector<Node *> nodes;
+    for (size_t i = 0; i < n; i++)
+        nodes.push_back(new Node("id" + to_string(i), "node" + to_string(i)));
+
+    /* growth: the index moves entries a few at a time, the map all at once */
+    id_index index;
+    unordered_map<string, Node *> map;
+    double index_max = 0, map_max = 0;
+    auto t0 = chrono::steady_clock::now();
+    for (Node *node : nodes) {
+        auto t = chrono::steady_clock::now();
+        index.insert(node);
+        double s = seconds_since(t);
+        if (s > index_max)
+            index_max = s;
+    }
+    double index_secs = seconds_since(t0);
+    t0 = chrono::steady_clock::now();
+    for (Node *node : nodes) {
+        auto t = chrono::steady_clock::now();
+        map.emplace(node->id, node);
+        double s = seconds_since(t);
+        if (s > map_max)
+            map_max = s;
+    }
+    double map_secs = seconds_since(t0);
+    fprintf(stderr,
+            "ids:               %zu (%u hardware threads)\n"
+            "insert, id_index:  %.3f s, longest %.3f ms\n"
+            "insert, map:       %.3f s, longest %.3f ms\n"
+            "lookups/s          id_index       map+lock\n",
+            n, thread::hardware_concurrency(), index_secs, index_max * 1000, map_secs,
+            map_max * 1000);
+
+    rw_mutex lock;
+    bool ok = true;
+    for (int threads = 1; threads <= 8; threads *= 2) {
+        double rate[2];
+        for (int which = 0; which < 2; which++) {
+            atomic<bool> stop(false);
+            atomic<uint64_t> total(0), missing(0);
+            vector<thread> ts;
+            for (int k = 0; k < threads; k++) {
+                ts.emplace_back([&, k]() {
+                    mt19937_64 rng(k);
+                    uint64_t done = 0, lost = 0;
+                    while (!stop) {
+                        for (int b = 0; b < 1024; b++) {
+                            const string &id = nodes[rng() % n]->id;
+                            Node *found;
+                            if (which == 0) {
+                                found = index.find(id);
+                            } else {
+                                shared_guard lk(lock);
+                                auto it = map.find(id);
+                                found = it == map.end() ? nullptr : it->second;
+                            }
+                            if (found == nullptr || found->id != id)
+                                lost++;
+                        }
+                        done += 1024;
+                    }
+                    total += done;
+                    missing += lost;
+                });
+            }
+            t0 = chrono::steady_clock::now();
+            this_thread::sleep_for(chrono::milliseconds(500));
+            stop = true;
+            for (thread &t : ts)
+                t.join();
+            rate[which] = total / seconds_since(t0);
+            ok = ok && missing == 0;
+        }
+        fprintf(stderr, "  %d thread%s       %12.0f   %12.0f\n", threads,
+                threads > 1 ? "s" : " ", rate[0], rate[1]);
+    }
+
+    for (Node *node : nodes)
+        delete node;
+    return ok ? 0 : -1;
+}
+
+/* ops/s of writers through jsonDecodeProcess, and whether the log replays to the same tree */
+enum class writer_mode { tree_lock, subtree_locks, shards };
+
+static double bench_writers(int writers, writer_mode mode, bool &same) {
+    const size_t SUBTREE = 500, OPS = 20000;
+    string dir = "/tmp";
+    if (getenv("TMPDIR"))
+        dir = getenv("TMPDIR");
+    string log_path = dir + "/hierarchy-bench-" + to_string(getpid()) + ".wal";
+    unlink(log_path.c_str());
+
+    hierarchy h;
+    write_ahead_log wal;
+    epoch_manager epochs;
+    subtree_locks locks(h);
+    shard_engine shards(mode == writer_mode::shards ? writers : 0);
+    if (wal.open(log_path, wal_sync::os, 10) < 0)
+        return -1;
+    h.m_wal = &wal;
+    if (mode == writer_mode::subtree_locks) {
+        epochs.start(1);
+        h.m_epochs = &epochs;
+        h.m_locks = &locks;
+    } else if (mode == writer_mode::shards) {
+        shards.start(h);
+        h.m_shards = &shards;
+    }
+
+    auto request = [&](const json &j) {
+        json req = j;
+        return jsonDecodeProcess(h, req) == h.pass;
+    };
+    /* root, then one subtree per writer */
+    vector<vector<string>> own(writers);
+    request({{"add_node", {{"id", bench_id(0)}, {"name", "name-0"}}}});
+    size_t next_id = 1;
+    mt19937_64 rng(42);
+    for (int t = 0; t < writers; t++) {
+        for (size_t i = 0; i < SUBTREE; i++) {
+            string id = bench_id(next_id++);
+            string parent = i ? own[t][rng() % own[t].size()] : bench_id(0);
+            request({{"add_node", {{"id", id}, {"name", "name-" + id.substr(5)},
+                                   {"parent_id", parent}}}});
+            own[t].push_back(id);
+        }
+    }
+
+    /* the others' lists grow while they run */
+    const vector<vector<string>> initial = own;
+    auto writer = [&](int t) {
+        mt19937_64 r(t + 1);
+        vector<string> &live = own[t];
+        for (size_t i = 0; i < OPS; i++) {
+            uint64_t op = r() % 100;
+            const string &id = live[1 + r() % (live.size() - 1)];
+            if (op < 40) {
+                /* IDs of writer t are t + writers * k, so they never clash */
+                string new_id = bench_id(next_id + t + writers * i);
+                if (request({{"add_node", {{"id", new_id}, {"name", "name-" + new_id.substr(5)},
+                                           {"parent_id", id}}}}))
+                    live.push_back(new_id);
+            } else if (op < 70) {
+                request({{"delete_node", {{"id", id}}}});
+            } else if (op < 97) {
+                request({{"move_node", {{"id", id},
+                                        {"new_parent_id", live[r() % live.size()]}}}});
+            } else {
+                const vector<string> &other = initial[(t + 1) % writers];
+                request({{"move_node", {{"id", id},
+                                        {"new_parent_id", other[r() % SUBTREE]}}}});
+            }
+        }
+    };
+    vector<thread> threads;
+    auto t0 = chrono::steady_clock::now();
+    for (int t = 0; t < writers; t++)
+        threads.emplace_back(writer, t);
+    for (thread &t : threads)
+        t.join();
+    double rate = writers * OPS / seconds_since(t0);
+    json all = {{"query", json::object()}};
+    json tree = jsonDecodeProcess(h, all);
+    shards.stop();
+    wal.close();
+    h.m_wal = nullptr;
+    epochs.stop();
+
+    hierarchy replayed;
+    uint64_t last_lsn = 0, valid_end = 0;
+    write_ahead_log::replay(log_path, [&](const wal_record &rec) { replayed.apply(rec); },
+                            last_lsn, valid_end);
+    same = tree == query_all(replayed);
+    unlink(log_path.c_str());
+    return rate;
+}
+
+int bench_subtrees(int writers) {
+    if (writers < 1)
+        return -1;
+    bool ok = true;
+    fprintf(stderr, "writers: %d (%u hardware threads)\n", writers,
+            thread::hardware_concurrency());
+    for (int mode = 0; mode < 2; mode++) {
+        bool same = false;
+        double rate = bench_writers(writers, mode ? writer_mode::subtree_locks
+                                                  : writer_mode::tree_lock, same);
+        if (rate < 0)
+            return -1;
+        fprintf(stderr, "  %-15s %10.0f ops/s, log replay %s\n",
+                mode ? "subtree locks" : "tree lock", rate, same ? "matches" : "DIFFERS");
+        ok = ok && same;
+    }
+    return ok ? 0 : -1;
+}
+
+int bench_shards(int writers) {
+    if (writers < 1)
+        return -1;
+    bool ok = true;
+    fprintf(stderr, "writers: %d (%u hardware threads)\n", writers,
+            thread::hardware_concurrency());
+    for (int mode = 0; mode < 2; mode++) {
+        bool same = false;
+        double rate = bench_writers(writers, mode ? writer_mode::shards
+                                                  : writer_mode::tree_lock, same);
+        if (rate < 0)
+            return -1;
+        fprintf(stderr, "  %-15s %10.0f ops/s, log replay %s\n",
+                mode ? "shards" : "tree lock", rate, same ? "matches" : "DIFFERS");
+        ok = ok && same;
+    }
+    return ok ? 0 : -1;
+}
+
+/* the rows of a query response, without those of nodes under the scratch node */
+static json bench_rows(const json &resp) {
+    json rows = json::array();
+    for (const json &row : resp["nodes"]) {
+        if (row[0].get_ref<const string &>().compare(0, 8, "scratch-") != 0)
+            rows.push_back(row);
+    }
+    return rows;
+}
+
+/* write latencies in us while full queries run, and whether each query was right */
+static bool bench_yield_run(size_t n, bool yielding, vector<double> &latencies,
+                            uint64_t &queries, uint64_t &wrong) {
+    hierarchy h;
+    mt19937_64 rng(42);
+    vector<string> live;
+    for (size_t i = 0; i < n; i++) {
+        string id = bench_id(i);
+        h.add_node("name-" + id.substr(5), id, i ? live[rng() % live.size()] : "");
+        live.push_back(id);
+    }
+    h.add_node("scratch", "scratch-root", bench_id(0));
+    vector<string> names, ids, root_ids;
+    json expected = bench_rows(h.query(0, INT_MAX, names, ids, root_ids, row_format::array));
+
+    atomic<bool> stop(false);
+    atomic<uint64_t> done(0);
+    wrong = 0;
+    thread reader([&]() {
+        while (!stop) {
+            json resp;
+            if (yielding) {
+                json req = {{"query", json::object()}};
+                resp = jsonDecodeProcess(h, req, row_format::array);
+            } else {
+                shared_guard lk(h.m_mutex);
+                resp = h.query(0, INT_MAX, names, ids, root_ids, row_format::array);
+            }
+            done++;
+            if (bench_rows(resp) != expected)
+                wrong++;
+        }
+    });
+
+    /* adds, moves and deletes under the scratch node only, for a few queries */
+    const size_t QUERIES = 5;
+    latencies.clear();
+    for (size_t i = 0; done < QUERIES; i++) {
+        string id = "scratch-" + to_string(i % 64);
+        json req;
+        if (i % 3 == 0)
+            req = {{"add_node", {{"id", id}, {"name", id}, {"parent_id", "scratch-root"}}}};
+        else if (i % 3 == 1)
+            req = {{"move_node", {{"id", id}, {"new_parent_id", "scratch-" + to_string((i + 1) % 64)}}}};
+        else
+            req = {{"delete_node", {{"id", id}}}};
+        auto t0 = chrono::steady_clock::now();
+        jsonDecodeProcess(h, req);
+        latencies.push_back(seconds_since(t0) * 1e6);
+        this_thread::sleep_for(chrono::microseconds(200));
+    }
+    stop = true;
+    reader.join();
+    queries = done;
+    return wrong == 0;
+}
+
+int bench_yield(size_t n) {
+    if (n < 1)
+        return -1;
+    bool ok = true;
+    for (int mode = 0; mode < 2; mode++) {
+        vector<double> lat;
+        uint64_t queries = 0, wrong = 0;
+        ok = bench_yield_run(n, mode == 1, lat, queries, wrong) && ok;
+        sort(lat.begin(), lat.end());
+        fprintf(stderr, "  %-15s %6zu writes p50 %6.0f us, p99 %6.0f us, max %6.0f us; "
+                "%llu queries, %llu wrong\n",
+                mode ? "yielding query" : "holding query", lat.size(), lat[lat.size() / 2],
+                lat[lat.size() * 99 / 100], lat.back(), (unsigned long long)queries,
+                (unsigned long long)wrong);
+    }
+    return ok ? 0 : -1;
+}
+
+/* recover base + deltas into a fresh hierarchy, optionally lazily, and query all of it */
+static bool bench_recover(const string &path, int lazy_depth, const json &expected,
+                          double &secs) {
+    hierarchy h;
+    cold_store cold(lazy_depth, 0);
+    if (lazy_depth > 0)
+        h.m_lazy = &cold;
+    write_ahead_log wal;
+    checkpointer ck(h, wal, path);
+    uint64_t lsn = 0;
+    auto t0 = chrono::steady_clock::now();
+    if (ck.recover(lsn, false) < 0)
+        return false;
+    secs = seconds_since(t0);
+    /* with a cache of 0 every unpinned subtree goes back to disk here */
+    if (h.m_lazy)
+        cold.trim(h);
+    return query_all(h) == expected;
+}
+
+int bench_restart(size_t n) {
+    if (n < 2)
+        return -1;
+    string dir = "/tmp";
+    if (getenv("TMPDIR"))
+        dir = getenv("TMPDIR");
+    string path = dir + "/hierarchy-bench-" + to_string(getpid()) + ".wal";
+    unlink(path.c_str());
+
+    hierarchy h;
+    write_ahead_log wal;
+    checkpointer ck(h, wal, path);
+    uint64_t lsn = 0;
+    if (ck.recover(lsn, true) < 0 || wal.open(path, wal_sync::os, 10, lsn) < 0)
+        return -1;
+    h.m_wal = &wal;
+    /* only run() by hand, but started as --checkpoint would be */
+    ck.start(0, 0);
+
+    auto request = [&](const json &j) {
+        json req = j;
+        return jsonDecodeProcess(h, req) == h.pass;
+    };
+    mt19937_64 rng(42);
+    vector<string> live;
+    for (size_t i = 0; i < n; i++) {
+        string id = bench_id(i);
+        json add = {{"id", id}, {"name", "name-" + id.substr(5)}};
+        if (i > 0)
+            add["parent_id"] = live[rng() % live.size()];
+        request({{"add_node", add}});
+        live.push_back(id);
+    }
+    json result;
+    bool ok = ck.run(result) == 0;
+    vector<uint64_t> deltas;
+
+    /* each round adds below, deletes and moves nodes of the base's cold subtrees */
+    const int ROUNDS = 3;
+    size_t next_id = n;
+    for (int round = 0; ok && round < ROUNDS; round++) {
+        for (size_t i = 0; i < n / 10 + 1; i++) {
+            const string &id = live[1 + rng() % (live.size() - 1)];
+            uint64_t op = rng() % 3;
+            if (op == 0) {
+                string new_id = bench_id(next_id++);
+                if (request({{"add_node", {{"id", new_id}, {"name", "name-" + new_id.substr(5)},
+                                           {"parent_id", id}}}}))
+                    live.push_back(new_id);
+            } else if (op == 1) {
+                request({{"delete_node", {{"id", id}}}});
+            } else {
+                request({{"move_node", {{"id", id},
+                                        {"new_parent_id", live[rng() % live.size()]}}}});
+            }
+        }
+        ok = ck.run(result) == 0 && result["kind"] == "delta";
+        deltas.push_back(result.value("lsn", uint64_t(0)));
+    }
+    ck.stop();
+    wal.close();
+    h.m_wal = nullptr;
+    json expected = query_all(h);
+
+    double full_secs = 0, lazy_secs = 0;
+    bool full_same = ok && bench_recover(path, 0, expected, full_secs);
+    bool lazy_same = ok && bench_recover(path, 2, expected, lazy_secs);
+    unlink(path.c_str());
+    unlink((path + ".base").c_str());
+    for (uint64_t d : deltas)
+        unlink((path + ".delta." + to_string(d)).c_str());
+
+    fprintf(stderr,
+            "nodes:             %zu, %d deltas\n"
+            "full recovery:     %.3f s, tree %s\n"
+            "lazy recovery:     %.3f s, tree %s (--lazy-depth 2 --lazy-cache 0)\n",
+            n, ROUNDS, full_secs, full_same ? "matches" : "DIFFERS",
+            lazy_secs, lazy_same ? "matches" : "DIFFERS");
+    return full_same && lazy_same ? 0 : -1;
+}
@@ -0,0 +1,348 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "nlohmann/json.hpp"
+#include "hierarchy.h"
+#include "wal.h"
+#include "bulk_load.h"
+#include "lazy.h"
+#include "mvcc.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+static const uint32_t NONE = 0xffffffffu;
+
+struct bulk_row {
+    string id;
+    string parent_id;
+    string name;
+    uint64_t line;
+};
+
+/* Split one CSV record; quoted fields may contain commas and "" escapes. */
+static bool parse_csv(const char *p, const char *end, vector<string> &fields) {
+    fields.clear();
+    fields.emplace_back();
+    bool quoted = false;
+    while (p < end) {
+        char c = *p++;
+        if (quoted) {
+            if (c == '"') {
+                if (p < end && *p == '"') {
+                    fields.back() += '"';
+                    p++;
+                } else {
+                    quoted = false;
+                }
+            } else {
+                fields.back() += c;
+            }
+        } else if (c == '"' && fields.back().empty()) {
+            quoted = true;
+        } else if (c == ',') {
+            fields.emplace_back();
+        } else {
+            fields.back() += c;
+        }
+    }
+    return !quoted;
+}
+
+static bool parse_ndjson(const char *p, const char *end, bulk_row &row) {
+    json j = json::parse(p, end, nullptr, false);
+    if (!j.is_object())
+        return false;
+    for (auto field : { make_pair("id", &row.id), make_pair("parent_id", &row.parent_id),
+                        make_pair("name", &row.name) }) {
+        auto it = j.find(field.first);
+        if (it == j.end() || it->is_null())
+            continue;
+        if (!it->is_string())
+            return false;
+        *field.second = it->get<string>();
+    }
+    return true;
+}
+
+static int read_rows(const string &path, vector<bulk_row> &rows, bulk_result &res) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        cerr << "bulk_load: cannot open " << path << ": " << strerror(errno) << endl;
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    if (size == 0) {
+        close(fd);
+        return 0;
+    }
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        cerr << "bulk_load: cannot mmap " << path << ": " << strerror(errno) << endl;
+        return -1;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    const char *cur = static_cast<const char *>(map);
+    const char *end = cur + size;
+    while (cur < end && isspace((unsigned char)*cur))
+        cur++;
+    bool ndjson = cur < end && *cur == '{';
+    cur = static_cast<const char *>(map);
+
+    vector<string> fields;
+    uint64_t line = 0;
+    while (cur < end) {
+        const char *eol = static_cast<const char *>(memchr(cur, '\n', end - cur));
+        if (eol == nullptr)
+            eol = end;
+        const char *line_end = eol;
+        if (line_end > cur && line_end[-1] == '\r')
+            line_end--;
+        line++;
+
+        if (line_end > cur) {
+            bulk_row row;
+            row.line = line;
+            bool ok;
+            if (ndjson) {
+                ok = parse_ndjson(cur, line_end, row);
+            } else {
+                ok = parse_csv(cur, line_end, fields) && fields.size() == 3;
+                if (ok && line == 1 && fields[0] == "id" && fields[1] == "parent_id" &&
+                    fields[2] == "name") {
+                    cur = eol + 1;
+                    continue;
+                }
+                if (ok) {
+                    row.id = move(fields[0]);
+                    row.parent_id = move(fields[1]);
+                    row.name = move(fields[2]);
+                }
+            }
+            res.rows++;
+            if (ok)
+                rows.push_back(move(row));
+            else
+                res.rejected.push_back({line, "", "malformed row"});
+        }
+        cur = eol + 1;
+    }
+    munmap(map, size);
+    return 0;
+}
+
+int bulk_load(hierarchy &h, const string &path, bulk_result &res) {
+    auto start = chrono::steady_clock::now();
+    vector<bulk_row> rows;
+    if (read_rows(path, rows, res) < 0)
+        return -1;
+
+    /* validation works on the in-memory index, so bring everything in */
+    if (h.m_lazy)
+        h.m_lazy->load_all(h);
+
+    uint32_t n = rows.size();
+    vector<uint8_t> ok(n, 1);
+    auto reject = [&](uint32_t i, const char *reason) {
+        ok[i] = 0;
+        res.rejected.push_back({rows[i].line, rows[i].id, reason});
+    };
+
+    /* IDs: non-empty, new to the tree and unique within the file; one root */
+    unordered_map<string, uint32_t> pos;
+    pos.reserve(n);
+    uint32_t new_root = NONE;
+    for (uint32_t i = 0; i < n; i++) {
+        const bulk_row &r = rows[i];
+        if (r.id.empty() || r.name.empty()) {
+            reject(i, "id and name must not be empty");
+        } else if (h.m_index.count(r.id) || pos.count(r.id)) {
+            reject(i, "duplicate id");
+        } else if (r.parent_id.empty() && (h.root != nullptr || new_root != NONE)) {
+            reject(i, "second root");
+        } else {
+            pos.emplace(r.id, i);
+            if (r.parent_id.empty())
+                new_root = i;
+        }
+    }
+
+    /* parents: another row of the file or a node already in the tree */
+    vector<uint32_t> parent(n, NONE);
+    vector<uint32_t> kids;
+    vector<pair<Node *, uint32_t>> ext_kids;
+    for (uint32_t i = 0; i < n; i++) {
+        if (!ok[i] || i == new_root)
+            continue;
+        auto it = pos.find(rows[i].parent_id);
+        if (it != pos.end()) {
+            parent[i] = it->second;
+            kids.push_back(i);
+        } else if (Node *p = h.find(rows[i].parent_id)) {
+            ext_kids.push_back({p, i});
+        } else {
+            reject(i, "parent not found");
+        }
+    }
+
+    /* one sort puts every sibling list in name order, duplicates adjacent */
+    sort(kids.begin(), kids.end(), [&](uint32_t a, uint32_t b) {
+        if (parent[a] != parent[b])
+            return parent[a] < parent[b];
+        int c = rows[a].name.compare(rows[b].name);
+        return c < 0 || (c == 0 && a < b);
+    });
+    for (size_t k = 1; k < kids.size(); k++) {
+        uint32_t a = kids[k - 1], b = kids[k];
+        if (parent[a] == parent[b] && rows[a].name == rows[b].name)
+            reject(b, "duplicate sibling name");
+    }
+    vector<uint32_t> kid_begin(n, NONE);
+    for (size_t k = kids.size(); k-- > 0;)
+        kid_begin[parent[kids[k]]] = k;
+
+    sort(ext_kids.begin(), ext_kids.end(),
+         [&](const pair<Node *, uint32_t> &a, const pair<Node *, uint32_t> &b) {
+        if (a.first != b.first)
+            return a.first < b.first;
+        int c = rows[a.second].name.compare(rows[b.second].name);
+        return c < 0 || (c == 0 && a.second < b.second);
+    });
+    for (size_t k = 0; k < ext_kids.size();) {
+        Node *p = ext_kids[k].first;
+        Node *existing = p->child;
+        const string *prev = nullptr;
+        for (; k < ext_kids.size() && ext_kids[k].first == p; k++) {
+            uint32_t i = ext_kids[k].second;
+            while (existing && existing->name < rows[i].name)
+                existing = existing->next;
+            if ((existing && existing->name == rows[i].name) ||
+                (prev && *prev == rows[i].name))
+                reject(i, "duplicate sibling name");
+            prev = &rows[i].name;
+        }
+    }
+
+    /*
+     * Build in pre-order from every attach point, so parents exist (and are
+     * logged) before their children. Rows never reached hang below a
+     * rejected row or sit on a parent cycle.
+     */
+    node_pool::reserve(n);
+    h.m_index.reserve(h.m_index.size() + n);
+    vector<Node *> built(n, nullptr);
+    vector<uint32_t> stack;
+    auto build_from = [&](uint32_t top) {
+        stack.push_back(top);
+        while (!stack.empty()) {
+            uint32_t i = stack.back();
+            stack.pop_back();
+            bulk_row &r = rows[i];
+            Node *node = new Node(r.id, r.name, r.parent_id);
+            built[i] = node;
+            h.m_index.insert(node);
+            h.mark_dirty(node->id);
+            wal_record rec(wal_op::add_node, r.id, r.name, r.parent_id);
+            h.log(rec);
+            res.loaded++;
+
+            if (kid_begin[i] == NONE)
+                continue;
+            size_t k = kid_begin[i];
+            size_t last = k;
+            while (last < kids.size() && parent[kids[last]] == i)
+                last++;
+            /* push in reverse so the first sibling is built first */
+            while (last-- > k) {
+                if (ok[kids[last]])
+                    stack.push_back(kids[last]);
+            }
+        }
+    };
+    if (new_root != NONE)
+        build_from(new_root);
+    for (auto &e : ext_kids) {
+        if (ok[e.second])
+            build_from(e.second);
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        if (ok[i] && !built[i])
+            reject(i, "unreachable: ancestor rejected or parent cycle");
+    }
+
+    /* new sibling lists are already sorted, just chain them */
+    for (size_t k = 0; k < kids.size(); k++) {
+        uint32_t i = kids[k];
+        if (!built[i])
+            continue;
+        Node *p = built[parent[i]];
+        Node *node = built[i];
+        size_t next = k + 1;
+        while (next < kids.size() && parent[kids[next]] == parent[i] && !built[kids[next]])
+            next++;
+        if (next < kids.size() && parent[kids[next]] == parent[i])
+            node->next = built[kids[next]];
+        if (p->child == nullptr)
+            p->child = node;
+    }
+    /* a new tree becomes visible to lock-free queries only when complete */
+    if (new_root != NONE)
+        store_link(h.root, built[new_root]);
+
+    /*
+     * Merge new children into the existing, equally sorted, sibling lists.
+     * The new nodes are chained first, each to whatever follows it, and
+     * only then linked in from their existing predecessor (or p->child),
+     * so a lock-free query walks either the old list or a complete one.
+     */
+    vector<pair<Node *, bool>> merged;
+    for (size_t k = 0; k < ext_kids.size();) {
+        Node *p = ext_kids[k].first;
+        Node *existing = p->child;
+        merged.clear();
+        for (; k < ext_kids.size() && ext_kids[k].first == p; k++) {
+            Node *node = built[ext_kids[k].second];
+            if (node == nullptr)
+                continue;
+            while (existing && existing->name < node->name) {
+                merged.push_back(make_pair(existing, false));
+                existing = existing->next;
+            }
+            merged.push_back(make_pair(node, true));
+        }
+        for (size_t m = 0; m < merged.size(); m++) {
+            if (merged[m].second)
+                merged[m].first->next = m + 1 < merged.size() ? merged[m + 1].first : existing;
+        }
+        for (size_t m = 0; m + 1 < merged.size(); m++) {
+            if (!merged[m].second && merged[m + 1].second)
+                store_link(merged[m].first->next, merged[m + 1].first);
+        }
+        if (!merged.empty() && merged[0].second)
+            store_link(p->child, merged[0].first);
+    }
+
+    sort(res.rejected.begin(), res.rejected.end(),
+         [](const bulk_reject &a, const bulk_reject &b) { return a.line < b.line; });
+    /* the nodes went in without add_node(), so copy the tree afresh */
+    if (h.m_mvcc)
+        h.m_mvcc->init(h);
+    res.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return 0;
+}
@@ -0,0 +1,377 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "nlohmann/json.hpp"
+#include "hierarchy.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "checkpoint.h"
+#include "lazy.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+static bool file_exists(const string &path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+/* <wal>.<kind>.<lsn> files, oldest first */
+static vector<pair<uint64_t, string>> list_files(const string &wal_path, const string &kind) {
+    size_t slash = wal_path.rfind('/');
+    string dir = slash == string::npos ? "." : wal_path.substr(0, slash + 1);
+    string prefix = (slash == string::npos ? wal_path : wal_path.substr(slash + 1)) +
+                    "." + kind + ".";
+
+    vector<pair<uint64_t, string>> files;
+    DIR *d = opendir(dir.c_str());
+    if (d == nullptr)
+        return files;
+    while (struct dirent *e = readdir(d)) {
+        string name = e->d_name;
+        if (name.compare(0, prefix.size(), prefix) != 0 || name.size() == prefix.size())
+            continue;
+        string num = name.substr(prefix.size());
+        if (num.find_first_not_of("0123456789") != string::npos)
+            continue;
+        string path = slash == string::npos ? name : dir + name;
+        files.push_back(make_pair(strtoull(num.c_str(), nullptr, 10), path));
+    }
+    closedir(d);
+    sort(files.begin(), files.end());
+    return files;
+}
+
+/*
+ * Turn the tree at the previous checkpoint into the tree at this one. Every
+ * node the delta mentions is first taken out of its sibling list, deleted
+ * nodes are freed (their children, having moved or gone, are all in the
+ * delta too), then the surviving nodes are put back under their parents in
+ * depth order. With --lazy-depth every parent touched is pinned and freed
+ * nodes are dropped from the cold store, as the mutations themselves do,
+ * or the next trim() would put the snapshot's version back.
+ */
+static int apply_delta(hierarchy &h, const vector<wal_record> &recs) {
+    for (const wal_record &rec : recs) {
+        Node *n = h.find(rec.id);
+        if (n == nullptr)
+            continue;
+        if (n == h.root) {
+            h.root = nullptr;
+        } else if (Node *parent = h.find(n->parent_id)) {
+            h.expand(parent);
+            h.unlink_child(parent, n);
+            if (h.m_lazy)
+                h.m_lazy->modified(h, parent);
+        }
+    }
+    for (const wal_record &rec : recs) {
+        if (rec.op != wal_op::delete_node)
+            continue;
+        Node *n = h.find(rec.id);
+        if (n == nullptr)
+            continue;
+        h.expand(n);
+        if (n->child) {
+            cerr << "checkpoint: deleted node " << rec.id << " still has children" << endl;
+            return -1;
+        }
+        if (h.m_lazy)
+            h.m_lazy->forget(n);
+        h.m_index.erase(rec.id);
+        delete n;
+    }
+    for (const wal_record &rec : recs) {
+        if (rec.op != wal_op::add_node)
+            continue;
+        Node *n = h.find(rec.id);
+        if (n == nullptr) {
+            n = new Node(rec.id, rec.name, rec.parent_id);
+            h.m_index.insert(n);
+        } else {
+            n->name = rec.name;
+            n->parent_id = rec.parent_id;
+        }
+        if (rec.parent_id.empty()) {
+            if (h.root != nullptr) {
+                cerr << "checkpoint: second root " << rec.id << endl;
+                return -1;
+            }
+            h.root = n;
+            continue;
+        }
+        Node *parent = h.find(rec.parent_id);
+        if (parent == nullptr) {
+            cerr << "checkpoint: missing parent " << rec.parent_id << " of " << rec.id << endl;
+            return -1;
+        }
+        h.expand(parent);
+        h.link_child(parent, n);
+        if (h.m_lazy)
+            h.m_lazy->modified(h, parent);
+    }
+    return 0;
+}
+
+checkpointer::checkpointer(hierarchy &h, write_ahead_log &wal, const string &wal_path) :
+    m_h(h), m_wal(wal), m_path(wal_path) {}
+
+int checkpointer::recover(uint64_t &lsn, bool track) {
+    string base = m_path + ".base";
+    if (file_exists(base)) {
+        if (m_h.root != nullptr) {
+            cerr << "checkpoint: " << base << " cannot be combined with --snapshot" << endl;
+            return -1;
+        }
+        if (snapshot_load(m_h, base, lsn) < 0)
+            return -1;
+        m_have_base = true;
+    }
+
+    for (auto &f : list_files(m_path, "delta")) {
+        if (f.first <= lsn)
+            continue;
+        if (!m_have_base) {
+            cerr << "checkpoint: " << f.second << " has no base" << endl;
+            return -1;
+        }
+        vector<wal_record> recs;
+        uint64_t last_lsn;
+        uint64_t valid_end;
+        struct stat st;
+        bool ok = write_ahead_log::replay(f.second, [&](const wal_record &rec) {
+            recs.push_back(rec);
+        }, last_lsn, valid_end) == 0 && stat(f.second.c_str(), &st) == 0 &&
+            valid_end == uint64_t(st.st_size);
+        for (const wal_record &rec : recs)
+            ok = ok && rec.lsn == f.first && rec.op != wal_op::move_node;
+        if (!ok) {
+            cerr << "checkpoint: " << f.second << " is damaged" << endl;
+            return -1;
+        }
+        if (apply_delta(m_h, recs) < 0)
+            return -1;
+        lsn = f.first;
+        m_deltas++;
+    }
+    m_lsn = lsn;
+
+    m_h.m_track_dirty = track;
+    if (m_have_base)
+        cerr << "checkpoint: recovered " << m_deltas << " deltas up to lsn " << m_lsn << endl;
+    return 0;
+}
+
+json checkpointer::handoff_state() {
+    json dirty = json::array();
+    for (const string &id : m_h.m_dirty)
+        dirty.push_back(id);
+    return json{{"lsn", m_lsn}, {"have_base", m_have_base}, {"deltas", m_deltas},
+                {"tracking", m_h.m_track_dirty}, {"dirty", dirty}};
+}
+
+void checkpointer::adopt(const json &state) {
+    m_lsn = state.value("lsn", uint64_t(0));
+    m_have_base = state.value("have_base", false);
+    m_deltas = state.value("deltas", 0);
+    m_h.m_track_dirty = state.value("tracking", false);
+    m_h.m_dirty.clear();
+    for (const json &id : state.value("dirty", json::array()))
+        m_h.m_dirty.insert(id.get<string>());
+}
+
+vector<string> checkpointer::log_files() {
+    vector<string> paths;
+    for (auto &f : list_files(m_path, "seg"))
+        paths.push_back(f.second);
+    paths.push_back(m_path);
+    return paths;
+}
+
+void checkpointer::start(int interval_sec, uint64_t bytes_per_sec, int max_deltas) {
+    if (!m_h.m_track_dirty) {
+        m_h.m_track_dirty = true;
+        m_have_base = false;
+    }
+    m_interval_sec = interval_sec;
+    m_rate = bytes_per_sec;
+    m_max_deltas = max_deltas > 0 ? max_deltas : 1;
+    m_stop = false;
+    m_thread = thread(&checkpointer::loop, this);
+}
+
+void checkpointer::stop() {
+    if (!m_thread.joinable())
+        return;
+    {
+        lock_guard<mutex> lk(m_lock);
+        m_stop = true;
+    }
+    m_cv.notify_all();
+    m_thread.join();
+}
+
+void checkpointer::request() {
+    lock_guard<mutex> lk(m_lock);
+    m_requested = true;
+    m_cv.notify_all();
+}
+
+json checkpointer::status() {
+    lock_guard<mutex> lk(m_lock);
+    return m_status;
+}
+
+void checkpointer::loop() {
+    unique_lock<mutex> lk(m_lock);
+    while (true) {
+        auto due = [&] { return m_stop || m_requested; };
+        if (m_interval_sec > 0)
+            m_cv.wait_for(lk, chrono::seconds(m_interval_sec), due);
+        else
+            m_cv.wait(lk, due);
+        if (m_stop)
+            break;
+        m_requested = false;
+        m_status["running"] = true;
+        lk.unlock();
+
+        json result;
+        run(result);
+        cerr << "checkpoint: " << result.dump() << endl;
+
+        lk.lock();
+        m_status = result;
+    }
+}
+
+int checkpointer::write_delta(const string &path, const string &records) {
+    string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        cerr << "checkpoint: cannot create " << tmp << ": " << strerror(errno) << endl;
+        return -1;
+    }
+    io_throttle out(m_rate);
+    bool ok = out.write(fd, records.data(), records.size()) && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp.c_str(), path.c_str()) < 0) {
+        cerr << "checkpoint: cannot write " << path << ": " << strerror(errno) << endl;
+        unlink(tmp.c_str());
+        return -1;
+    }
+    wal_sync_dir(path);
+    return 0;
+}
+
+void checkpointer::remove_upto(const string &kind, uint64_t lsn) {
+    for (auto &f : list_files(m_path, kind)) {
+        if (f.first <= lsn)
+            unlink(f.second.c_str());
+    }
+}
+
+int checkpointer::run(json &result) {
+    auto t0 = chrono::steady_clock::now();
+    vector<string> captured;
+    vector<pair<uint32_t, wal_record>> changed;
+    uint64_t lsn;
+    bool full;
+    double pause_us;
+    {
+        lock_guard<rw_mutex> lk(m_h.m_mutex);
+        lsn = m_wal.last_lsn();
+        if (lsn == m_lsn) {
+            result = json{{"ok", true}, {"kind", "none"}, {"lsn", lsn}};
+            return 0;
+        }
+        full = !m_have_base || m_deltas >= m_max_deltas;
+        captured.assign(m_h.m_dirty.begin(), m_h.m_dirty.end());
+
+        if (full) {
+            json resp;
+            if (snapshot_start(m_h, m_path + ".base", lsn, resp, m_rate) < 0) {
+                result = json{{"ok", false}, {"error", "a snapshot is already running"}};
+                return -1;
+            }
+        } else {
+            /* depth orders parents before children; deleted nodes go last */
+            for (const string &id : captured) {
+                Node *n = m_h.find(id);
+                if (n == nullptr) {
+                    changed.push_back(make_pair(UINT32_MAX,
+                        wal_record(wal_op::delete_node, id, "", "")));
+                    continue;
+                }
+                uint32_t depth = 0;
+                for (Node *cur = n; cur != m_h.root; cur = m_h.find(cur->parent_id))
+                    depth++;
+                changed.push_back(make_pair(depth,
+                    wal_record(wal_op::add_node, n->id, n->name, n->parent_id)));
+            }
+        }
+        if (m_wal.rotate(m_path + ".seg." + to_string(lsn)) < 0) {
+            if (full)
+                snapshot_wait();
+            result = json{{"ok", false}, {"error", "cannot rotate the log"}};
+            return -1;
+        }
+        m_h.m_dirty.clear();
+        pause_us = chrono::duration<double, micro>(chrono::steady_clock::now() - t0).count();
+    }
+
+    int rc;
+    size_t bytes = 0;
+    if (full) {
+        rc = snapshot_wait() ? 0 : -1;
+    } else {
+        stable_sort(changed.begin(), changed.end(),
+                    [](const pair<uint32_t, wal_record> &a, const pair<uint32_t, wal_record> &b) {
+                        return a.first < b.first;
+                    });
+        string records;
+        write_ahead_log::encode_header(records);
+        for (auto &c : changed) {
+            c.second.lsn = lsn;
+            write_ahead_log::encode(c.second, records);
+        }
+        bytes = records.size();
+        rc = write_delta(m_path + ".delta." + to_string(lsn), records);
+    }
+
+    if (rc < 0) {
+        /* the rotated segment stays, and the next checkpoint covers these again */
+        lock_guard<rw_mutex> lk(m_h.m_mutex);
+        m_h.m_dirty.insert(captured.begin(), captured.end());
+        result = json{{"ok", false}, {"kind", full ? "base" : "delta"}, {"lsn", lsn}};
+        return -1;
+    }
+
+    if (full) {
+        remove_upto("delta", lsn);
+        m_have_base = true;
+        m_deltas = 0;
+    } else {
+        m_deltas++;
+    }
+    remove_upto("seg", lsn);
+    m_lsn = lsn;
+
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+    result = json{{"ok", true}, {"kind", full ? "base" : "delta"}, {"lsn", lsn},
+                  {"nodes", captured.size()}, {"pause_us", pause_us}, {"duration_ms", ms},
+                  {"deltas", m_deltas}};
+    if (!full)
+        result["bytes"] = bytes;
+    return 0;
+}
@@ -0,0 +1,102 @@
+#include <string>
+#include <cstring>
+#include <algorithm>
+#include "nlohmann/json.hpp"
+#include "codec.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+bool parse_wire_format(const string &s, wire_format &fmt) {
+    if (s == "json" || s == "text")
+        fmt = wire_format::text;
+    else if (s == "cbor")
+        fmt = wire_format::cbor;
+    else if (s == "msgpack")
+        fmt = wire_format::msgpack;
+    else
+        return false;
+    return true;
+}
+
+row_format wire_row_format(wire_format fmt) {
+    return fmt == wire_format::text ? row_format::object : row_format::array;
+}
+
+int decode_request(const char *data, size_t len, wire_format fmt, json &j,
+                   size_t &consumed, size_t *scanned) {
+    consumed = 0;
+    if (fmt == wire_format::text) {
+        /* a line may hold MAX_FRAME_SIZE bytes before its newline */
+        size_t scan = min(len, size_t(MAX_FRAME_SIZE) + 1);
+        size_t from = scanned ? min(*scanned, scan) : 0;
+        const char *eol = static_cast<const char *>(memchr(data + from, '\n', scan - from));
+        if (eol == nullptr) {
+            if (scanned)
+                *scanned = scan;
+            return len > MAX_FRAME_SIZE ? -1 : 0;
+        }
+        if (scanned)
+            *scanned = 0;
+        const char *end = eol;
+        if (end > data && end[-1] == '\r')
+            end--;
+        consumed = eol - data + 1;
+        if (end == data)
+            j = nullptr;
+        else
+            j = json::parse(data, end, nullptr, false);
+        return 1;
+    }
+
+    if (len < 4)
+        return 0;
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+    uint32_t size = (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+                    (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+    if (size > MAX_FRAME_SIZE)
+        return -1;
+    if (len - 4 < size)
+        return 0;
+    consumed = 4 + size;
+
+    j = decode_payload(data + 4, size, fmt);
+    return 1;
+}
+
+json decode_payload(const char *data, size_t len, wire_format fmt) {
+    const uint8_t *first = reinterpret_cast<const uint8_t *>(data);
+    const uint8_t *last = first + len;
+    if (fmt == wire_format::cbor)
+        return json::from_cbor(first, last, true, false);
+    if (fmt == wire_format::msgpack)
+        return json::from_msgpack(first, last, true, false);
+    return json::parse(data, data + len, nullptr, false);
+}
+
+void encode_payload(const json &j, wire_format fmt, string &out) {
+    if (fmt == wire_format::cbor)
+        json::to_cbor(j, out);
+    else if (fmt == wire_format::msgpack)
+        json::to_msgpack(j, out);
+    else
+        out += j.dump();
+}
+
+void encode_response(const json &resp, wire_format fmt, string &out) {
+    if (fmt == wire_format::text) {
+        out += resp.dump();
+        out += '\n';
+        return;
+    }
+
+    /* reserve the length prefix, encode in place, then patch the length */
+    size_t head = out.size();
+    out.append(4, '\0');
+    encode_payload(resp, fmt, out);
+    uint32_t size = out.size() - head - 4;
+    out[head] = char(size >> 24);
+    out[head + 1] = char(size >> 16);
+    out[head + 2] = char(size >> 8);
+    out[head + 3] = char(size);
+}
@@ -0,0 +1,122 @@
+#include <iostream>
+#include <functional>
+#include <chrono>
+#include "nlohmann/json.hpp"
+#include "hierarchy.h"
+#include "epoch.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+/* the slot this thread has pinned, and where it starts looking for one */
+static thread_local int t_slot = -1;
+static thread_local size_t t_hint = hash<thread::id>()(this_thread::get_id());
+
+epoch_manager::~epoch_manager() {
+    stop();
+    for (auto &r : m_retired)
+        delete r.second;
+}
+
+void epoch_manager::start(int interval_ms) {
+    m_thread = thread([this, interval_ms]() {
+        unique_lock<mutex> lk(m_run_lock);
+        while (!m_stop) {
+            m_wake.wait_for(lk, chrono::milliseconds(interval_ms));
+            lk.unlock();
+            collect();
+            lk.lock();
+        }
+    });
+}
+
+void epoch_manager::stop() {
+    {
+        lock_guard<mutex> lk(m_run_lock);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+void epoch_manager::enter() {
+    /* a free slot; there are more than threads that query at once */
+    size_t i = t_hint % MAX_READERS;
+    for (size_t tries = 1; ; tries++, i = (i + 1) % MAX_READERS) {
+        bool expected = false;
+        if (!m_slots[i].used.load(memory_order_relaxed) &&
+            m_slots[i].used.compare_exchange_strong(expected, true))
+            break;
+        if (tries % MAX_READERS == 0)
+            this_thread::yield();
+    }
+    t_slot = i;
+    t_hint = i;
+
+    /* the pin counts once the epoch is seen unchanged after publishing it */
+    slot &s = m_slots[i];
+    uint64_t e = m_epoch.load();
+    for (;;) {
+        s.epoch.store(e);
+        uint64_t now = m_epoch.load();
+        if (now == e)
+            break;
+        e = now;
+    }
+}
+
+void epoch_manager::leave() {
+    slot &s = m_slots[t_slot];
+    s.epoch.store(IDLE, memory_order_release);
+    s.used.store(false, memory_order_release);
+    t_slot = -1;
+}
+
+void epoch_manager::retire(Node *n) {
+    uint64_t e = m_epoch.load();
+    lock_guard<mutex> lk(m_lock);
+    m_retired.push_back(make_pair(e, n));
+}
+
+size_t epoch_manager::collect() {
+    uint64_t oldest = m_epoch.fetch_add(1) + 1;
+    for (slot &s : m_slots) {
+        uint64_t e = s.epoch.load();
+        if (e < oldest)
+            oldest = e;
+    }
+
+    vector<Node *> dead;
+    {
+        lock_guard<mutex> lk(m_lock);
+        size_t k = 0;
+        for (auto &r : m_retired) {
+            if (r.first < oldest)
+                dead.push_back(r.second);
+            else
+                m_retired[k++] = r;
+        }
+        m_retired.resize(k);
+    }
+    for (Node *n : dead)
+        delete n;
+    m_freed += dead.size();
+    m_passes++;
+    return dead.size();
+}
+
+json epoch_manager::status() {
+    size_t readers = 0;
+    for (slot &s : m_slots) {
+        if (s.epoch.load() != IDLE)
+            readers++;
+    }
+    size_t retired;
+    {
+        lock_guard<mutex> lk(m_lock);
+        retired = m_retired.size();
+    }
+    return json{{"epoch", m_epoch.load()}, {"readers", readers}, {"retired", retired},
+                {"freed", m_freed.load()}, {"passes", m_passes.load()}};
+}
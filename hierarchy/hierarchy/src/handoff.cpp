@@ -0,0 +1,519 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "nlohmann/json.hpp"
+#include "hierarchy.h"
+#include "wal.h"
+#include "checkpoint.h"
+#include "snapshot.h"
+#include "handoff.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+/* descriptors per SCM_RIGHTS message, below the kernel's SCM_MAX_FD */
+static const size_t FDS_PER_MSG = 200;
+static const char ACK = 'k';
+/* step 1: the child wrote the image, or failed to; the successor loaded it */
+static const char IMAGE_READY = 'i';
+static const char IMAGE_FAILED = 'x';
+static const char IMAGE_LOADED = 'r';
+/* log records left over that make step 2 worth starting */
+static const int CATCH_UP_DONE = 100;
+
+static bool write_all(int fd, const char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* exactly len bytes, so a read never runs into the descriptors after them */
+static bool read_all(int fd, char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool send_fds(int sock, const int *fds, size_t count) {
+    char byte = 0;
+    struct iovec iov = { &byte, 1 };
+    vector<char> ctl(CMSG_SPACE(count * sizeof(int)));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.data();
+    msg.msg_controllen = ctl.size();
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cm), fds, count * sizeof(int));
+    while (true) {
+        ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        return n == 1;
+    }
+}
+
+static bool recv_fds(int sock, vector<int> &fds, size_t count) {
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    vector<char> ctl(CMSG_SPACE(count * sizeof(int)));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.data();
+    msg.msg_controllen = ctl.size();
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (n != 1 || cm == nullptr || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+        return false;
+    size_t got = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    const int *p = reinterpret_cast<const int *>(CMSG_DATA(cm));
+    fds.insert(fds.end(), p, p + got);
+    return got == count && !(msg.msg_flags & MSG_CTRUNC);
+}
+
+static void set_timeouts(int fd, int sec) {
+    struct timeval tv = { sec, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static double ms_since(chrono::steady_clock::time_point t0) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+}
+
+handoff::~handoff() {
+    if (m_peer >= 0)
+        close(m_peer);
+    if (m_listen_fd >= 0) {
+        close(m_listen_fd);
+        unlink(m_path.c_str());
+    }
+}
+
+int handoff::listen_on(const string &path) {
+    struct sockaddr_un addr;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        cerr << "handoff: socket path too long: " << path << endl;
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        cerr << "handoff: socket: " << strerror(errno) << endl;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(path.c_str());
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        cerr << "handoff: cannot listen on " << path << ": " << strerror(errno) << endl;
+        close(fd);
+        return -1;
+    }
+    m_listen_fd = fd;
+    m_path = path;
+    return 0;
+}
+
+/* a length-prefixed CBOR object, then its descriptors, if any, in one message */
+static bool send_meta(int sock, const json &meta, const vector<int> &fds) {
+    vector<uint8_t> encoded = json::to_cbor(meta);
+    uint32_t len = encoded.size();
+    return write_all(sock, reinterpret_cast<const char *>(&len), sizeof(len)) &&
+           write_all(sock, reinterpret_cast<const char *>(encoded.data()), len) &&
+           (fds.empty() || send_fds(sock, fds.data(), fds.size()));
+}
+
+static bool recv_meta(int sock, json &meta) {
+    uint32_t len;
+    string encoded;
+    if (!read_all(sock, reinterpret_cast<char *>(&len), sizeof(len)))
+        return false;
+    encoded.resize(len);
+    if (!read_all(sock, &encoded[0], len))
+        return false;
+    meta = json::from_cbor(encoded, true, false);
+    return meta.is_object();
+}
+
+void handoff::give(const handoff_state &st) {
+    if (m_giving >= 0) {
+        /* step 2, unless the successor gave up on the image */
+        char ready = 0;
+        if (read_all(m_giving, &ready, 1) && ready == IMAGE_LOADED)
+            finish(st, true);
+        else
+            abandon();
+        return;
+    }
+
+    int peer = accept4(m_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (peer < 0)
+        return;
+    set_timeouts(peer, TIMEOUT_SEC);
+    m_giving = peer;
+    m_started = chrono::steady_clock::now();
+    if (m_h.m_checkpoint)
+        m_ckpt.stop();
+    if (m_h.m_wal)
+        prepare(peer);
+    else
+        finish(st, false);
+}
+
+/*
+ * Step 1: fork a child that writes the image into a memfd for the
+ * successor, and let the caller get back to serving.
+ */
+void handoff::prepare(int peer) {
+    int mfd = memfd_create("hierarchy-handoff", MFD_CLOEXEC);
+    if (mfd < 0) {
+        abandon();
+        return;
+    }
+    /* make sure the child never has to run one-time initialisation */
+    wal_crc32("", 0);
+    auto t0 = chrono::steady_clock::now();
+    {
+        unique_lock<rw_mutex> lk(m_h.m_mutex);
+        /* the records after the image start where the synced log ends */
+        int wal_fd = m_wal.quiesce();
+        struct stat st;
+        m_image_lsn = m_wal.last_lsn();
+        if (fstat(wal_fd, &st) == 0 &&
+            send_meta(peer, json{{"image_lsn", m_image_lsn}, {"tail_offset", st.st_size},
+                                 {"wal", m_wal.path()}},
+                      vector<int>{mfd}))
+            m_child = fork();
+        if (m_child == 0) {
+            /*
+             * child: the tree is frozen at the moment of the fork, and so
+             * is the checkpointer's dirty set, which can be as big as the
+             * tree; the records after the image mark the rest again
+             */
+            char done = snapshot_write_fd(m_h, mfd, m_image_lsn) == 0 ? IMAGE_READY : IMAGE_FAILED;
+            bool sent = write_all(peer, &done, 1) && done == IMAGE_READY &&
+                        send_meta(peer, m_ckpt.handoff_state(), vector<int>());
+            _exit(sent ? 0 : 1);
+        }
+    }
+    close(mfd);
+    if (m_child < 0) {
+        cerr << "handoff: cannot prepare an image for the successor" << endl;
+        abandon();
+        return;
+    }
+    cerr << "handoff: successor loading an image at lsn " << m_image_lsn << ", "
+         << ms_since(t0) << " ms under the lock" << endl;
+}
+
+/* Step 2, or the only step without a log: hand everything over and exit. */
+void handoff::finish(const handoff_state &st, bool prepared) {
+    auto t0 = chrono::steady_clock::now();
+    unique_lock<rw_mutex> lk(m_h.m_mutex);
+
+    bool logging = m_h.m_wal != nullptr;
+    int wal_fd = logging ? m_wal.quiesce() : -1;
+    uint64_t lsn = logging ? m_wal.last_lsn() : 0;
+
+    /* the image is written after the log is synced, so it is exactly lsn */
+    int mfd = -1;
+    bool ok = true;
+    if (!prepared) {
+        mfd = memfd_create("hierarchy-handoff", MFD_CLOEXEC);
+        ok = mfd >= 0 && snapshot_write_fd(m_h, mfd, lsn) == 0;
+    }
+    size_t nodes = m_h.m_index.size();
+    if (ok) {
+        json conns = json::array();
+        for (const handoff_conn &c : st.conns)
+            conns.push_back(json{{"in", c.in}, {"out", c.out}, {"reading", c.reading},
+                                 {"closing", c.closing}});
+        json meta{{"lsn", lsn}, {"format", int(st.fmt)}, {"stdin", st.stdin_in},
+                  {"conns", conns}};
+        meta["wal"] = logging ? json(m_wal.path()) : json(nullptr);
+        meta["listen"] = st.listen_fd >= 0 ? json(st.listen_path) : json(nullptr);
+        if (logging && !prepared)
+            meta["checkpoint"] = m_ckpt.handoff_state();
+
+        vector<int> fds;
+        if (!prepared)
+            fds.push_back(mfd);
+        if (logging)
+            fds.push_back(wal_fd);
+        if (st.listen_fd >= 0)
+            fds.push_back(st.listen_fd);
+        fds.push_back(STDIN_FILENO);
+        fds.push_back(STDOUT_FILENO);
+
+        ok = send_meta(m_giving, meta, fds);
+        for (size_t i = 0; ok && i < st.conns.size(); i += FDS_PER_MSG) {
+            vector<int> chunk;
+            for (size_t j = i; j < st.conns.size() && j < i + FDS_PER_MSG; j++)
+                chunk.push_back(st.conns[j].fd);
+            ok = send_fds(m_giving, chunk.data(), chunk.size());
+        }
+        char ack = 0;
+        ok = ok && read_all(m_giving, &ack, 1) && ack == ACK;
+    }
+
+    if (ok) {
+        /*
+         * Everything is the successor's now; confirm, so it knows this
+         * process did not give up waiting. Leave without unwinding: no
+         * destructor may unlink its sockets or write to its log, and the
+         * lock stays held so nothing else here runs another request.
+         */
+        write_all(m_giving, &ACK, 1);
+        cerr << "handoff: " << nodes << " nodes, " << st.conns.size()
+             << " connections handed over at lsn " << lsn << ", " << ms_since(t0)
+             << " ms under the lock, " << ms_since(m_started) << " ms in all" << endl;
+        _exit(0);
+    }
+
+    cerr << "handoff: successor did not take over, carrying on" << endl;
+    if (mfd >= 0)
+        close(mfd);
+    lk.unlock();
+    abandon();
+}
+
+/* the successor went away: carry on serving, ready for the next one */
+void handoff::abandon() {
+    if (m_child > 0) {
+        kill(m_child, SIGKILL);
+        while (waitpid(m_child, nullptr, 0) < 0 && errno == EINTR)
+            ;
+    }
+    m_child = -1;
+    if (m_giving >= 0)
+        close(m_giving);
+    m_giving = -1;
+    if (m_h.m_checkpoint)
+        m_ckpt.resume();
+}
+
+/*
+ * Apply the whole records the old process logged from offset on, after the
+ * image, and move offset past them; returns how many were applied. The
+ * handed-over descriptor is write-only, so the log is opened again.
+ */
+int handoff::catch_up(const string &wal_path, uint64_t &offset, uint64_t &lsn) {
+    int fd = open(wal_path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || uint64_t(st.st_size) < offset) {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    string tail(st.st_size - offset, '\0');
+    size_t got = 0;
+    while (got < tail.size()) {
+        ssize_t n = pread(fd, &tail[got], tail.size() - got, offset + got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        got += n;
+    }
+    close(fd);
+    if (got < tail.size())
+        return -1;
+    const char *p = tail.data();
+    const char *end = p + tail.size();
+    wal_record rec;
+    size_t len;
+    int applied = 0;
+    while (p < end && write_ahead_log::decode(p, end, rec, len)) {
+        if (rec.lsn > lsn) {
+            lsn = rec.lsn;
+            m_h.apply(move(rec));
+            applied++;
+        }
+        p += len;
+    }
+    /* a record still being written is picked up next time */
+    offset += p - tail.data();
+    return applied;
+}
+
+int handoff::take(const string &path, const string &wal_path, wal_sync policy,
+                  int interval_ms, handoff_state &st, uint64_t &lsn) {
+    auto t0 = chrono::steady_clock::now();
+    struct sockaddr_un addr;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        cerr << "handoff: socket path too long: " << path << endl;
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        cerr << "handoff: cannot connect to " << path << ": " << strerror(errno) << endl;
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    set_timeouts(fd, TIMEOUT_SEC);
+
+    json meta, ckpt;
+    vector<int> fds;
+    bool ok = recv_meta(fd, meta);
+    bool prepared = ok && meta["image_lsn"].is_number_unsigned();
+    uint64_t tail_offset = 0;
+    double load_ms = 0;
+    if (prepared) {
+        /* step 1: load the image while the old process keeps serving */
+        tail_offset = meta.value("tail_offset", uint64_t(0));
+        char image = 0;
+        ok = recv_fds(fd, fds, 1) && read_all(fd, &image, 1) && image == IMAGE_READY &&
+             recv_meta(fd, ckpt) && snapshot_load_fd(m_h, fds[0], lsn) == 0 &&
+             lsn == meta["image_lsn"].get<uint64_t>();
+        for (int d : fds)
+            close(d);
+        fds.clear();
+        /* as of the image; catching up marks what changed since */
+        if (ok)
+            m_ckpt.adopt(ckpt);
+        /* it can hold every ID; freeing it is not for step 2 */
+        ckpt = json();
+        /* while the old process keeps logging, until step 2 has little left */
+        ok = ok && meta["wal"] == wal_path;
+        for (int pass = 0, n = CATCH_UP_DONE + 1; ok && n > CATCH_UP_DONE && pass < 8; pass++)
+            ok = (n = catch_up(wal_path, tail_offset, lsn)) >= 0;
+        load_ms = ms_since(t0);
+        ok = ok && write_all(fd, &IMAGE_LOADED, 1) && recv_meta(fd, meta);
+    }
+    if (!ok || !meta["conns"].is_array()) {
+        cerr << "handoff: no state received from " << path << endl;
+        close(fd);
+        return -1;
+    }
+
+    auto t1 = chrono::steady_clock::now();
+    bool have_wal = meta["wal"].is_string();
+    bool have_listen = meta["listen"].is_string();
+    const json &conns = meta["conns"];
+    ok = recv_fds(fd, fds, (prepared ? 2 : 3) + have_wal + have_listen);
+    for (size_t i = 0; ok && i < conns.size(); i += FDS_PER_MSG)
+        ok = recv_fds(fd, fds, min(FDS_PER_MSG, conns.size() - i));
+    if (!ok) {
+        cerr << "handoff: descriptors missing from " << path << endl;
+        for (int d : fds)
+            close(d);
+        close(fd);
+        return -1;
+    }
+
+    size_t k = 0;
+    int mfd = prepared ? -1 : fds[k++];
+    int wal_fd = have_wal ? fds[k++] : -1;
+    int listen_fd = have_listen ? fds[k++] : -1;
+    int in_fd = fds[k++];
+    int out_fd = fds[k++];
+
+    if (have_wal && meta["wal"].get<string>() != wal_path) {
+        cerr << "handoff: the running process logs to " << meta["wal"].get<string>()
+             << ", start with --wal " << meta["wal"].get<string>() << endl;
+        ok = false;
+    }
+    if (prepared && (!ok || !have_wal || catch_up(wal_path, tail_offset, lsn) < 0 ||
+                     lsn != meta.value("lsn", uint64_t(0)))) {
+        cerr << "handoff: cannot catch up with the log after the image" << endl;
+        ok = false;
+    }
+    if (!prepared)
+        ok = ok && snapshot_load_fd(m_h, mfd, lsn) == 0;
+    if (ok && have_wal) {
+        ok = m_wal.adopt(wal_fd, wal_path, policy, interval_ms, lsn) == 0;
+        if (ok && !prepared)
+            m_ckpt.adopt(meta["checkpoint"]);
+    } else if (ok && !wal_path.empty()) {
+        /* logging starts here; the first checkpoint writes a base */
+        ok = m_wal.open(wal_path, policy, interval_ms, lsn) == 0;
+        if (ok)
+            m_ckpt.adopt(json{{"lsn", 0}});
+    }
+    if (mfd >= 0)
+        close(mfd);
+    if (!ok) {
+        for (size_t i = prepared ? 0 : 1; i < fds.size(); i++)
+            close(fds[i]);
+        close(fd);
+        return -1;
+    }
+    if (!wal_path.empty())
+        m_h.m_wal = &m_wal;
+
+    dup2(in_fd, STDIN_FILENO);
+    dup2(out_fd, STDOUT_FILENO);
+    close(in_fd);
+    close(out_fd);
+
+    st.fmt = wire_format(meta.value("format", 0));
+    st.listen_fd = listen_fd;
+    st.listen_path = have_listen ? meta["listen"].get<string>() : "";
+    st.stdin_in = meta.value("stdin", "");
+    st.conns.clear();
+    for (size_t i = 0; i < conns.size(); i++)
+        st.conns.push_back(handoff_conn{fds[k + i], conns[i].value("in", ""),
+                                        conns[i].value("out", ""),
+                                        conns[i].value("reading", true),
+                                        conns[i].value("closing", false)});
+    m_peer = fd;
+    m_take_ms = ms_since(t1);
+    cerr << "handoff: received " << m_h.m_index.size() << " nodes, " << st.conns.size()
+         << " connections at lsn " << lsn << " in " << m_take_ms << " ms";
+    if (prepared)
+        cerr << ", after loading the image in " << load_ms << " ms";
+    cerr << endl;
+    return 0;
+}
+
+int handoff::done() {
+    if (m_peer < 0)
+        return -1;
+    char reply = 0;
+    bool ok = write_all(m_peer, &ACK, 1) && read_all(m_peer, &reply, 1) && reply == ACK;
+    close(m_peer);
+    m_peer = -1;
+    if (!ok)
+        cerr << "handoff: the old process carried on, giving up" << endl;
+    return ok ? 0 : -1;
+}
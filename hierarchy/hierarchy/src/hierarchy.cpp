@@ -5,10 +5,79 @@
 #include <set>
 #include "nlohmann/json.hpp"
 #include "hierarchy.h"
+#include "lazy.h"
+#include "replication.h"
+#include "history.h"
+#include "mvcc.h"
+#include "epoch.h"
+#include "subtree_locks.h"
 
 using json = nlohmann::json;
 using namespace std;
 
+static const size_t NODE_SLAB = 4096;
+
+struct free_node {
+    free_node *next;
+};
+
+static mutex pool_lock;
+static free_node *pool_free = nullptr;
+static char *pool_cur = nullptr;
+static size_t pool_left = 0;
+
+void node_pool::reserve(size_t count) {
+    lock_guard<mutex> lk(pool_lock);
+    if (pool_left >= count)
+        return;
+    /* the tail of the previous slab stays usable through the free list */
+    while (pool_left > 0) {
+        free_node *f = reinterpret_cast<free_node *>(pool_cur);
+        f->next = pool_free;
+        pool_free = f;
+        pool_cur += sizeof(Node);
+        pool_left--;
+    }
+    pool_cur = static_cast<char *>(::operator new(count * sizeof(Node)));
+    pool_left = count;
+}
+
+void *node_pool::alloc(size_t size) {
+    if (size != sizeof(Node))
+        return ::operator new(size);
+    lock_guard<mutex> lk(pool_lock);
+    if (pool_free) {
+        free_node *f = pool_free;
+        pool_free = f->next;
+        return f;
+    }
+    if (pool_left == 0) {
+        pool_cur = static_cast<char *>(::operator new(NODE_SLAB * sizeof(Node)));
+        pool_left = NODE_SLAB;
+    }
+    void *p = pool_cur;
+    pool_cur += sizeof(Node);
+    pool_left--;
+    return p;
+}
+
+void node_pool::release(void *p) {
+    if (p == nullptr)
+        return;
+    lock_guard<mutex> lk(pool_lock);
+    free_node *f = static_cast<free_node *>(p);
+    f->next = pool_free;
+    pool_free = f;
+}
+
+rw_mutex::rw_mutex() {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&m_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+}
+
 /*
  * Description: Add a new node to the tree.
  *
@@ -26,80 +95,49 @@ using namespace std;
  *    - Name and ID must be specified and not empty strings.
  *    - If specified, parent node must exist.
  */
-void hierarchy::add_node(string name, string id, string parent_id) {
+bool hierarchy::add_node(string name, string id, string parent_id) {
     /* Name and ID must be specified and not empty strings. */
     if (id == "" || name == "") {
-        std::cout << fail << std::endl;
-        return;
+        return false;
     }
 
+    /* No two nodes in the tree can have the same ID. */
+    if (find(id))
+        return false;
+
     /* There can only be one root node */
     if (parent_id == "") {
-        if (root != nullptr) {
-            std::cout << fail << std::endl;
-            return;
+        if (load_link(root) != nullptr) {
+            return false;
         } else {
-            root = new Node(id, name);
-            std::cout << pass << std::endl;
-            return;
-        }
-    }
-
-    /* Inorder Traversal */
-    stack<Node *> s;
-    Node *cur = root;
-    Node *parent = nullptr;
-    while (cur || !s.empty()) {
-        if (cur) {
-            s.push(cur);
-            cur = cur->child;
-        } else {
-            Node *node = s.top();
-            s.pop();
-            /* unique id, siblings cannot have the same name */
-            if ((node->id == id) ||
-                 (node->parent_id == parent_id && node->name == name))
-            {
-                std::cout << fail << std::endl;
-                return;
-            }
-            if (node->id == parent_id)
-                parent = node;
-            cur = node->next;
+            store_link(root, new Node(id, name));
+            m_index.insert(root);
+            mark_dirty(id);
+            if (m_mvcc)
+                m_mvcc->add(id, name, "");
+            return true;
         }
     }
 
     /* parent node must exist */
+    Node *parent = find(parent_id);
     if (nullptr == parent) {
-        std::cout << fail << std::endl;
-        return;
-    }
-
-    /* check if it is the first child */
-    if (nullptr == parent->child) {
-        parent->child = new Node(id, name, parent_id);
-        std::cout << pass << std::endl;
-        return;
-    } else {
-        cur = parent->child;
-        if (cur->name > name) {
-            parent->child = new Node(id, name, parent_id);
-            parent->child->next = cur;
-            std::cout << pass << std::endl;
-            return;
-        }
-        while (cur->next && cur->next->name <= name) {
-            cur = cur->next;
-        }
-        Node *next = cur->next;
-        cur->next = new Node(id, name, parent_id);
-        cur->next->next = next;
-        std::cout << pass << std::endl;
-        return;
+        return false;
     }
 
-    cout << "it should never be printed !" << endl;
-    return;
+    /* siblings cannot have the same name */
+    if (find_child(parent, name))
+        return false;
+
+    Node *node = new Node(id, name, parent_id);
+    link_child(parent, node);
+    m_index.insert(node);
+    mark_dirty(id);
+    if (m_lazy)
+        m_lazy->modified(*this, parent);
+    if (m_mvcc)
+        m_mvcc->add(id, name, parent_id);
+    return true;
 }
 
 /*
@@ -113,55 +151,43 @@ void hierarchy::add_node(string name, string id, string parent_id) {
  *    - Node must exist.
  *    - Node must not have children.
  */
-void hierarchy::delete_node(string id) {
+bool hierarchy::delete_node(string id) {
     /* ID must be specified and not empty strings. */
     if (id == "") {
-        std::cout << fail << std::endl;
-        return;
+        return false;
     }
 
-    /* Inorder Traversal */
-    stack<Node *> s;
-    Node *cur = root;
-    Node *parent = nullptr;
-    while (cur || !s.empty()) {
-        if (cur) {
-            s.push(cur);
-            cur = cur->child;
-        } else {
-            Node *node = s.top();
-            s.pop();
-            if (node->next && node->next->id == id) {
-                /* Node must not have children. */
-                if (nullptr != node->next->child) {
-                    std::cout << fail << std::endl;
-                    return;
-                }
-                Node *next = node->next;
-                node->next = node->next->next;
-                delete next;
-                std::cout << pass << std::endl;
-                return;
-            }
-            if (node->id == id) {
-                /* Node must not have children. */
-                if (nullptr != node->child) {
-                    std::cout << fail << std::endl;
-                    return;
-                }
-                parent = s.top();
-                parent->child = node->next;
-                node->next = nullptr;
-                delete node;
-                std::cout << pass << std::endl;
-                return;
-            }
-            cur = node->next;
-        }
+    /* Node must exist. */
+    Node *node = find(id);
+    if (nullptr == node) {
+        return false;
     }
 
-    /* Node must exist. */
-    std::cout << fail << std::endl;
+    /* Node must not have children. */
+    expand(node);
+    if (nullptr != node->child) {
+        return false;
+    }
+
+    if (node == load_link(root)) {
+        store_link(root, nullptr);
+    } else {
+        Node *parent = find(node->parent_id);
+        unlink_child(parent, node);
+        if (m_lazy)
+            m_lazy->modified(*this, parent);
+    }
+    if (m_lazy)
+        m_lazy->forget(node);
+    m_index.erase(id);
+    if (m_epochs)
+        m_epochs->retire(node);
+    else
+        delete node;
+    mark_dirty(id);
+    if (m_mvcc)
+        m_mvcc->remove(id);
+    return true;
 }
 
 
@@ -179,153 +205,109 @@ void hierarchy::delete_node(string id) {
  *      the new parent's other children.
  *    - Move must not create a cycle in the tree.
  */
-void hierarchy::move_node(string id, string new_parent_id) {
+bool hierarchy::move_node(string id, string new_parent_id) {
     /* ID and new parent ID must be specified and not empty strings. */
-    if (id == "" || new_parent_id == "" || id == root->id ||
+    Node *top = load_link(root);
+    if (id == "" || new_parent_id == "" || top == nullptr || id == top->id ||
         id == new_parent_id) {
-        std::cout << fail << std::endl;
-        return;
+        return false;
     }
 
-    stack<Node *> s;
-    stack<Node *> ss;
-    s.push(root);
-    Node *parent_tmp = root;
-    Node *parent = nullptr;
-    Node *prev = nullptr;
-    Node *child = nullptr;
-    Node *new_parent = nullptr;
-    int depth = 0;
-
-    find_root_id_node(root, &new_parent, new_parent_id, depth);
-    if (nullptr == new_parent) {
-        std::cout << fail << std::endl;
-        return;
+    /* Both nodes must exist. */
+    Node *child = find(id);
+    Node *new_parent = find(new_parent_id);
+    if (nullptr == child || nullptr == new_parent) {
+        return false;
     }
 
-    /* Preorder Traversal */
-    while (s.size() > 0) {
-        Node *node = s.top();
-        s.pop();
-
-        /* Move must not create a cycle in the tree. */
-        if (!child && node->next && node->next->id == id) {
-            prev = node;
-            child = node->next;
-            if (child->child) {
-                ss.push(child->child);
-                while (ss.size() > 0) {
-                    Node *node_tmp = ss.top();
-                    ss.pop();
-                    if (node_tmp->id == new_parent_id) {
-                        std::cout << fail << std::endl;
-                        return;
-                    }
-                    if (node_tmp->child) ss.push(node_tmp->child);
-                    if (node_tmp->next) ss.push(node_tmp->next);
-                }
-            }
-            break;
-        }
+    /* Move must not create a cycle in the tree. */
+    for (Node *cur = new_parent; cur != top; cur = find(cur->parent_id)) {
+        if (cur == child)
+            return false;
+    }
 
-        /* Move must not create a cycle in the tree. */
-        if (!child && node->id == id) {
-            parent = parent_tmp;
-            child = node;
-            if (child->child) {
-                ss.push(child->child);
-                while (ss.size() > 0) {
-                    Node *node_tmp = ss.top();
-                    ss.pop();
-                    if (node_tmp->id == new_parent_id) {
-                        std::cout << fail << std::endl;
-                        return;
-                    }
-                    if (node_tmp->child) ss.push(node_tmp->child);
-                    if (node_tmp->next) ss.push(node_tmp->next);
-                }
-            }
-            break;
-        }
+    /* check same name */
+    if (find_child(new_parent, child->name))
+        return false;
+
+    /* move from parent, then to new parent */
+    Node *old_parent = find(child->parent_id);
+    unlink_child(old_parent, child);
+    if (m_epochs) {
+        /*
+         * a lock-free query standing on child carries on along its old
+         * siblings with its old parent; the new parent gets a copy
+         */
+        Node *copy = new Node(child->id, child->name, new_parent->id);
+        copy->child = child->child;
+        copy->snap = child->snap;
+        m_index.replace(copy);
+        m_epochs->retire(child);
+        child = copy;
+    } else {
+        child->parent_id = new_parent->id;
+    }
+    link_child(new_parent, child);
+    mark_dirty(id);
+    if (m_lazy) {
+        m_lazy->modified(*this, old_parent);
+        m_lazy->modified(*this, new_parent);
+    }
+    if (m_mvcc)
+        m_mvcc->move(id, new_parent_id);
+    return true;
+}
 
-        if ((node->child) && (!child) || (child && prev)) {
-            parent_tmp = node;
-            s.push(node->child);
-        }
-        if (node->next) {
-            if (node->next == child) {
-                if (node->next->next)
-                    s.push(node->next->next);
-            } else {
-                s.push(node->next);
-            }
-        }
+Node *hierarchy::find(const string &id) {
+    if (Node *n = m_index.find(id))
+        return n;
+    return m_lazy ? m_lazy->lookup(*this, id) : nullptr;
+}
+
+/* make sure the children of node are in memory */
+void hierarchy::expand(Node *node) {
+    if (node->snap != UINT32_MAX && m_lazy)
+        m_lazy->load(*this, node);
+}
+
+Node *hierarchy::find_child(Node *parent, const string &name) {
+    expand(parent);
+    for (Node *cur = parent->child; cur && cur->name <= name; cur = cur->next) {
+        if (cur->name == name)
+            return cur;
     }
+    return nullptr;
+}
 
-    /* Both nodes must exist. */
-    if (child == nullptr) {
-        std::cout << fail << std::endl;
+/* insert child into parent's sibling list, keeping it ordered by name */
+void hierarchy::link_child(Node *parent, Node *child) {
+    expand(parent);
+    Node *cur = parent->child;
+    if (nullptr == cur || cur->name > child->name) {
+        store_link(child->next, cur);
+        store_link(parent->child, child);
         return;
     }
+    while (cur->next && cur->next->name <= child->name) {
+        cur = cur->next;
+    }
+    store_link(child->next, cur->next);
+    store_link(cur->next, child);
+}
 
-    /* check if it is the first child */
-    if (nullptr == new_parent->child) {
-        if (prev) {
-            prev->next = prev->next->next;
-            child->next = nullptr;
-        } else if (parent) {
-            parent->child = child->next;
-            child->next = nullptr;
-        } else {
-            cout << "somthing wrong, should not be here" << endl;
-            return;
-        }
-
-        new_parent->child = child;
-        std::cout << pass << std::endl;
-        return;
+void hierarchy::unlink_child(Node *parent, Node *child) {
+    if (parent->child == child) {
+        store_link(parent->child, child->next);
     } else {
-        Node *cur = new_parent->child;
-        /* check same name */
-        while (cur) {
-            if (cur->name == child->name) {
-                std::cout << fail << std::endl;
-                return;
-            }
+        Node *cur = parent->child;
+        while (cur && cur->next != child)
             cur = cur->next;
-        }
-
-        /* move from parent */
-        if (prev) {
-            prev->next = prev->next->next;
-            child->next = nullptr;
-        } else if (parent) {
-            parent->child = child->next;
-            child->next = nullptr;
-        } else {
-            cout << "somthing wrong, should not be here" << endl;
-            return;
-        }
-
-        /* move to new parent*/
-        cur = new_parent->child;
-        if (cur->name > child->name) {
-            new_parent->child = child;
-            child->next = cur;
-            child->parent_id = new_parent->id;
-            std::cout << pass << std::endl;
-            return;
-        }      
-        while (cur->next && cur->next->name <= child->name) {
-            cur = cur->next;
-        }
-        Node *next = cur->next;
-        cur->next = child;
-        child->next = next;
-        child->parent_id = new_parent->id;
-        std::cout << pass << std::endl;
-        return;
+        if (cur)
+            store_link(cur->next, child->next);
     }
+    /* a lock-free query standing on child still gets to its old siblings */
+    if (!m_epochs)
+        child->next = nullptr;
 }
 
 /*
@@ -341,80 +323,192 @@ void hierarchy::move_node(string id, string new_parent_id) {
  *   - root_ids {list of ids}:  Search subtrees rooted at specified nodes.
  *                              If not specified, search from the root. If any ID
  *                              in the list doesn't exist in the tree, ignore it.
+ *   - rows:                    row_format::array returns every node as
+ *                              [id, name, parent_id] instead of an object.
+ *                              row_format::columnar returns parallel "ids",
+ *                              "names" and "parents" arrays; a parent that was
+ *                              returned earlier is referenced by its row index
+ *                              and only parents outside the result by ID.
+ *   - ctl:                     If given, the walk stops early once ctl's
+ *                              deadline passes or it is cancelled, and sets
+ *                              ctl->stopped. With ctl->yield_lock it lets
+ *                              waiting writers in every so often and then
+ *                              carries on, so nodes they add, delete or move
+ *                              behind the walk's position may be missed.
  */
-void hierarchy::query(int min_depth, int max_depth, vector<string>& names,
- vector<string>& ids, vector<string>& root_ids)
+json hierarchy::query(int min_depth, int max_depth, vector<string>& names,
+ vector<string>& ids, vector<string>& root_ids, row_format rows, query_control *ctl)
 {
     json j_arr;
     json j;
-    json j_tmp;
 
-    if (!root || (max_depth < min_depth)) {
+    if (rows == row_format::columnar)
+        j_arr = json{{"ids", json::array()}, {"names", json::array()},
+                     {"parents", json::array()}};
+
+    Node *top = load_link(root);
+    if (!top || (max_depth < min_depth)) {
         j["nodes"] = j_arr;
-        std::cout << j.dump(4) << std::endl;
-        return;
+        return j;
     }
 
-    m_max_depth = max_depth;
-    m_min_depth = min_depth;
-    for (int i = 0; i < names.size(); i++)
-        m_names_set.insert(names[i]);
-    for (int i = 0; i < ids.size(); i++)
-        m_ids_set.insert(ids[i]);
-    for (int i = 0; i < root_ids.size(); i++) {
-        m_root_ids_set.insert(root_ids[i]);
-    }
-
-    std::set<string>::iterator itr; 
-    if (!m_root_ids_set.empty()) {
-        // code here
-        for (itr = m_root_ids_set.begin(); itr != m_root_ids_set.end(); itr++) {
-            int depth = 0;
-            Node *node_be_found = nullptr;
-            find_root_id_node(root, &node_be_found, *itr, depth);
-            if (node_be_found != nullptr) {
-                preOrder(node_be_found->child, depth + 1);
-            }
+    /* everything the traversal needs lives here, not in the hierarchy */
+    query_context ctx;
+    ctx.max_depth = max_depth;
+    ctx.min_depth = min_depth;
+    ctx.rows = rows;
+    ctx.ctl = ctl;
+    if (rows == row_format::columnar)
+        ctx.out = j_arr;
+    ctx.names.insert(names.begin(), names.end());
+    ctx.ids.insert(ids.begin(), ids.end());
+    std::set<string> root_ids_set(root_ids.begin(), root_ids.end());
+
+    /* each walk starts over from the top if it let go of the lock */
+    if (!root_ids_set.empty()) {
+        for (const string &root_id : root_ids_set) {
+            do {
+                ctx.restart = false;
+                int depth = 0;
+                Node *node_be_found = nullptr;
+                find_root_id_node(load_link(root), &node_be_found, root_id, depth);
+                if (node_be_found != nullptr) {
+                    expand(node_be_found);
+                    preOrder(ctx, node_be_found->child, node_be_found->id, depth + 1);
+                }
+                ctx.seeking = ctx.restart;
+            } while (ctx.restart);
+            if (ctl && ctl->stopped)
+                break;
         }
     }
     else {
-        preOrder(root, 0);
+        do {
+            ctx.restart = false;
+            if ((top = load_link(root)) != nullptr)
+                preOrder(ctx, top, top->parent_id, 0);
+            ctx.seeking = ctx.restart;
+        } while (ctx.restart);
     }
 
-    j["nodes"] = m_j_arr;
-    std::cout << j.dump(4) << std::endl;
+    j["nodes"] = move(ctx.out);
+    return j;
+}
 
-out:
-    m_max_depth = INT_MAX;
-    m_min_depth = 0;
-    m_names_set.clear();
-    m_ids_set.clear();
-    m_root_ids_set.clear();
-    m_j_arr.clear();
+const unsigned query_control::CHECK_EVERY;
+const int query_control::SLICE_US;
+
+/* check the limits of the query, every CHECK_EVERY nodes */
+bool query_context::poll() {
+    if (ctl->stopped)
+        return true;
+    if (++visits % query_control::CHECK_EVERY)
+        return false;
+    if (ctl->cancelled)
+        ctl->stopped = "cancelled";
+    else if (chrono::steady_clock::now() > ctl->deadline)
+        ctl->stopped = "deadline exceeded";
+    return ctl->stopped != nullptr;
 }
 
-void hierarchy::preOrder(Node *node, int depth) {
-    json j_tmp;
+/* at node, let waiting writers have the lock, then walk again from seek */
+static void yield(query_context &ctx, Node *node) {
+    ctx.seek.clear();
+    for (Node *n : ctx.path)
+        ctx.seek.push_back(n->name);
+    ctx.seek.push_back(node->name);
+    ctx.restart = true;
+    ctx.ctl->yields++;
+    ctx.ctl->yield_lock->unlock_shared();
+    ctx.ctl->yield_lock->lock_shared();
+    ctx.ctl->slice_start = chrono::steady_clock::now();
+}
 
+/* parent_id comes from the walk, as a move may be rewriting node->parent_id */
+void hierarchy::preOrder(query_context &ctx, Node *node, const string &parent_id, int depth) {
 	if (node == nullptr)
 	    return;
 
-    if (depth < m_min_depth)
+    if (ctx.ctl) {
+        if (ctx.interrupted())
+            return;
+        if (ctx.seeking && (node = seek(ctx, node, parent_id, depth)) == nullptr)
+            return;
+        if (ctx.ctl->yield_lock && ctx.visits % query_control::CHECK_EVERY == 0 &&
+            ctx.ctl->yield_lock->writers_waiting() && ctx.ctl->slice_over()) {
+            yield(ctx, node);
+            return;
+        }
+    }
+
+    if (depth < ctx.min_depth)
         goto traverse;
 
-    if ((!m_names_set.empty() && !m_names_set.count(node->name)) ||
-        (!m_ids_set.empty() && !m_ids_set.count(node->id))) {
+    if ((!ctx.names.empty() && !ctx.names.count(node->name)) ||
+        (!ctx.ids.empty() && !ctx.ids.count(node->id))) {
         goto traverse;
     } else {
-        j_tmp = json{{"name", node->name}, {"id", node->id},
-             {"parent_id", node->parent_id}};  
-        m_j_arr.emplace_back(j_tmp);
+        query_row(ctx.out, ctx.rows, ctx.row_index, node->id, node->name, parent_id);
     }
 
 traverse:
-    if (depth < m_max_depth)
-	    preOrder(node->child, depth + 1);
-	preOrder(node->next, depth);
+    if (depth < ctx.max_depth) {
+        expand(node);
+        if (ctx.ctl)
+            ctx.path.push_back(node);
+        preOrder(ctx, load_link(node->child), node->id, depth + 1);
+        if (ctx.ctl) {
+            ctx.path.pop_back();
+            if (ctx.interrupted())
+                return;
+        }
+    }
+    preOrder(ctx, load_link(node->next), parent_id, depth);
+}
+
+/*
+ * Skip ahead to ctx.seek after a yield, from node on among its siblings.
+ * Returns the node where the walk goes on as usual, or nullptr if seek()
+ * took care of the rest of the siblings.
+ */
+Node *hierarchy::seek(query_context &ctx, Node *node, const string &parent_id, int depth) {
+    size_t level = ctx.path.size();
+    const string &want = ctx.seek[level];
+    while (node && node->name < want)
+        node = load_link(node->next);
+    if (node == nullptr)
+        return nullptr;
+    if (node->name > want || level + 1 == ctx.seek.size() || depth >= ctx.max_depth) {
+        ctx.seeking = false;
+        return node;
+    }
+    /* returned before the yield; carry on inside it, then after it */
+    expand(node);
+    ctx.path.push_back(node);
+    preOrder(ctx, load_link(node->child), node->id, depth + 1);
+    ctx.path.pop_back();
+    ctx.seeking = false;
+    if (!ctx.interrupted())
+        preOrder(ctx, load_link(node->next), parent_id, depth);
+    return nullptr;
+}
+
+void query_row(json &out, row_format rows, unordered_map<string, size_t> &row_index,
+               const string &id, const string &name, const string &parent_id) {
+    if (rows == row_format::columnar) {
+        auto parent = row_index.find(parent_id);
+        if (parent != row_index.end())
+            out["parents"].emplace_back(parent->second);
+        else
+            out["parents"].emplace_back(parent_id);
+        row_index[id] = out["ids"].size();
+        out["ids"].emplace_back(id);
+        out["names"].emplace_back(name);
+    } else if (rows == row_format::array) {
+        out.emplace_back(json::array({id, name, parent_id}));
+    } else {
+        out.emplace_back(json{{"name", name}, {"id", id}, {"parent_id", parent_id}});
+    }
 }
 
 void hierarchy::find_root_id_node(Node *node, Node **node_be_found,
@@ -423,23 +517,174 @@ void hierarchy::find_root_id_node(Node *node, Node **node_be_found,
 	if (node == nullptr)
 	    return;
 
-    stack<pair<Node *, int>> s;
-    s.push({node, depth});
-    while (s.size() > 0) {
-        Node *node_tmp = s.top().first;
-        depth = s.top().second;
-        s.pop();
-        if (node_tmp->id == root_id) {
-            *node_be_found = node_tmp;
+    Node *found = find(root_id);
+    if (found == nullptr)
+        return;
+
+    /* depth below node, which must be an ancestor of the found node */
+    int d = depth;
+    for (Node *cur = found; cur != node; cur = find(parent_of(cur))) {
+        /* a deleted ancestor, when writers do not hold the tree lock */
+        if (cur == nullptr || cur == load_link(root))
+            return;
+        d++;
+    }
+    depth = d;
+    *node_be_found = found;
+}
+
+/* n, its siblings and what is below them, down to max_depth and up to cap */
+static void count_nodes(Node *n, int depth, int max_depth, size_t cap, size_t &count) {
+    for (; n && count < cap; n = load_link(n->next)) {
+        count++;
+        if (depth < max_depth)
+            count_nodes(load_link(n->child), depth + 1, max_depth, cap, count);
+    }
+}
+
+/*
+ * Description: the number of nodes query() would walk, counting no further
+ *              than cap, for admission control. Not used for a lazily
+ *              loaded tree, whose subtrees on disk it would count as
+ *              empty: jsonEstimateCost gives those queries the size of
+ *              the whole tree (cold_store::size) instead.
+ */
+size_t hierarchy::query_cost(int max_depth, vector<string> &root_ids, size_t cap) {
+    Node *top = load_link(root);
+    size_t count = 0;
+    if (top == nullptr)
+        return 0;
+    if (root_ids.empty()) {
+        count_nodes(top, 0, max_depth, cap, count);
+        return count;
+    }
+    for (const string &root_id : std::set<string>(root_ids.begin(), root_ids.end())) {
+        int depth = 0;
+        Node *found = nullptr;
+        find_root_id_node(top, &found, root_id, depth);
+        if (found != nullptr)
+            count_nodes(load_link(found->child), depth + 1, max_depth, cap, count);
+    }
+    return count;
+}
+
+/*
+ * Description: re-apply a logged mutation, used by recovery
+ */
+bool hierarchy::apply(wal_record rec) {
+    switch (rec.op) {
+    case wal_op::add_node:
+        return add_node(move(rec.name), move(rec.id), move(rec.parent_id));
+    case wal_op::delete_node:
+        return delete_node(move(rec.id));
+    case wal_op::move_node:
+        return move_node(move(rec.id), move(rec.parent_id));
+    }
+    return false;
+}
+
+/* the mutation that undoes rec, worked out before rec is applied */
+static wal_record inverse_of(hierarchy &h, const wal_record &rec) {
+    Node *n = h.find(rec.id);
+    switch (rec.op) {
+    case wal_op::add_node:
+        return wal_record(wal_op::delete_node, rec.id, "", "");
+    case wal_op::delete_node:
+        return wal_record(wal_op::add_node, rec.id, n ? n->name : "", n ? h.parent_of(n) : "");
+    case wal_op::move_node:
+        return wal_record(wal_op::move_node, rec.id, "", n ? h.parent_of(n) : "");
+    }
+    return rec;
+}
+
+/*
+ * Description: apply mutations all or nothing, used by transactions
+ *
+ * On the first one that fails, those before it are undone in reverse order,
+ * failed is its index and nothing is logged. Otherwise they are logged
+ * together. Called with the tree lock held exclusively; queries that skip
+ * the lock see the result only when the transaction is over with --mvcc,
+ * but may see it half done with --live-reads.
+ */
+bool hierarchy::apply_all(vector<wal_record> &recs, size_t &failed) {
+    auto step = [this](wal_record &rec) {
+        return m_locks ? m_locks->apply(rec, false) : apply(rec);
+    };
+    if (m_mvcc)
+        m_mvcc->hold();
+    vector<wal_record> undo;
+    failed = recs.size();
+    for (size_t i = 0; i < recs.size(); i++) {
+        wal_record inverse = inverse_of(*this, recs[i]);
+        if (!step(recs[i])) {
+            failed = i;
             break;
         }
-        if (node_tmp->child)
-            s.push({node_tmp->child, depth + 1});
-        if (node_tmp->next)
-            s.push({node_tmp->next, depth});
+        undo.push_back(inverse);
+    }
+    if (failed < recs.size()) {
+        for (auto it = undo.rbegin(); it != undo.rend(); ++it)
+            step(*it);
+    }
+    if (m_mvcc)
+        m_mvcc->release();
+    if (failed < recs.size())
+        return false;
+    log(recs);
+    return true;
+}
+
+/*
+ * Description: record a successful mutation in the write-ahead log, the
+ *              replication stream and the version history
+ */
+void hierarchy::log(wal_record &rec) {
+    lock_guard<mutex> lk(m_log_lock);
+    if (m_wal)
+        m_wal->append(rec);
+    if (m_shipper)
+        m_shipper->ship(rec);
+    if (m_history)
+        m_history->record(rec);
+}
+
+void hierarchy::log(vector<wal_record> &recs) {
+    lock_guard<mutex> lk(m_log_lock);
+    if (m_wal)
+        m_wal->append(recs);
+    for (wal_record &rec : recs) {
+        if (m_shipper)
+            m_shipper->ship(rec);
+        if (m_history)
+            m_history->record(rec);
     }
 }
 
+/*
+ * Description: a node's parent_id, which a concurrent move may be rewriting
+ *              when writers lock subtrees instead of the tree
+ */
+string hierarchy::parent_of(Node *n) {
+    return m_locks ? m_locks->parent_of(n) : n->parent_id;
+}
+
+/*
+ * Description: drop every node, e.g. before a follower bootstraps again
+ */
+void hierarchy::clear() {
+    store_link(root, nullptr);
+    m_index.for_each([this](Node *n) {
+        if (m_epochs)
+            m_epochs->retire(n);
+        else
+            delete n;
+    });
+    m_index.clear();
+    m_dirty.clear();
+    if (m_mvcc)
+        m_mvcc->clear();
+}
+
 /*
  * Description: print node inorder for self-test
  */
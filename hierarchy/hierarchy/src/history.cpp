@@ -0,0 +1,274 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include "nlohmann/json.hpp"
+#include "hierarchy.h"
+#include "wal.h"
+#include "history.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+static int64_t now_ms() {
+    return chrono::duration_cast<chrono::milliseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+}
+
+version_history::~version_history() {
+    for (auto &kv : m_ids)
+        for (node *n : kv.second)
+            delete n;
+}
+
+void version_history::init(hierarchy &h, uint64_t version) {
+    m_version = version;
+    m_oldest = version;
+    if (h.root) {
+        vector<Node *> stack{h.root};
+        while (!stack.empty()) {
+            Node *n = stack.back();
+            stack.pop_back();
+            add(n->id, n->name, n == h.root ? "" : n->parent_id);
+            if (n->next)
+                stack.push_back(n->next);
+            if (n->child)
+                stack.push_back(n->child);
+        }
+    }
+    m_times.push_back(make_pair(version, now_ms()));
+}
+
+version_history::node *version_history::current(const string &id) {
+    auto it = m_ids.find(id);
+    if (it == m_ids.end() || it->second.back()->died != OPEN)
+        return nullptr;
+    return it->second.back();
+}
+
+version_history::node *version_history::at(const string &id, uint64_t version) {
+    auto it = m_ids.find(id);
+    if (it == m_ids.end())
+        return nullptr;
+    for (node *n : it->second) {
+        if (n->born <= version && version < n->died)
+            return n;
+    }
+    return nullptr;
+}
+
+void version_history::add(const string &id, const string &name, const string &parent_id) {
+    node *n = new node();
+    n->id = id;
+    n->name = name;
+    n->born = m_version;
+    m_ids[id].push_back(n);
+    m_nodes++;
+    m_bytes += sizeof(node) + id.capacity() + name.capacity();
+    if (parent_id.empty()) {
+        m_roots.push_back(link{n, m_version, OPEN});
+        n->open_slot = m_roots.size() - 1;
+        return;
+    }
+    if (node *parent = current(parent_id))
+        attach(n, parent);
+}
+
+void version_history::attach(node *n, node *parent) {
+    parent->children.push_back(link{n, m_version, OPEN});
+    n->open_slot = parent->children.size() - 1;
+    n->parents.push_back(link{parent, m_version, OPEN});
+    m_links++;
+    m_bytes += 2 * sizeof(link);
+}
+
+/* close the link to n's current parent; the root never has a parent link */
+void version_history::detach(node *n) {
+    if (n->parents.empty()) {
+        m_roots[n->open_slot].to = m_version;
+        m_expiring.push_back(expiry{m_version, nullptr, n, false});
+        return;
+    }
+    link &up = n->parents.back();
+    up.to = m_version;
+    up.other->children[n->open_slot].to = m_version;
+    m_expiring.push_back(expiry{m_version, up.other, n, false});
+}
+
+void version_history::record(const wal_record &rec) {
+    m_version = rec.lsn ? rec.lsn : m_version + 1;
+    node *n;
+    switch (rec.op) {
+    case wal_op::add_node:
+        add(rec.id, rec.name, rec.parent_id);
+        break;
+    case wal_op::delete_node:
+        if ((n = current(rec.id)) != nullptr) {
+            detach(n);
+            n->died = m_version;
+            m_expiring.push_back(expiry{m_version, nullptr, n, true});
+        }
+        break;
+    case wal_op::move_node:
+        if ((n = current(rec.id)) != nullptr) {
+            detach(n);
+            if (node *parent = current(rec.parent_id))
+                attach(n, parent);
+        }
+        break;
+    }
+    int64_t now = now_ms();
+    m_times.push_back(make_pair(m_version, now));
+    prune(now);
+}
+
+/* drop links no retained version can see, fixing up the open links' slots */
+void version_history::compact(vector<link> &links, size_t &expired, bool children) {
+    size_t k = 0;
+    for (size_t i = 0; i < links.size(); i++) {
+        if (links[i].to != OPEN && links[i].to <= m_oldest)
+            continue;
+        if (children && links[i].to == OPEN)
+            links[i].other->open_slot = k;
+        links[k++] = links[i];
+    }
+    links.resize(k);
+    links.shrink_to_fit();
+    expired = 0;
+}
+
+void version_history::prune(int64_t now) {
+    /* a version is visible until the next one replaces it */
+    while (m_times.size() > 1 &&
+           ((m_window_ms > 0 && m_times[1].second <= now - m_window_ms) ||
+            m_bytes > m_max_bytes)) {
+        m_times.pop_front();
+        m_oldest = m_times.front().first;
+
+        while (!m_expiring.empty() && m_expiring.front().version <= m_oldest) {
+            expiry e = m_expiring.front();
+            m_expiring.pop_front();
+            node *n = e.child;
+            if (e.died) {
+                vector<node *> &same = m_ids[n->id];
+                same.erase(std::find(same.begin(), same.end(), n));
+                if (same.empty())
+                    m_ids.erase(n->id);
+                m_bytes -= sizeof(node) + n->id.capacity() + n->name.capacity();
+                m_nodes--;
+                delete n;
+                continue;
+            }
+            if (e.parent == nullptr) {
+                if (++m_expired_roots * 2 > m_roots.size())
+                    compact(m_roots, m_expired_roots, true);
+                continue;
+            }
+            m_links--;
+            m_bytes -= 2 * sizeof(link);
+            if (++e.parent->expired_children * 2 > e.parent->children.size())
+                compact(e.parent->children, e.parent->expired_children, true);
+            if (n->died == OPEN && ++n->expired_parents * 2 > n->parents.size())
+                compact(n->parents, n->expired_parents, false);
+        }
+    }
+}
+
+bool version_history::version_at(int64_t time_ms, uint64_t &version) {
+    auto it = upper_bound(m_times.begin(), m_times.end(), time_ms,
+                          [](int64_t t, const pair<uint64_t, int64_t> &v) {
+                              return t < v.second;
+                          });
+    if (it == m_times.begin())
+        return false;
+    version = (it - 1)->first;
+    return true;
+}
+
+/* live children of n at version, in name order like the sibling lists */
+void version_history::children_at(node *n, uint64_t version, vector<node *> &out) {
+    out.clear();
+    for (const link &l : n->children) {
+        if (l.from <= version && version < l.to)
+            out.push_back(l.other);
+    }
+    sort(out.begin(), out.end(), [](const node *a, const node *b) { return a->name < b->name; });
+}
+
+void version_history::pre_order(query_context &ctx, uint64_t version, node *n,
+                                const string &parent_id, int depth) {
+    if (ctx.interrupted())
+        return;
+    if (depth >= ctx.min_depth && (ctx.names.empty() || ctx.names.count(n->name)) &&
+        (ctx.ids.empty() || ctx.ids.count(n->id)))
+        query_row(ctx.out, ctx.rows, ctx.row_index, n->id, n->name, parent_id);
+    if (depth >= ctx.max_depth)
+        return;
+    vector<node *> kids;
+    children_at(n, version, kids);
+    for (node *k : kids)
+        pre_order(ctx, version, k, n->id, depth + 1);
+}
+
+/* same results as hierarchy::query() had at the time */
+json version_history::query(uint64_t version, int min_depth, int max_depth,
+                            vector<string> &names, vector<string> &ids,
+                            vector<string> &root_ids, row_format rows,
+                            query_control *ctl) {
+    query_context ctx;
+    ctx.ctl = ctl;
+    ctx.min_depth = min_depth;
+    ctx.max_depth = max_depth;
+    ctx.names.insert(names.begin(), names.end());
+    ctx.ids.insert(ids.begin(), ids.end());
+    ctx.rows = rows;
+    if (rows == row_format::columnar)
+        ctx.out = json{{"ids", json::array()}, {"names", json::array()},
+                     {"parents", json::array()}};
+
+    node *root = nullptr;
+    for (const link &l : m_roots) {
+        if (l.from <= version && version < l.to)
+            root = l.other;
+    }
+    json j;
+    if (root == nullptr || max_depth < min_depth) {
+        j["nodes"] = ctx.out;
+        return j;
+    }
+
+    if (root_ids.empty()) {
+        pre_order(ctx, version, root, "", 0);
+    } else {
+        for (const string &id : set<string>(root_ids.begin(), root_ids.end())) {
+            node *n = at(id, version);
+            if (n == nullptr)
+                continue;
+            int depth = 0;
+            for (node *cur = n; cur != root; depth++) {
+                node *up = nullptr;
+                for (const link &l : cur->parents) {
+                    if (l.from <= version && version < l.to)
+                        up = l.other;
+                }
+                if (up == nullptr)
+                    break;
+                cur = up;
+            }
+            vector<node *> kids;
+            children_at(n, version, kids);
+            for (node *k : kids)
+                pre_order(ctx, version, k, n->id, depth + 1);
+        }
+    }
+    j["nodes"] = ctx.out;
+    return j;
+}
+
+json version_history::status() {
+    return json{{"version", m_version}, {"oldest_version", m_oldest},
+                {"oldest_time_ms", m_times.front().second}, {"versions", m_times.size()},
+                {"nodes", m_nodes}, {"links", m_links}, {"bytes", m_bytes},
+                {"max_bytes", m_max_bytes}, {"window_sec", m_window_ms / 1000}};
+}
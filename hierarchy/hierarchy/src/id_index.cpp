@@ -0,0 +1,230 @@
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <new>
+#include "hierarchy.h"
+#include "id_index.h"
+
+using namespace std;
+
+static const size_t INITIAL_CAPACITY = 1024;
+
+/* zeroed (EMPTY) pages straight from the kernel, not a pass over the table */
+id_index::table::table(size_t capacity) :
+    mask(capacity - 1),
+    slots(static_cast<atomic<uintptr_t> *>(calloc(capacity, sizeof(atomic<uintptr_t>))), free) {
+    if (!slots)
+        throw bad_alloc();
+}
+
+id_index::id_index() {
+    m_tables.emplace_back(new table(INITIAL_CAPACITY));
+    m_cur.store(m_tables.back().get());
+}
+
+id_index::~id_index() {}
+
+uintptr_t id_index::pack(Node *n, size_t h) {
+    uintptr_t p = reinterpret_cast<uintptr_t>(n);
+    if (p >> 48) {
+        cerr << "id_index: node address " << n << " does not fit in 48 bits" << endl;
+        abort();
+    }
+    return p | (uintptr_t(h >> 48) << 48);
+}
+
+/* the slot holding id in t, and its value in v; nullptr if absent */
+atomic<uintptr_t> *id_index::find_in(table *t, const string &id, size_t h, uintptr_t &v) {
+    uintptr_t tag = h >> 48;
+    for (size_t i = h & t->mask, n = 0; n <= t->mask; i = (i + 1) & t->mask, n++) {
+        v = t->slots[i].load(memory_order_acquire);
+        if (v == EMPTY)
+            return nullptr;
+        if (v > MOVED && (v >> 48) == tag && unpack(v)->id == id)
+            return &t->slots[i];
+    }
+    return nullptr;
+}
+
+Node *id_index::find(const string &id) const {
+    size_t h = hash_id(id);
+    table *t = m_cur.load(memory_order_acquire);
+    table *old = m_old.load(memory_order_acquire);
+    /* an entry leaves a table only after it was copied to the next one */
+    for (table *s = old ? old : t; s; s = s->next.load(memory_order_acquire)) {
+        uintptr_t v;
+        if (find_in(s, id, h, v))
+            return unpack(v);
+    }
+    return nullptr;
+}
+
+/* claim an empty or deleted slot; the caller made sure id is absent */
+void id_index::insert_into(table *t, Node *n, size_t h) {
+    uintptr_t packed = pack(n, h);
+    for (;;) {
+        atomic<uintptr_t> *reuse = nullptr;
+        size_t i = h & t->mask;
+        for (size_t k = 0; k <= t->mask; i = (i + 1) & t->mask, k++) {
+            uintptr_t v = t->slots[i].load(memory_order_acquire);
+            if (v == DELETED && reuse == nullptr)
+                reuse = &t->slots[i];
+            if (v == EMPTY)
+                break;
+        }
+        uintptr_t expected = reuse ? DELETED : EMPTY;
+        atomic<uintptr_t> &slot = reuse ? *reuse : t->slots[i];
+        /* a writer of another stripe may have taken it first */
+        if (slot.compare_exchange_strong(expected, packed, memory_order_acq_rel)) {
+            if (!reuse)
+                t->used.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+    }
+}
+
+bool id_index::insert(Node *n) {
+    migrate(MIGRATE_SLOTS);
+    size_t h = hash_id(n->id);
+    {
+        lock_guard<mutex> lk(m_stripes[h % STRIPES]);
+        table *t = m_cur.load(memory_order_acquire);
+        table *old = m_old.load(memory_order_acquire);
+        uintptr_t v;
+        if ((old && find_in(old, n->id, h, v)) || find_in(t, n->id, h, v))
+            return false;
+        insert_into(t, n, h);
+        m_size.fetch_add(1, memory_order_relaxed);
+    }
+    table *t = m_cur.load(memory_order_acquire);
+    size_t used = t->used.load(memory_order_relaxed);
+    if (used * 2 > t->mask + 1) {
+        /* past half full: grow, or only drop the deleted slots if most are */
+        size_t capacity = t->mask + 1;
+        if (size() * 4 > capacity)
+            capacity *= 2;
+        lock_guard<mutex> lk(m_resize_lock);
+        if (m_cur.load() == t)
+            grow(capacity);
+    }
+    return true;
+}
+
+bool id_index::erase(const string &id) {
+    migrate(MIGRATE_SLOTS);
+    size_t h = hash_id(id);
+    lock_guard<mutex> lk(m_stripes[h % STRIPES]);
+    bool found = false;
+    for (table *t : {m_old.load(memory_order_acquire), m_cur.load(memory_order_acquire)}) {
+        uintptr_t v;
+        atomic<uintptr_t> *slot = t ? find_in(t, id, h, v) : nullptr;
+        if (slot) {
+            slot->store(DELETED, memory_order_release);
+            found = true;
+        }
+    }
+    if (found)
+        m_size.fetch_sub(1, memory_order_relaxed);
+    return found;
+}
+
+bool id_index::replace(Node *n) {
+    size_t h = hash_id(n->id);
+    lock_guard<mutex> lk(m_stripes[h % STRIPES]);
+    bool found = false;
+    for (table *t : {m_old.load(memory_order_acquire), m_cur.load(memory_order_acquire)}) {
+        uintptr_t v;
+        atomic<uintptr_t> *slot = t ? find_in(t, n->id, h, v) : nullptr;
+        if (slot) {
+            slot->store(pack(n, h), memory_order_release);
+            found = true;
+        }
+    }
+    return found;
+}
+
+/* move the next slots of the table being replaced; m_resize_lock is held */
+void id_index::migrate_locked(size_t slots) {
+    table *old = m_old.load(memory_order_acquire);
+    if (old == nullptr)
+        return;
+    table *t = m_cur.load(memory_order_acquire);
+    size_t end = old->mask + 1;
+    if (slots < end - m_moved)
+        end = m_moved + slots;
+    for (; m_moved < end; m_moved++) {
+        atomic<uintptr_t> &slot = old->slots[m_moved];
+        uintptr_t v = slot.load(memory_order_acquire);
+        if (v <= MOVED)
+            continue;
+        size_t h = hash_id(unpack(v)->id);
+        lock_guard<mutex> lk(m_stripes[h % STRIPES]);
+        v = slot.load(memory_order_acquire);
+        if (v <= MOVED)
+            continue;
+        insert_into(t, unpack(v), h);
+        slot.store(MOVED, memory_order_release);
+    }
+    if (m_moved > old->mask)
+        m_old.store(nullptr, memory_order_release);
+}
+
+void id_index::migrate(size_t slots) {
+    if (m_old.load(memory_order_acquire) == nullptr)
+        return;
+    /* whoever holds the lock is moving entries already */
+    unique_lock<mutex> lk(m_resize_lock, try_to_lock);
+    if (lk.owns_lock())
+        migrate_locked(slots);
+}
+
+/* start replacing the current table; m_resize_lock is held */
+void id_index::grow(size_t capacity) {
+    if (m_old.load() != nullptr)
+        migrate_locked(SIZE_MAX);
+    table *t = m_cur.load();
+    m_tables.emplace_back(new table(capacity));
+    table *next = m_tables.back().get();
+
+    /* no writer may be between its check and its insert into t */
+    for (mutex &m : m_stripes)
+        m.lock();
+    t->next.store(next, memory_order_release);
+    m_old.store(t, memory_order_release);
+    m_cur.store(next, memory_order_release);
+    m_moved = 0;
+    for (mutex &m : m_stripes)
+        m.unlock();
+}
+
+void id_index::reserve(size_t n) {
+    lock_guard<mutex> lk(m_resize_lock);
+    size_t capacity = m_cur.load()->mask + 1;
+    if (n * 2 <= capacity)
+        return;
+    while (n * 2 > capacity)
+        capacity *= 2;
+    grow(capacity);
+    migrate_locked(SIZE_MAX);
+}
+
+void id_index::clear() {
+    lock_guard<mutex> lk(m_resize_lock);
+    migrate_locked(SIZE_MAX);
+    table *t = m_cur.load();
+    for (size_t i = 0; i <= t->mask; i++)
+        t->slots[i].store(EMPTY, memory_order_release);
+    t->used.store(0);
+    m_size.store(0);
+}
+
+void id_index::for_each(const function<void(Node *)> &fn) {
+    lock_guard<mutex> lk(m_resize_lock);
+    migrate_locked(SIZE_MAX);
+    table *t = m_cur.load();
+    for (size_t i = 0; i <= t->mask; i++) {
+        uintptr_t v = t->slots[i].load(memory_order_acquire);
+        if (v > MOVED)
+            fn(unpack(v));
+    }
+}
@@ -0,0 +1,278 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <sys/mman.h>
+#include "nlohmann/json.hpp"
+#include "hierarchy.h"
+#include "snapshot.h"
+#include "lazy.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+cold_store::cold_store(int max_depth, size_t max_nodes) :
+    m_max_depth(max_depth > 0 ? max_depth : 1), m_max_nodes(max_nodes) {}
+
+cold_store::~cold_store() {
+    if (m_base)
+        munmap(const_cast<char *>(m_base), m_size);
+}
+
+Node *cold_store::make_node(uint32_t i, const string &parent_id) {
+    const snap_node &r = m_recs[i];
+    if (r.id_off + r.id_len > m_hdr->pool_size || r.name_off + r.name_len > m_hdr->pool_size)
+        return nullptr;
+    Node *node = new Node();
+    node->id.assign(m_pool + r.id_off, r.id_len);
+    node->name.assign(m_pool + r.name_off, r.name_len);
+    node->parent_id = parent_id;
+    return node;
+}
+
+/* first record after the subtree of record i */
+static uint64_t subtree_end(const snap_node *recs, uint64_t n, uint32_t i) {
+    for (uint32_t j = i; ; j = recs[j].parent) {
+        if (recs[j].next_sibling != SNAP_NONE)
+            return recs[j].next_sibling;
+        if (recs[j].parent == SNAP_NONE)
+            return n;
+    }
+}
+
+int cold_store::open(hierarchy &h, const string &path, uint64_t &wal_lsn) {
+    if (snapshot_map(path, m_base, m_size) < 0)
+        return -1;
+    m_hdr = reinterpret_cast<const snap_header *>(m_base);
+    m_recs = reinterpret_cast<const snap_node *>(m_base + m_hdr->nodes_off);
+    m_ids = reinterpret_cast<const uint32_t *>(m_base + m_hdr->index_off);
+    m_pool = m_base + m_hdr->pool_off;
+    uint64_t n = m_hdr->node_count;
+
+    /* pre-order: the open path from the root is all the state needed */
+    struct level {
+        Node *node;
+        Node *last_child;
+    };
+    vector<level> stack;
+    for (uint64_t i = 0; i < n; ) {
+        const snap_node &r = m_recs[i];
+        if (r.depth > stack.size() || (r.depth == 0) != (i == 0)) {
+            cerr << "snapshot: " << path << " is corrupt at node " << i << endl;
+            return -1;
+        }
+        stack.resize(r.depth);
+        Node *node = make_node(i, stack.empty() ? "" : stack.back().node->id);
+        if (node == nullptr) {
+            cerr << "snapshot: " << path << " is corrupt at node " << i << endl;
+            return -1;
+        }
+        if (stack.empty()) {
+            h.root = node;
+        } else {
+            level &up = stack.back();
+            if (up.last_child)
+                up.last_child->next = node;
+            else
+                up.node->child = node;
+            up.last_child = node;
+        }
+        h.m_index.insert(node);
+        stack.push_back({node, nullptr});
+
+        if (r.depth + 1 >= uint32_t(m_max_depth) && r.first_child != SNAP_NONE) {
+            node->snap = i;
+            m_units[node] = unit{false, false, 0, m_lru.end()};
+            uint64_t end = subtree_end(m_recs, n, i);
+            m_cold += end - i - 1;
+            i = end;
+        } else {
+            i++;
+        }
+    }
+    wal_lsn = m_hdr->wal_lsn;
+    cerr << "lazy: " << h.m_index.size() << " of " << n << " nodes loaded, "
+         << m_units.size() << " cold subtrees below depth " << m_max_depth << endl;
+    return 0;
+}
+
+void cold_store::load(hierarchy &h, Node *n) {
+    auto it = m_units.find(n);
+    if (it == m_units.end())
+        return;
+    unit &u = it->second;
+    if (u.loaded) {
+        if (!u.pinned)
+            m_lru.splice(m_lru.begin(), m_lru, u.lru);
+        return;
+    }
+
+    uint32_t s = n->snap;
+    uint32_t top = m_recs[s].depth;
+    uint64_t end = subtree_end(m_recs, m_hdr->node_count, s);
+    struct level {
+        Node *node;
+        Node *last_child;
+    };
+    vector<level> stack{{n, nullptr}};
+    for (uint64_t i = s + 1; i < end; i++) {
+        const snap_node &r = m_recs[i];
+        uint32_t d = r.depth - top;
+        Node *node = nullptr;
+        if (d >= 1 && d <= stack.size()) {
+            stack.resize(d);
+            node = make_node(i, stack.back().node->id);
+        }
+        if (node == nullptr) {
+            cerr << "lazy: snapshot is corrupt at node " << i << endl;
+            abort();
+        }
+        level &up = stack.back();
+        if (up.last_child)
+            up.last_child->next = node;
+        else
+            up.node->child = node;
+        up.last_child = node;
+        h.m_index.insert(node);
+        stack.push_back({node, nullptr});
+    }
+
+    u.loaded = true;
+    u.nodes = end - s - 1;
+    m_resident += u.nodes;
+    m_cold -= u.nodes;
+    m_faults++;
+    m_lru.push_front(n);
+    u.lru = m_lru.begin();
+}
+
+uint32_t cold_store::find_record(const string &id) {
+    size_t lo = 0;
+    size_t hi = m_hdr->node_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        const snap_node &r = m_recs[m_ids[mid]];
+        int c = memcmp(m_pool + r.id_off, id.data(), min<size_t>(r.id_len, id.size()));
+        if (c < 0 || (c == 0 && r.id_len < id.size()))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < m_hdr->node_count) {
+        const snap_node &r = m_recs[m_ids[lo]];
+        if (r.id_len == id.size() && memcmp(m_pool + r.id_off, id.data(), id.size()) == 0)
+            return m_ids[lo];
+    }
+    return SNAP_NONE;
+}
+
+Node *cold_store::lookup(hierarchy &h, const string &id) {
+    if (m_base == nullptr || m_units.empty())
+        return nullptr;
+    uint32_t k = find_record(id);
+    if (k == SNAP_NONE || m_recs[k].depth < uint32_t(m_max_depth))
+        return nullptr;
+
+    /*
+     * Only a subtree that is still on disk can hold the node; if it was
+     * loaded, or its root has gone, the node was deleted since.
+     */
+    uint32_t a = k;
+    while (m_recs[a].depth >= uint32_t(m_max_depth))
+        a = m_recs[a].parent;
+    Node *top = h.m_index.find(string(m_pool + m_recs[a].id_off, m_recs[a].id_len));
+    if (top == nullptr || top->snap != a)
+        return nullptr;
+    auto it = m_units.find(top);
+    if (it == m_units.end() || it->second.loaded)
+        return nullptr;
+
+    load(h, top);
+    return h.m_index.find(id);
+}
+
+void cold_store::modified(hierarchy &h, Node *n) {
+    while (n) {
+        if (n->snap != SNAP_NONE) {
+            auto it = m_units.find(n);
+            if (it != m_units.end() && !it->second.pinned) {
+                if (it->second.loaded)
+                    m_lru.erase(it->second.lru);
+                it->second.pinned = true;
+            }
+            return;
+        }
+        if (n == h.root)
+            return;
+        n = h.m_index.find(n->parent_id);
+    }
+}
+
+void cold_store::forget(Node *n) {
+    auto it = m_units.find(n);
+    if (it == m_units.end())
+        return;
+    if (it->second.loaded) {
+        if (!it->second.pinned)
+            m_lru.erase(it->second.lru);
+        m_resident -= it->second.nodes;
+    } else {
+        m_cold -= subtree_end(m_recs, m_hdr->node_count, n->snap) - n->snap - 1;
+    }
+    m_units.erase(it);
+}
+
+void cold_store::load_all(hierarchy &h) {
+    for (auto &u : m_units) {
+        load(h, u.first);
+        if (!u.second.pinned) {
+            m_lru.erase(u.second.lru);
+            u.second.pinned = true;
+        }
+    }
+}
+
+/* drop the Nodes below n; the snapshot still has them */
+void cold_store::evict(hierarchy &h, Node *n) {
+    vector<Node *> stack;
+    if (n->child)
+        stack.push_back(n->child);
+    while (!stack.empty()) {
+        Node *cur = stack.back();
+        stack.pop_back();
+        if (cur->next)
+            stack.push_back(cur->next);
+        if (cur->child)
+            stack.push_back(cur->child);
+        h.m_index.erase(cur->id);
+        delete cur;
+    }
+    n->child = nullptr;
+}
+
+void cold_store::trim(hierarchy &h) {
+    while (m_resident > m_max_nodes && !m_lru.empty()) {
+        Node *n = m_lru.back();
+        unit &u = m_units[n];
+        evict(h, n);
+        m_lru.pop_back();
+        u.loaded = false;
+        m_resident -= u.nodes;
+        m_cold += u.nodes;
+        u.nodes = 0;
+        m_evictions++;
+    }
+}
+
+json cold_store::stats() {
+    size_t loaded = 0;
+    size_t pinned = 0;
+    for (auto &u : m_units) {
+        loaded += u.second.loaded;
+        pinned += u.second.pinned;
+    }
+    return json{{"subtrees", m_units.size()}, {"loaded", loaded}, {"pinned", pinned},
+                {"resident_nodes", m_resident}, {"max_nodes", m_max_nodes},
+                {"faults", m_faults}, {"evictions", m_evictions}};
+}
@@ -0,0 +1,201 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <set>
+#include <memory>
+#include "nlohmann/json.hpp"
+#include "hierarchy.h"
+#include "mvcc.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+mvcc_tree::node_ptr mvcc_tree::build(hierarchy &h, Node *n, pmap<entry> &index) {
+    auto copy = make_shared<node>();
+    copy->id = n->id;
+    copy->name = n->name;
+    index = index.insert(n->id, entry{n->name, n == h.root ? "" : n->parent_id});
+    for (Node *c = n->child; c; c = c->next)
+        copy->children = copy->children.insert(c->name, build(h, c, index));
+    return copy;
+}
+
+void mvcc_tree::init(hierarchy &h) {
+    pmap<entry> index;
+    node_ptr root = h.root ? build(h, h.root, index) : nullptr;
+    publish(root, index);
+}
+
+void mvcc_tree::publish(node_ptr root, const pmap<entry> &index) {
+    auto v = make_shared<version>();
+    v->number = ++m_number;
+    v->root = root;
+    v->index = index;
+    m_head = v;
+    if (!m_held)
+        atomic_store(&m_published, version_ptr(v));
+}
+
+void mvcc_tree::release() {
+    m_held = false;
+    atomic_store(&m_published, m_head);
+}
+
+/* the nodes from the root down to id in version v */
+bool mvcc_tree::path(const version &v, const string &id, vector<node_ptr> &out) {
+    vector<const entry *> up;
+    for (string cur = id; ; ) {
+        const entry *e = v.index.find(cur);
+        if (e == nullptr)
+            return false;
+        up.push_back(e);
+        if (e->parent_id.empty())
+            break;
+        cur = e->parent_id;
+    }
+    out.clear();
+    if (!v.root)
+        return false;
+    out.push_back(v.root);
+    for (size_t i = up.size() - 1; i-- > 0; ) {
+        const node_ptr *child = out.back()->children.find(up[i]->name);
+        if (child == nullptr)
+            return false;
+        out.push_back(*child);
+    }
+    return true;
+}
+
+/* a new root in which the last node of path is replaced by leaf */
+mvcc_tree::node_ptr mvcc_tree::replace_path(const vector<node_ptr> &path, node_ptr leaf) {
+    node_ptr cur = leaf;
+    for (size_t i = path.size() - 1; i-- > 0; ) {
+        auto copy = make_shared<node>(*path[i]);
+        copy->children = copy->children.insert(cur->name, cur);
+        cur = copy;
+    }
+    return cur;
+}
+
+void mvcc_tree::add(const string &id, const string &name, const string &parent_id) {
+    auto n = make_shared<node>();
+    n->id = id;
+    n->name = name;
+    pmap<entry> index = m_head->index.insert(id, entry{name, parent_id});
+    if (parent_id.empty()) {
+        publish(n, index);
+        return;
+    }
+    vector<node_ptr> p;
+    if (!path(*m_head, parent_id, p))
+        return;
+    auto parent = make_shared<node>(*p.back());
+    parent->children = parent->children.insert(name, n);
+    publish(replace_path(p, parent), index);
+}
+
+void mvcc_tree::remove(const string &id) {
+    const entry *e = m_head->index.find(id);
+    if (e == nullptr)
+        return;
+    pmap<entry> index = m_head->index.erase(id);
+    if (e->parent_id.empty()) {
+        publish(nullptr, index);
+        return;
+    }
+    vector<node_ptr> p;
+    if (!path(*m_head, e->parent_id, p))
+        return;
+    auto parent = make_shared<node>(*p.back());
+    parent->children = parent->children.erase(e->name);
+    publish(replace_path(p, parent), index);
+}
+
+void mvcc_tree::move(const string &id, const string &new_parent_id) {
+    vector<node_ptr> p;
+    const entry *e = m_head->index.find(id);
+    if (e == nullptr || !path(*m_head, id, p) || p.size() < 2)
+        return;
+    node_ptr moved = p.back();
+    string name = e->name;
+
+    /* out of the old parent, then into the new one */
+    p.pop_back();
+    auto old_parent = make_shared<node>(*p.back());
+    old_parent->children = old_parent->children.erase(name);
+    version between;
+    between.root = replace_path(p, old_parent);
+    between.index = m_head->index.insert(id, entry{name, new_parent_id});
+    if (!path(between, new_parent_id, p))
+        return;
+    auto new_parent = make_shared<node>(*p.back());
+    new_parent->children = new_parent->children.insert(name, moved);
+    publish(replace_path(p, new_parent), between.index);
+}
+
+void mvcc_tree::clear() {
+    publish(nullptr, pmap<entry>());
+}
+
+void mvcc_tree::pre_order(query_context &ctx, const node *n, const string &parent_id,
+                          int depth) {
+    if (ctx.interrupted())
+        return;
+    if (depth >= ctx.min_depth && (ctx.names.empty() || ctx.names.count(n->name)) &&
+        (ctx.ids.empty() || ctx.ids.count(n->id)))
+        query_row(ctx.out, ctx.rows, ctx.row_index, n->id, n->name, parent_id);
+    if (depth >= ctx.max_depth)
+        return;
+    n->children.for_each([&](const node_ptr &c) { pre_order(ctx, c.get(), n->id, depth + 1); });
+}
+
+/* same results as hierarchy::query() on the version current at the call */
+json mvcc_tree::query(int min_depth, int max_depth, vector<string> &names, vector<string> &ids,
+                      vector<string> &root_ids, row_format rows, query_control *ctl) {
+    version_ptr v = atomic_load(&m_published);
+    json j;
+    query_context ctx;
+    if (rows == row_format::columnar)
+        ctx.out = json{{"ids", json::array()}, {"names", json::array()},
+                       {"parents", json::array()}};
+    if (!v || !v->root || max_depth < min_depth) {
+        j["nodes"] = rows == row_format::columnar ? ctx.out : json();
+        return j;
+    }
+    ctx.min_depth = min_depth;
+    ctx.max_depth = max_depth;
+    ctx.rows = rows;
+    ctx.ctl = ctl;
+    ctx.names.insert(names.begin(), names.end());
+    ctx.ids.insert(ids.begin(), ids.end());
+
+    if (root_ids.empty()) {
+        pre_order(ctx, v->root.get(), "", 0);
+    } else {
+        vector<node_ptr> p;
+        for (const string &id : set<string>(root_ids.begin(), root_ids.end())) {
+            if (!path(*v, id, p))
+                continue;
+            int depth = p.size() - 1;
+            p.back()->children.for_each([&](const node_ptr &c) {
+                pre_order(ctx, c.get(), id, depth + 1);
+            });
+        }
+    }
+    j["nodes"] = std::move(ctx.out);
+    return j;
+}
+
+json mvcc_tree::status() {
+    version_ptr v = atomic_load(&m_published);
+    if (!v)
+        return json{{"version", 0}, {"nodes", 0}};
+    /*
+     * besides queries, held by m_published and v, and by m_head unless a
+     * transaction has moved it on; called under the shared lock, so m_head
+     * stays put
+     */
+    long held = 2 + (v == m_head);
+    return json{{"version", v->number}, {"nodes", v->index.size()},
+                {"readers", v.use_count() - held}};
+}
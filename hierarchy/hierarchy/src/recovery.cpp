@@ -0,0 +1,218 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hierarchy.h"
+#include "wal.h"
+#include "recovery.h"
+
+using namespace std;
+
+static const size_t CHUNK_BYTES = 1 << 20;
+
+static uint32_t get_u32(const char *p) {
+    const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+    return uint32_t(u[0]) | (uint32_t(u[1]) << 8) | (uint32_t(u[2]) << 16) |
+           (uint32_t(u[3]) << 24);
+}
+
+log_replayer::log_replayer(int threads) {
+    if (threads <= 0)
+        threads = thread::hardware_concurrency();
+    m_threads = threads > 0 ? threads : 1;
+}
+
+log_replayer::~log_replayer() {
+    finish();
+    for (mapped &f : m_files) {
+        if (f.data)
+            munmap(const_cast<char *>(f.data), f.size);
+    }
+}
+
+void log_replayer::start(const vector<string> &paths) {
+    for (const string &path : paths) {
+        mapped f;
+        f.path = path;
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                madvise(map, st.st_size, MADV_SEQUENTIAL);
+                madvise(map, st.st_size, MADV_WILLNEED);
+                f.data = static_cast<const char *>(map);
+                f.size = st.st_size;
+            } else {
+                f.bad = true;
+            }
+        }
+        if (fd >= 0)
+            close(fd);
+        m_files.push_back(f);
+    }
+
+    m_scanner = thread(&log_replayer::scan, this);
+    for (int i = 0; i < m_threads; i++)
+        m_workers.push_back(thread(&log_replayer::decode, this));
+}
+
+/* cut each file into chunks of whole records, staying a bounded distance ahead */
+void log_replayer::scan() {
+    const size_t max_ahead = 4 * m_threads;
+    for (size_t i = 0; i < m_files.size(); i++) {
+        mapped &f = m_files[i];
+        if (f.data == nullptr)
+            continue;
+        if (f.size < 8 || get_u32(f.data) != write_ahead_log::WAL_MAGIC ||
+            get_u32(f.data + 4) != write_ahead_log::WAL_VERSION) {
+            f.bad = true;
+            continue;
+        }
+
+        const char *p = f.data + 8;
+        const char *end = f.data + f.size;
+        while (p < end) {
+            const char *begin = p;
+            while (p - begin < ptrdiff_t(CHUNK_BYTES) && end - p >= 8) {
+                uint32_t len = get_u32(p);
+                if (len > uint64_t(end - p - 8))
+                    break;
+                p += 8 + len;
+            }
+            if (p == begin)
+                break;
+
+            unique_ptr<chunk> c(new chunk);
+            c->file = i;
+            c->begin = begin;
+            c->end = p;
+            unique_lock<mutex> lk(m_lock);
+            m_cv.wait(lk, [&] { return m_stop || m_chunks.size() < max_ahead; });
+            if (m_stop)
+                return;
+            m_chunks.push_back(move(c));
+            m_cv.notify_all();
+        }
+    }
+    lock_guard<mutex> lk(m_lock);
+    m_scanned = true;
+    m_cv.notify_all();
+}
+
+void log_replayer::decode() {
+    unique_lock<mutex> lk(m_lock);
+    while (true) {
+        m_cv.wait(lk, [&] {
+            return m_stop || m_scanned || m_next_decode < m_front + m_chunks.size();
+        });
+        if (m_stop)
+            break;
+        if (m_next_decode >= m_front + m_chunks.size()) {
+            if (m_scanned)
+                break;
+            continue;
+        }
+        chunk *c = m_chunks[m_next_decode - m_front].get();
+        m_next_decode++;
+        lk.unlock();
+
+        wal_record rec;
+        size_t len;
+        for (const char *p = c->begin; p < c->end; p += len) {
+            if (!write_ahead_log::decode(p, c->end, rec, len)) {
+                c->corrupt = true;
+                break;
+            }
+            c->recs.push_back(move(rec));
+        }
+
+        lk.lock();
+        c->decoded = true;
+        m_bytes += c->end - c->begin;
+        m_cv.notify_all();
+    }
+}
+
+void log_replayer::finish() {
+    {
+        lock_guard<mutex> lk(m_lock);
+        m_stop = true;
+    }
+    m_cv.notify_all();
+    if (m_scanner.joinable())
+        m_scanner.join();
+    for (thread &t : m_workers)
+        t.join();
+    m_workers.clear();
+}
+
+int log_replayer::apply(hierarchy &h, uint64_t &lsn) {
+    auto t0 = chrono::steady_clock::now();
+    auto next_report = t0 + chrono::seconds(1);
+    vector<bool> stopped(m_files.size(), false);
+    unsigned long long applied = 0;
+    unsigned long long skipped = 0;
+
+    unique_lock<mutex> lk(m_lock);
+    while (true) {
+        m_cv.wait(lk, [&] {
+            return (!m_chunks.empty() && m_chunks.front()->decoded) ||
+                   (m_scanned && m_chunks.empty());
+        });
+        if (m_chunks.empty())
+            break;
+        unique_ptr<chunk> c = move(m_chunks.front());
+        m_chunks.pop_front();
+        m_front++;
+        m_cv.notify_all();
+        uint64_t bytes = m_bytes;
+        lk.unlock();
+
+        if (!stopped[c->file]) {
+            for (wal_record &rec : c->recs) {
+                if (rec.lsn <= lsn) {
+                    skipped++;
+                    continue;
+                }
+                lsn = rec.lsn;
+                h.apply(move(rec));
+                applied++;
+            }
+            /* nothing after a torn or corrupt record can be trusted */
+            stopped[c->file] = c->corrupt;
+        }
+        c.reset();
+
+        auto now = chrono::steady_clock::now();
+        if (now >= next_report) {
+            double s = chrono::duration<double>(now - t0).count();
+            fprintf(stderr, "recovery: %llu records applied, %.1f MB decoded, %.0f records/s\n",
+                    applied, bytes / 1048576.0, applied / s);
+            next_report = now + chrono::seconds(1);
+        }
+        lk.lock();
+    }
+    lk.unlock();
+    finish();
+
+    int rc = 0;
+    for (const mapped &f : m_files) {
+        if (f.bad) {
+            cerr << "wal: " << f.path << " is not a write-ahead log" << endl;
+            rc = -1;
+        }
+    }
+    double s = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    if (applied)
+        fprintf(stderr, "recovery: %llu records (%llu already checkpointed) from %zu files "
+                "up to lsn %llu in %.3f s, %.0f records/s, %d decode threads\n",
+                applied, skipped, m_files.size(), (unsigned long long)lsn, s,
+                applied / (s > 0 ? s : 1), m_threads);
+    return rc;
+}
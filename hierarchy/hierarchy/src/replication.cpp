@@ -0,0 +1,469 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "nlohmann/json.hpp"
+#include "hierarchy.h"
+#include "wal.h"
+#include "replication.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+static const size_t FRAME_HEADER = 1 + 8 + 8;
+static const size_t MAX_FRAME = 16 << 20;
+
+uint64_t repl_now_us() {
+    return chrono::duration_cast<chrono::microseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void put_u64(string &out, uint64_t v) {
+    for (int i = 0; i < 8; i++)
+        out += char(v >> (8 * i));
+}
+
+static uint64_t get_u64(const char *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--)
+        v = (v << 8) | uint8_t(p[i]);
+    return v;
+}
+
+static void put_frame(string &out, uint8_t type, uint64_t lsn, uint64_t time_us,
+                      const string &payload) {
+    uint32_t len = FRAME_HEADER + payload.size();
+    for (int i = 0; i < 4; i++)
+        out += char(len >> (8 * i));
+    out += char(type);
+    put_u64(out, lsn);
+    put_u64(out, time_us);
+    out += payload;
+}
+
+static bool write_all(int fd, const char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN) {
+            /* the socket is non-blocking for the shipper thread */
+            struct pollfd pfd = {fd, POLLOUT, 0};
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* the bootstrap of h as of lsn, in pre-order; runs in a forked child */
+static bool write_bootstrap(hierarchy &h, int fd, uint64_t lsn) {
+    const size_t FLUSH_AT = 64 << 10;
+    uint64_t now = repl_now_us();
+    string out;
+    put_frame(out, REPL_START, lsn, now, "");
+    vector<Node *> stack;
+    if (h.root)
+        stack.push_back(h.root);
+    string payload;
+    while (!stack.empty()) {
+        Node *n = stack.back();
+        stack.pop_back();
+        payload.clear();
+        write_ahead_log::encode(wal_record(wal_op::add_node, n->id, n->name, n->parent_id),
+                                payload);
+        put_frame(out, REPL_BOOTSTRAP, 0, now, payload);
+        if (out.size() >= FLUSH_AT) {
+            if (!write_all(fd, out.data(), out.size()))
+                return false;
+            out.clear();
+        }
+        if (n->next)
+            stack.push_back(n->next);
+        h.expand(n);
+        if (n->child)
+            stack.push_back(n->child);
+    }
+    return write_all(fd, out.data(), out.size());
+}
+
+log_shipper::~log_shipper() {
+    stop();
+    for (follower &f : m_followers)
+        drop(f);
+    if (m_listen_fd >= 0) {
+        close(m_listen_fd);
+        unlink(m_path.c_str());
+    }
+    if (m_wake[0] >= 0) {
+        close(m_wake[0]);
+        close(m_wake[1]);
+    }
+}
+
+int log_shipper::listen_on(const string &path) {
+    struct sockaddr_un addr;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        cerr << "replication: socket path too long: " << path << endl;
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        cerr << "replication: socket: " << strerror(errno) << endl;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(path.c_str());
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0 ||
+        pipe2(m_wake, O_NONBLOCK | O_CLOEXEC) < 0) {
+        cerr << "replication: cannot listen on " << path << ": " << strerror(errno) << endl;
+        close(fd);
+        return -1;
+    }
+    m_listen_fd = fd;
+    m_path = path;
+    return 0;
+}
+
+void log_shipper::start() {
+    if (m_h.m_wal)
+        m_lsn = m_h.m_wal->last_lsn();
+    m_thread = thread(&log_shipper::loop, this);
+}
+
+void log_shipper::stop() {
+    if (!m_thread.joinable())
+        return;
+    m_stop = true;
+    wake();
+    m_thread.join();
+}
+
+void log_shipper::wake() {
+    char c = 0;
+    ssize_t n = write(m_wake[1], &c, 1);
+    (void)n;
+}
+
+void log_shipper::ship(wal_record &rec) {
+    lock_guard<mutex> lk(m_lock);
+    if (rec.lsn == 0)
+        rec.lsn = m_lsn + 1;
+    m_lsn = rec.lsn;
+    if (m_followers.empty())
+        return;
+
+    string payload;
+    write_ahead_log::encode(rec, payload);
+    uint64_t now = repl_now_us();
+    bool was_idle = true;
+    for (follower &f : m_followers) {
+        was_idle = was_idle && f.out.size() == f.out_off;
+        put_frame(f.out, REPL_RECORD, rec.lsn, now, payload);
+    }
+    if (was_idle)
+        wake();
+}
+
+/*
+ * Runs on the shipper thread. The child is forked under the hierarchy lock,
+ * so no mutation can fall between its image of the tree and the first
+ * record queued for the follower.
+ */
+void log_shipper::accept_follower() {
+    int fd = accept4(m_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    /* make sure the child never has to run one-time initialisation */
+    wal_crc32("", 0);
+    auto t0 = chrono::steady_clock::now();
+    pid_t pid;
+    {
+        lock_guard<rw_mutex> hl(m_h.m_mutex);
+        lock_guard<mutex> lk(m_lock);
+        pid = fork();
+        if (pid == 0)
+            _exit(write_bootstrap(m_h, fd, m_lsn) ? 0 : 1);
+        if (pid > 0) {
+            follower f;
+            f.fd = fd;
+            f.bootstrap = pid;
+            f.since = t0;
+            f.acked = m_lsn;
+            m_followers.push_back(move(f));
+        }
+    }
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+    if (pid < 0) {
+        cerr << "replication: fork: " << strerror(errno) << endl;
+        close(fd);
+        return;
+    }
+    cerr << "replication: follower " << fd << " bootstrapping, " << ms
+         << " ms under the lock" << endl;
+}
+
+/*
+ * Whether f's bootstrap child is still writing; until then nothing else
+ * may go out on its socket. Sets dead if the child failed.
+ */
+bool log_shipper::bootstrapping(follower &f, bool &dead) {
+    if (f.bootstrap == 0)
+        return false;
+    int wstatus;
+    pid_t r = waitpid(f.bootstrap, &wstatus, WNOHANG);
+    if (r == 0 || (r < 0 && errno == EINTR))
+        return true;
+    f.bootstrap = 0;
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - f.since).count();
+    if (r < 0 || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+        cerr << "replication: follower " << f.fd << " bootstrap failed" << endl;
+        dead = true;
+    } else {
+        cerr << "replication: follower " << f.fd << " bootstrapped in " << ms << " ms" << endl;
+    }
+    return false;
+}
+
+void log_shipper::drop(follower &f) {
+    if (f.bootstrap > 0) {
+        kill(f.bootstrap, SIGKILL);
+        while (waitpid(f.bootstrap, nullptr, 0) < 0 && errno == EINTR)
+            ;
+        f.bootstrap = 0;
+    }
+    close(f.fd);
+}
+
+void log_shipper::loop() {
+    signal(SIGPIPE, SIG_IGN);
+    uint64_t next_heartbeat = 0;
+    vector<struct pollfd> fds;
+    while (!m_stop) {
+        fds.clear();
+        fds.push_back({m_listen_fd, POLLIN, 0});
+        fds.push_back({m_wake[0], POLLIN, 0});
+        {
+            lock_guard<mutex> lk(m_lock);
+            for (follower &f : m_followers) {
+                /* acks still have to be read while the child writes */
+                short ev = POLLIN;
+                if (!f.bootstrap && f.out_off < f.out.size())
+                    ev |= POLLOUT;
+                fds.push_back({f.fd, ev, 0});
+            }
+        }
+        if (poll(fds.data(), fds.size(), 100) < 0 && errno != EINTR)
+            break;
+
+        if (fds[1].revents & POLLIN) {
+            char buf[256];
+            while (read(m_wake[0], buf, sizeof(buf)) > 0)
+                ;
+        }
+        if (fds[0].revents & POLLIN)
+            accept_follower();
+
+        lock_guard<mutex> lk(m_lock);
+        uint64_t now = repl_now_us();
+        bool heartbeat = now >= next_heartbeat;
+        if (heartbeat)
+            next_heartbeat = now + 100000;
+
+        /* the poll set was built before any follower accepted above */
+        for (size_t i = 0; i < m_followers.size(); i++) {
+            follower &f = m_followers[i];
+            bool dead = false;
+            bool writing = bootstrapping(f, dead);
+            if (!dead && i + 2 < fds.size() &&
+                (fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR))) {
+                char buf[4096];
+                ssize_t n = read(f.fd, buf, sizeof(buf));
+                if (n > 0) {
+                    f.in.append(buf, n);
+                    size_t whole = f.in.size() / 8 * 8;
+                    if (whole)
+                        f.acked = get_u64(f.in.data() + whole - 8);
+                    f.in.erase(0, whole);
+                } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+                    dead = true;
+                }
+            }
+            if (heartbeat && !dead)
+                put_frame(f.out, REPL_HEARTBEAT, m_lsn, now, "");
+            while (!dead && !writing && f.out_off < f.out.size()) {
+                ssize_t n = write(f.fd, f.out.data() + f.out_off, f.out.size() - f.out_off);
+                if (n > 0) {
+                    f.out_off += n;
+                } else {
+                    dead = n < 0 && errno != EAGAIN && errno != EINTR;
+                    break;
+                }
+            }
+            if (f.out_off == f.out.size()) {
+                f.out.clear();
+                f.out_off = 0;
+            } else if (f.out_off > (1 << 20)) {
+                f.out.erase(0, f.out_off);
+                f.out_off = 0;
+            }
+            if (!dead && f.out.size() - f.out_off > MAX_BACKLOG) {
+                cerr << "replication: follower " << f.fd << " fell too far behind" << endl;
+                dead = true;
+            }
+            if (dead) {
+                drop(f);
+                m_followers.erase(m_followers.begin() + i);
+                fds.erase(fds.begin() + 2 + i);
+                i--;
+            }
+        }
+    }
+}
+
+json log_shipper::status() {
+    lock_guard<mutex> lk(m_lock);
+    json followers = json::array();
+    for (follower &f : m_followers)
+        followers.push_back({{"fd", f.fd}, {"acked_lsn", f.acked},
+                             {"lag_ops", m_lsn - f.acked},
+                             {"backlog_bytes", f.out.size() - f.out_off}});
+    return json{{"role", "primary"}, {"lsn", m_lsn}, {"followers", followers}};
+}
+
+void log_follower::start(const string &path) {
+    m_path = path;
+    m_thread = thread(&log_follower::loop, this);
+}
+
+void log_follower::stop() {
+    m_stop = true;
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+void log_follower::loop() {
+    signal(SIGPIPE, SIG_IGN);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, m_path.c_str(), sizeof(addr.sun_path) - 1);
+
+    while (!m_stop) {
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            {
+                lock_guard<mutex> lk(m_lock);
+                m_connected = true;
+            }
+            session(fd);
+            lock_guard<mutex> lk(m_lock);
+            m_connected = false;
+        }
+        if (fd >= 0)
+            close(fd);
+        for (int i = 0; i < 10 && !m_stop; i++)
+            this_thread::sleep_for(chrono::milliseconds(100));
+    }
+}
+
+/* apply frames until the primary goes away; everything read at once is applied under one lock */
+int log_follower::session(int fd) {
+    string in;
+    char buf[64 << 10];
+    while (!m_stop) {
+        struct pollfd p = {fd, POLLIN, 0};
+        int r = poll(&p, 1, 200);
+        if (r < 0 && errno != EINTR)
+            return -1;
+        if (r <= 0)
+            continue;
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (n <= 0)
+            return 0;
+        in.append(buf, n);
+
+        size_t off = 0;
+        uint64_t applied;
+        {
+            lock_guard<rw_mutex> hl(m_h.m_mutex);
+            lock_guard<mutex> lk(m_lock);
+            while (in.size() - off >= 4) {
+                const char *p = in.data() + off;
+                uint32_t len = uint8_t(p[0]) | (uint8_t(p[1]) << 8) | (uint8_t(p[2]) << 16) |
+                               (uint32_t(uint8_t(p[3])) << 24);
+                if (len < FRAME_HEADER || len > MAX_FRAME) {
+                    cerr << "replication: bad frame from primary" << endl;
+                    return -1;
+                }
+                if (in.size() - off - 4 < len)
+                    break;
+                uint8_t type = p[4];
+                uint64_t lsn = get_u64(p + 5);
+                uint64_t time_us = get_u64(p + 13);
+                const char *payload = p + 4 + FRAME_HEADER;
+                const char *end = p + 4 + len;
+                off += 4 + len;
+
+                wal_record rec;
+                size_t rec_len;
+                if (type == REPL_START) {
+                    m_h.clear();
+                    m_applied = lsn;
+                    m_primary_lsn = lsn;
+                    m_bootstraps++;
+                } else if (type == REPL_BOOTSTRAP || type == REPL_RECORD) {
+                    if (!write_ahead_log::decode(payload, end, rec, rec_len)) {
+                        cerr << "replication: corrupt record from primary" << endl;
+                        return -1;
+                    }
+                    m_h.apply(move(rec));
+                    if (type == REPL_RECORD) {
+                        m_applied = lsn;
+                        if (lsn > m_primary_lsn)
+                            m_primary_lsn = lsn;
+                        uint64_t now = repl_now_us();
+                        m_lag_us = now > time_us ? now - time_us : 0;
+                    }
+                } else if (type == REPL_HEARTBEAT) {
+                    if (lsn > m_primary_lsn)
+                        m_primary_lsn = lsn;
+                }
+            }
+            applied = m_applied;
+        }
+        in.erase(0, off);
+
+        string ack;
+        put_u64(ack, applied);
+        if (!write_all(fd, ack.data(), ack.size()))
+            return 0;
+    }
+    return 0;
+}
+
+json log_follower::status() {
+    lock_guard<mutex> lk(m_lock);
+    return json{{"role", "follower"}, {"connected", m_connected},
+                {"applied_lsn", m_applied}, {"primary_lsn", m_primary_lsn},
+                {"lag_ops", m_primary_lsn - m_applied}, {"lag_us", m_lag_us},
+                {"bootstraps", m_bootstraps}};
+}
@@ -0,0 +1,513 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include "nlohmann/json.hpp"
+#include "hierarchy.h"
+#include "request.h"
+#include "snapshot.h"
+#include "bulk_load.h"
+#include "checkpoint.h"
+#include "recovery.h"
+#include "lazy.h"
+#include "replication.h"
+#include "history.h"
+#include "mvcc.h"
+#include "epoch.h"
+#include "subtree_locks.h"
+#include "shards.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+/*
+ * Requests that leave the tree alone and may run alongside each other. A
+ * lazily loaded tree is the exception: a query there can fault subtrees in.
+ * With subtree locks, mutations also run alongside each other and lock
+ * only the nodes they touch.
+ */
+static bool shared_request(hierarchy &h, const string &input_fun) {
+    if (input_fun == "query")
+        return h.m_lazy == nullptr;
+    if (input_fun == "add_node" || input_fun == "delete_node" || input_fun == "move_node")
+        return h.m_locks != nullptr;
+    return input_fun == "snapshot_status" || input_fun == "checkpoint" ||
+           input_fun == "checkpoint_status" || input_fun == "replication_status" ||
+           input_fun == "history_status" || input_fun == "mvcc_status" ||
+           input_fun == "epoch_status" || input_fun == "locks_status";
+}
+
+/*
+ * A query of the current tree that runs without the lock: on a published
+ * version, or on the live tree under an epoch pin. The latter cannot serve
+ * root_ids unless writers lock subtrees: a root's depth is counted by
+ * walking up its ancestors one find() at a time, and moves in between can
+ * send that walk up a chain of parents that never existed together. The
+ * ID index itself is safe to read without the lock.
+ */
+static bool lock_free_request(hierarchy &h, json &j, const string &input_fun) {
+    if (input_fun != "query" || j[input_fun]["as_of_version"] != nullptr ||
+        j[input_fun]["as_of_time"] != nullptr)
+        return false;
+    return h.m_mvcc || (h.m_epochs && (h.m_locks || j[input_fun]["root_ids"] == nullptr));
+}
+
+/*
+ * With --shards the tree lives in the shards and h stays empty, so only
+ * mutations and queries of the current tree make sense.
+ */
+static bool sharded_request(json &j, const string &input_fun) {
+    if (input_fun == "query")
+        return j[input_fun]["as_of_version"] == nullptr && j[input_fun]["as_of_time"] == nullptr;
+    return input_fun == "add_node" || input_fun == "delete_node" ||
+           input_fun == "move_node" || input_fun == "shards_status";
+}
+
+/*
+ * Request arguments: a request is {"<name>": {..}}, and the arguments
+ * object may be left out as null. A field that is there with the wrong
+ * type fails the request rather than being read as something else.
+ */
+static bool valid_args(const json &j) {
+    return j.is_object() && j.size() == 1 &&
+           (j.begin().value().is_object() || j.begin().value().is_null());
+}
+
+/* args[key] into out, if it is there; false if it is not a string */
+static bool get_arg(json &args, const char *key, string &out) {
+    const json &v = args[key];
+    if (v == nullptr)
+        return true;
+    if (!v.is_string())
+        return false;
+    out = v.get<string>();
+    return true;
+}
+
+static bool get_arg(json &args, const char *key, int64_t &out) {
+    const json &v = args[key];
+    if (v == nullptr)
+        return true;
+    if (!v.is_number_integer())
+        return false;
+    out = v.get<int64_t>();
+    return true;
+}
+
+static bool get_arg(json &args, const char *key, int &out) {
+    int64_t v = out;
+    if (!get_arg(args, key, v) || v < INT_MIN || v > INT_MAX)
+        return false;
+    out = int(v);
+    return true;
+}
+
+static bool get_arg(json &args, const char *key, vector<string> &out) {
+    const json &v = args[key];
+    if (v == nullptr)
+        return true;
+    if (!v.is_array())
+        return false;
+    for (const json &s : v) {
+        if (!s.is_string())
+            return false;
+        out.push_back(s.get<string>());
+    }
+    return true;
+}
+
+/* the add_node, delete_node or move_node request in j[fun] as a log record */
+static bool decode_mutation(json &j, const string &fun, wal_record &rec) {
+    string id;
+    string name;
+    string parent_id;
+    json &args = j[fun];
+    if (!valid_args(j) || !get_arg(args, "id", id))
+        return false;
+    if (fun == "add_node") {
+        if (!get_arg(args, "name", name) || !get_arg(args, "parent_id", parent_id))
+            return false;
+        rec = wal_record(wal_op::add_node, id, name, parent_id);
+    } else if (fun == "delete_node") {
+        rec = wal_record(wal_op::delete_node, id, "", "");
+    } else if (fun == "move_node") {
+        if (!get_arg(args, "new_parent_id", parent_id))
+            return false;
+        rec = wal_record(wal_op::move_node, id, "", parent_id);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* apply a mutation and log it if it succeeded */
+static bool mutate(hierarchy &h, wal_record &rec) {
+    if (h.m_shards)
+        return h.m_shards->apply(rec);
+    if (h.m_locks)
+        return h.m_locks->apply(rec);
+    if (!h.apply(rec))
+        return false;
+    h.log(rec);
+    return true;
+}
+
+/*
+ * Queries that carry a request_id, for as long as they run, so that a
+ * cancel request can find them.
+ */
+static mutex running_lock;
+static unordered_multimap<string, query_control *> running;
+
+class running_query
+{
+public:
+    running_query(const string &id, query_control *ctl) : m_id(id), m_ctl(ctl) {
+        if (m_id.empty())
+            return;
+        lock_guard<mutex> lk(running_lock);
+        running.emplace(m_id, m_ctl);
+    }
+    ~running_query() {
+        if (m_id.empty())
+            return;
+        lock_guard<mutex> lk(running_lock);
+        auto range = running.equal_range(m_id);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second == m_ctl) {
+                running.erase(it);
+                break;
+            }
+        }
+    }
+    running_query(const running_query &) = delete;
+    running_query &operator=(const running_query &) = delete;
+
+private:
+    string m_id;
+    query_control *m_ctl;
+};
+
+/* {"cancel": {"request_id": ..}}: cut off the running queries with that ID */
+static json cancel(hierarchy &h, json &j) {
+    if (!j["cancel"]["request_id"].is_string())
+        return h.fail;
+    string id = j["cancel"]["request_id"];
+    lock_guard<mutex> lk(running_lock);
+    auto range = running.equal_range(id);
+    for (auto it = range.first; it != range.second; ++it)
+        it->second->cancelled = true;
+    return range.first != range.second ? h.pass : h.fail;
+}
+
+/* shared_lock: the tree lock, if the caller holds it shared */
+static json process(hierarchy &h, json &j, const string &input_fun, row_format rows,
+                    chrono::steady_clock::time_point received,
+                    rw_mutex *shared_lock = nullptr) {
+    int min_depth = 0;
+    int max_depth = INT_MAX;
+    vector<string> names;
+    vector<string> ids;
+    vector<string> root_ids;
+    json resp;
+
+    if (h.m_read_only && (input_fun == "add_node" || input_fun == "delete_node" ||
+                          input_fun == "move_node" || input_fun == "transaction" ||
+                          input_fun == "bulk_load")) {
+        resp = h.fail;
+    } else if (input_fun == "add_node" || input_fun == "delete_node" ||
+               input_fun == "move_node") {
+        wal_record rec;
+        resp = decode_mutation(j, input_fun, rec) && mutate(h, rec) ? h.pass : h.fail;
+    } else if (input_fun == "transaction") {
+        /* {"transaction": {"ops": [{"add_node": {..}}, {"move_node": {..}}, ..]}} */
+        json &ops = j[input_fun]["ops"];
+        vector<wal_record> recs;
+        bool valid = ops.is_array() && !ops.empty();
+        for (size_t i = 0; valid && i < ops.size(); i++) {
+            recs.emplace_back();
+            valid = valid_args(ops[i]) &&
+                    decode_mutation(ops[i], ops[i].begin().key(), recs.back());
+        }
+        size_t failed = 0;
+        if (!valid) {
+            resp = h.fail;
+        } else if (h.apply_all(recs, failed)) {
+            resp = json{{"ok", true}, {"results", json::array()}};
+            for (size_t i = 0; i < recs.size(); i++)
+                resp["results"].push_back(h.pass);
+        } else {
+            /* the ops before the failed one ran and were undone */
+            resp = json{{"ok", false}, {"failed_op", failed}, {"results", json::array()}};
+            for (size_t i = 0; i < failed; i++)
+                resp["results"].push_back(h.pass);
+            resp["results"].push_back(h.fail);
+        }
+    } else if (input_fun == "query") {
+        json &args = j[input_fun];
+        string format;
+        /* deadline_ms from receipt; a cancel request may name request_id */
+        query_control ctl;
+        string request_id;
+        int64_t deadline_ms = 0;
+        if (!get_arg(args, "min_depth", min_depth) || !get_arg(args, "max_depth", max_depth) ||
+            !get_arg(args, "names", names) || !get_arg(args, "ids", ids) ||
+            !get_arg(args, "root_ids", root_ids) || !get_arg(args, "format", format) ||
+            !get_arg(args, "deadline_ms", deadline_ms) ||
+            !get_arg(args, "request_id", request_id))
+            return h.fail;
+        if (format == "columnar")
+            rows = row_format::columnar;
+        if (args["deadline_ms"] != nullptr)
+            ctl.deadline = received + chrono::milliseconds(deadline_ms);
+        ctl.yield_lock = shared_lock;
+        running_query registered(request_id, &ctl);
+        json as_of_version = j[input_fun]["as_of_version"];
+        json as_of_time = j[input_fun]["as_of_time"];
+        if (as_of_version == nullptr && as_of_time == nullptr && h.m_shards) {
+            resp = h.m_shards->query(min_depth, max_depth, names, ids, root_ids, rows, &ctl);
+        } else if (as_of_version == nullptr && as_of_time == nullptr && h.m_mvcc) {
+            resp = h.m_mvcc->query(min_depth, max_depth, names, ids, root_ids, rows, &ctl);
+        } else if (as_of_version == nullptr && as_of_time == nullptr) {
+            resp = h.query(min_depth, max_depth, names, ids, root_ids, rows, &ctl);
+        } else {
+            /* as_of_time is unix seconds; the version current at that moment */
+            uint64_t version = 0;
+            bool found = h.m_history != nullptr;
+            if (found && as_of_version.is_number_unsigned())
+                version = as_of_version;
+            else if (found && as_of_time.is_number())
+                found = h.m_history->version_at(int64_t(as_of_time.get<double>() * 1000), version);
+            else
+                found = false;
+            if (found && h.m_history->retained(version))
+                resp = h.m_history->query(version, min_depth, max_depth, names, ids,
+                                          root_ids, rows, &ctl);
+            else
+                resp = h.fail;
+        }
+        if (ctl.stopped)
+            resp = json{{"ok", false}, {"error", ctl.stopped.load()}};
+    } else if (input_fun == "snapshot") {
+        string path;
+        get_arg(j[input_fun], "path", path);
+        uint64_t lsn = h.m_wal ? h.m_wal->last_lsn() : 0;
+        if (path.empty() || snapshot_start(h, path, lsn, resp) < 0)
+            resp = h.fail;
+    } else if (input_fun == "snapshot_status") {
+        resp = snapshot_status();
+    } else if (input_fun == "checkpoint") {
+        if (h.m_checkpoint)
+            h.m_checkpoint->request();
+        resp = h.m_checkpoint ? h.pass : h.fail;
+    } else if (input_fun == "checkpoint_status") {
+        resp = h.m_checkpoint ? h.m_checkpoint->status() : h.fail;
+    } else if (input_fun == "replication_status") {
+        if (h.m_shipper)
+            resp = h.m_shipper->status();
+        else if (h.m_follower)
+            resp = h.m_follower->status();
+        else
+            resp = h.fail;
+    } else if (input_fun == "history_status") {
+        resp = h.m_history ? h.m_history->status() : h.fail;
+    } else if (input_fun == "mvcc_status") {
+        resp = h.m_mvcc ? h.m_mvcc->status() : h.fail;
+    } else if (input_fun == "epoch_status") {
+        resp = h.m_epochs ? h.m_epochs->status() : h.fail;
+    } else if (input_fun == "shards_status") {
+        resp = h.m_shards ? h.m_shards->status() : h.fail;
+    } else if (input_fun == "locks_status") {
+        resp = h.m_locks ? h.m_locks->status() : h.fail;
+    } else if (input_fun == "lazy_status") {
+        resp = h.m_lazy ? h.m_lazy->stats() : h.fail;
+    } else if (input_fun == "bulk_load") {
+        string path;
+        get_arg(j[input_fun], "path", path);
+        bulk_result res;
+        if (path.empty() || bulk_load(h, path, res) < 0)
+            resp = h.fail;
+        else
+            resp = jsonBulkLoadResult(res);
+    } else {
+        resp = h.fail;
+    }
+    return resp;
+}
+
+/*
+ * {"batch": {"ops": [request, ..]}}: independent requests, run in order
+ * under one hold of the tree lock, shared if every one of them may share
+ * it. Each gets its own response, and one failing does not stop the rest.
+ * A cancel needs no lock and goes to cancel() as it would on its own.
+ */
+static json process_batch(hierarchy &h, json &j, row_format rows,
+                          chrono::steady_clock::time_point received) {
+    json &ops = j["batch"]["ops"];
+    if (!ops.is_array() || ops.empty())
+        return h.fail;
+
+    vector<string> funs;
+    vector<bool> lock_free;
+    bool shared = true;
+    for (json &op : ops) {
+        string fun;
+        if (valid_args(op) && op.begin().key() != "batch")
+            fun = op.begin().key();
+        funs.push_back(fun);
+        lock_free.push_back(!fun.empty() && lock_free_request(h, op, fun));
+        shared = shared && (fun.empty() || fun == "cancel" || lock_free.back() ||
+                            shared_request(h, fun));
+    }
+
+    json results = json::array();
+    auto run = [&](bool pin_epochs, rw_mutex *shared_lock) {
+        for (size_t i = 0; i < funs.size(); i++) {
+            if (funs[i] == "cancel") {
+                results.push_back(cancel(h, ops[i]));
+                continue;
+            }
+            if (funs[i].empty() || (h.m_shards && !sharded_request(ops[i], funs[i]))) {
+                results.push_back(h.fail);
+                continue;
+            }
+            epoch_guard pin(pin_epochs && lock_free[i] ? h.m_epochs : nullptr);
+            results.push_back(process(h, ops[i], funs[i], rows, received, shared_lock));
+        }
+    };
+    if (h.m_shards) {
+        run(false, nullptr);
+    } else if (shared) {
+        /* writers with subtree locks still run alongside */
+        shared_guard lk(h.m_mutex);
+        run(true, &h.m_mutex);
+    } else {
+        lock_guard<rw_mutex> lk(h.m_mutex);
+        run(false, nullptr);
+        if (h.m_lazy)
+            h.m_lazy->trim(h);
+    }
+    return json{{"ok", true}, {"results", results}};
+}
+
+static json decode_process(hierarchy &h, json &j, row_format rows,
+                           chrono::steady_clock::time_point received) {
+    if (!valid_args(j))
+        return h.fail;
+
+    string input_fun = j.begin().key();
+    if (input_fun == "batch")
+        return process_batch(h, j, rows, received);
+    if (input_fun == "cancel")
+        return cancel(h, j);
+    if (h.m_shards) {
+        /* the shards run it on their own threads, without the tree lock */
+        if (!sharded_request(j, input_fun))
+            return h.fail;
+        return process(h, j, input_fun, rows, received);
+    }
+    if (lock_free_request(h, j, input_fun)) {
+        epoch_guard pin(h.m_epochs);
+        return process(h, j, input_fun, rows, received);
+    }
+    if (shared_request(h, input_fun)) {
+        shared_guard lk(h.m_mutex);
+        return process(h, j, input_fun, rows, received, &h.m_mutex);
+    }
+    lock_guard<rw_mutex> lk(h.m_mutex);
+    json resp = process(h, j, input_fun, rows, received);
+    if (h.m_lazy)
+        h.m_lazy->trim(h);
+    return resp;
+}
+
+json jsonDecodeProcess(hierarchy &h, json &j, row_format rows,
+                       chrono::steady_clock::time_point received) {
+    /* a request that slips past the checks above fails on its own */
+    try {
+        return decode_process(h, j, rows, received);
+    } catch (const json::exception &) {
+        return h.fail;
+    }
+}
+
+uint64_t jsonEstimateCost(hierarchy &h, json &j, uint64_t cap) {
+    if (!j.is_object() || j.size() != 1)
+        return 1;
+    string input_fun = j.begin().key();
+    json &args = j.begin().value();
+    if ((input_fun == "transaction" || input_fun == "batch") && args.is_object() &&
+        args["ops"].is_array()) {
+        uint64_t cost = 0;
+        for (json &op : args["ops"])
+            cost += jsonEstimateCost(h, op, cap);
+        return max<uint64_t>(cost, 1);
+    }
+    if (input_fun != "query" || !args.is_object())
+        return 1;
+
+    /* subtrees of other versions, shards and disk cannot be walked here */
+    uint64_t whole;
+    if (h.m_shards) {
+        whole = h.m_shards->size();
+    } else if (h.m_lazy) {
+        /* the ID index holds only what is in memory */
+        shared_guard lk(h.m_mutex);
+        whole = h.m_lazy->size(h);
+    } else {
+        whole = h.m_index.size();
+    }
+    if (h.m_shards || h.m_lazy || args["as_of_version"] != nullptr ||
+        args["as_of_time"] != nullptr)
+        return whole;
+    int max_depth = args["max_depth"].is_number_integer() ? args["max_depth"].get<int>() : INT_MAX;
+    vector<string> root_ids;
+    if (args["root_ids"].is_array()) {
+        for (const json &id : args["root_ids"]) {
+            if (id.is_string())
+                root_ids.push_back(id);
+        }
+    }
+    size_t cost;
+    if (h.m_locks) {
+        /* writers run alongside, as they do for the query itself */
+        epoch_guard pin(h.m_epochs);
+        cost = h.query_cost(max_depth, root_ids, cap);
+    } else {
+        shared_guard lk(h.m_mutex);
+        cost = h.query_cost(max_depth, root_ids, cap);
+    }
+    return cost < cap ? cost : max<uint64_t>(cap, whole);
+}
+
+json jsonBulkLoadResult(const bulk_result &res) {
+    const size_t MAX_REPORTED = 100;
+    json rejected = json::array();
+    for (size_t i = 0; i < res.rejected.size() && i < MAX_REPORTED; i++) {
+        const bulk_reject &r = res.rejected[i];
+        rejected.push_back({{"line", r.line}, {"id", r.id}, {"reason", r.reason}});
+    }
+    return json{{"ok", true}, {"rows", res.rows}, {"loaded", res.loaded},
+                {"rejected_count", res.rejected.size()}, {"rejected", rejected}};
+}
+
+string jsonEncodeResponse(const json &resp) {
+    /* row lists are pretty-printed, everything else stays on one line */
+    if (resp.contains("nodes") && resp["nodes"].is_array())
+        return resp.dump(4);
+    return resp.dump();
+}
+
+void jsonCommitResponses(hierarchy &h) {
+    if (h.m_wal)
+        h.m_wal->commit();
+}
+
+int jsonRecoverLog(hierarchy &h, const string &path, uint64_t after_lsn) {
+    log_replayer replayer;
+    replayer.start(vector<string>{path});
+    return replayer.apply(h, after_lsn);
+}
@@ -0,0 +1,502 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "nlohmann/json.hpp"
+#include "hierarchy.h"
+#include "request.h"
+#include "server.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+static int set_nonblock(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+socket_server::~socket_server() {
+    stop_queries();
+    for (auto &kv : m_conns)
+        close(kv.first);
+    if (m_listen_fd >= 0) {
+        close(m_listen_fd);
+        unlink(m_path.c_str());
+    }
+    if (m_epoll_fd >= 0)
+        close(m_epoll_fd);
+}
+
+int socket_server::listen_on(const string &path) {
+    struct sockaddr_un addr;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        cerr << "server: socket path too long: " << path << endl;
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        cerr << "server: socket: " << strerror(errno) << endl;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(path.c_str());
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, SOMAXCONN) < 0) {
+        cerr << "server: cannot listen on " << path << ": " << strerror(errno) << endl;
+        close(fd);
+        return -1;
+    }
+    m_listen_fd = fd;
+    m_path = path;
+    return 0;
+}
+
+void socket_server::adopt(handoff_state &st) {
+    m_listen_fd = st.listen_fd;
+    m_path = st.listen_path;
+    for (handoff_conn &hc : st.conns) {
+        Connection c(hc.fd);
+        c.serial = ++m_serial;
+        c.in.swap(hc.in);
+        c.out.swap(hc.out);
+        c.reading = hc.reading;
+        c.closing = hc.closing;
+        m_conns[hc.fd] = c;
+    }
+    st.conns.clear();
+}
+
+void socket_server::give_away() {
+    /* the successor gets no half-answered requests */
+    while (m_running > 0) {
+        uint64_t n;
+        if (read(m_answered_fd, &n, sizeof(n)) < 0 && errno != EINTR)
+            break;
+        finish_queries();
+    }
+    handoff_state st;
+    st.fmt = m_format;
+    st.listen_fd = m_listen_fd;
+    st.listen_path = m_path;
+    for (auto &kv : m_conns) {
+        Connection &c = kv.second;
+        if (c.fd >= 0)
+            st.conns.push_back(handoff_conn{c.fd, c.in, c.out.substr(c.out_off),
+                                            c.reading, c.closing});
+    }
+    m_handoff->give(st);
+}
+
+int socket_server::run() {
+    signal(SIGPIPE, SIG_IGN);
+
+    m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epoll_fd < 0) {
+        cerr << "server: epoll_create1: " << strerror(errno) << endl;
+        return -1;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = m_listen_fd;
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_listen_fd, &ev) < 0) {
+        cerr << "server: epoll_ctl: " << strerror(errno) << endl;
+        return -1;
+    }
+    if (m_handoff) {
+        ev.data.fd = m_handoff->fd();
+        epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_handoff->fd(), &ev);
+    }
+    m_answered_fd = eventfd(0, EFD_CLOEXEC);
+    if (m_answered_fd < 0) {
+        cerr << "server: eventfd: " << strerror(errno) << endl;
+        return -1;
+    }
+    ev.data.fd = m_answered_fd;
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_answered_fd, &ev);
+    for (int i = 0; i < QUERY_THREADS; i++)
+        m_query_threads.emplace_back(&socket_server::query_loop, this);
+
+    /* connections taken over: pick up where the predecessor left off */
+    for (auto &kv : m_conns) {
+        Connection &c = kv.second;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = c.fd;
+        epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, c.fd, &ev);
+        if (c.reading)
+            process_input(c);
+    }
+    jsonCommitResponses(m_h);
+    vector<int> adopted;
+    for (auto &kv : m_conns)
+        adopted.push_back(kv.first);
+    for (int fd : adopted) {
+        Connection &c = m_conns[fd];
+        update_events(c);
+        if (c.fd < 0 || (c.closing && !c.busy && c.out_off == c.out.size()))
+            close_conn(fd);
+    }
+
+    const int MAX_EVENTS = 256;
+    struct epoll_event events[MAX_EVENTS];
+    while (!m_stop) {
+        int n = epoll_wait(m_epoll_fd, events, MAX_EVENTS, 500);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            cerr << "server: epoll_wait: " << strerror(errno) << endl;
+            return -1;
+        }
+        vector<int> touched;
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == m_listen_fd) {
+                accept_clients();
+                continue;
+            }
+            if (m_handoff && fd == m_handoff->fd()) {
+                give_away();
+                /* between the two steps the successor is watched instead */
+                if (m_handoff->fd() != fd) {
+                    epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+                    ev.data.fd = m_handoff->fd();
+                    epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_handoff->fd(), &ev);
+                }
+                continue;
+            }
+            if (fd == m_answered_fd) {
+                uint64_t count;
+                if (read(m_answered_fd, &count, sizeof(count)) > 0)
+                    finish_queries();
+                continue;
+            }
+
+            auto it = m_conns.find(fd);
+            if (it == m_conns.end())
+                continue;
+            Connection &c = it->second;
+            if (events[i].events & EPOLLOUT)
+                handle_write(c);
+            if (c.fd >= 0 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                handle_read(c);
+            touched.push_back(fd);
+        }
+
+        /* one durability wait covers every response produced this round */
+        jsonCommitResponses(m_h);
+
+        for (int fd : touched) {
+            auto it = m_conns.find(fd);
+            if (it == m_conns.end())
+                continue;
+            Connection &c = it->second;
+            if (c.fd >= 0)
+                update_events(c);
+            if (c.fd < 0 || (c.closing && !c.busy && c.out_off == c.out.size()))
+                close_conn(fd);
+        }
+    }
+    stop_queries();
+    return 0;
+}
+
+/* cheap queries first; costly ones on all threads but one */
+void socket_server::query_loop() {
+    unique_lock<mutex> lk(m_query_lock);
+    for (;;) {
+        auto costly_ok = [this] {
+            return !m_costly.empty() && (m_costly_running < QUERY_THREADS - 1 || m_query_stop);
+        };
+        m_query_cv.wait(lk, [&] { return m_query_stop || !m_cheap.empty() || costly_ok(); });
+        bool costly = m_cheap.empty();
+        if (costly && !costly_ok())
+            return;
+        deque<query_task> &q = costly ? m_costly : m_cheap;
+        query_task t = move(q.front());
+        q.pop_front();
+        if (costly) {
+            m_costly_cost -= t.cost;
+            m_costly_running++;
+        }
+        lk.unlock();
+        t.resp = jsonDecodeProcess(m_h, t.req, wire_row_format(m_format), t.received);
+        lk.lock();
+        if (costly) {
+            m_costly_running--;
+            m_query_cv.notify_all();
+        }
+        m_answered.push_back(move(t));
+        uint64_t one = 1;
+        if (write(m_answered_fd, &one, sizeof(one)) < 0)
+            cerr << "server: eventfd: " << strerror(errno) << endl;
+    }
+}
+
+/* queue a query by its estimated cost; false if it is over budget */
+bool socket_server::start_query(Connection &c, json &j, uint64_t cost,
+                                chrono::steady_clock::time_point received) {
+    lock_guard<mutex> lk(m_query_lock);
+    if (cost <= CHEAP_QUERY_COST) {
+        if (m_cheap.size() >= MAX_CHEAP_QUEUED) {
+            m_rejected++;
+            return false;
+        }
+        m_cheap.push_back(query_task{c.fd, c.serial, cost, received, move(j), json()});
+    } else {
+        if (m_costly.size() >= MAX_COSTLY_QUEUED ||
+            m_costly_cost + cost > MAX_COSTLY_QUEUED_COST) {
+            m_rejected++;
+            return false;
+        }
+        m_costly.push_back(query_task{c.fd, c.serial, cost, received, move(j), json()});
+        m_costly_cost += cost;
+    }
+    c.busy = true;
+    c.reading = false;
+    m_running++;
+    m_query_cv.notify_all();
+    return true;
+}
+
+json socket_server::scheduler_status() {
+    lock_guard<mutex> lk(m_query_lock);
+    return json{{"cheap_queued", m_cheap.size()}, {"costly_queued", m_costly.size()},
+                {"costly_queued_cost", m_costly_cost}, {"costly_running", m_costly_running},
+                {"running", m_running - m_cheap.size() - m_costly.size()},
+                {"rejected", m_rejected}};
+}
+
+/* queue the responses of finished queries and go on with their connections */
+void socket_server::finish_queries() {
+    vector<query_task> done;
+    {
+        lock_guard<mutex> lk(m_query_lock);
+        done.swap(m_answered);
+        m_running -= done.size();
+    }
+    for (query_task &t : done) {
+        auto it = m_conns.find(t.fd);
+        if (it == m_conns.end() || it->second.serial != t.serial)
+            continue;
+        Connection &c = it->second;
+        c.busy = false;
+        if (c.fd < 0) {
+            close_conn(t.fd);
+            continue;
+        }
+        encode_response(t.resp, m_format, c.out);
+        if (c.out.size() - c.out_off <= MAX_PENDING_OUT) {
+            c.reading = !c.closing;
+            process_input(c);
+        }
+        jsonCommitResponses(m_h);
+        update_events(c);
+        if (c.fd < 0 || (c.closing && !c.busy && c.out_off == c.out.size()))
+            close_conn(t.fd);
+    }
+}
+
+void socket_server::stop_queries() {
+    {
+        lock_guard<mutex> lk(m_query_lock);
+        m_query_stop = true;
+        m_query_cv.notify_all();
+    }
+    for (thread &t : m_query_threads)
+        t.join();
+    m_query_threads.clear();
+    if (m_answered_fd >= 0) {
+        close(m_answered_fd);
+        m_answered_fd = -1;
+    }
+}
+
+void socket_server::accept_clients() {
+    while (true) {
+        int fd = accept4(m_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                cerr << "server: accept: " << strerror(errno) << endl;
+            return;
+        }
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            continue;
+        }
+        m_conns[fd] = Connection(fd);
+        m_conns[fd].serial = ++m_serial;
+    }
+}
+
+void socket_server::handle_read(Connection &c) {
+    char buf[READ_CHUNK];
+    while (c.reading) {
+        ssize_t n = read(c.fd, buf, sizeof(buf));
+        if (n > 0) {
+            c.in.append(buf, n);
+            c.reads.emplace_back(c.in.size(), chrono::steady_clock::now());
+            process_input(c);
+            if (n < (ssize_t)sizeof(buf))
+                break;
+        } else if (n == 0) {
+            /* finish the last unterminated line, then drain and close */
+            if (m_format == wire_format::text && !c.in.empty()) {
+                c.in += '\n';
+                process_input(c);
+            }
+            c.closing = true;
+            c.reading = false;
+            break;
+        } else {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                close(c.fd);
+                c.fd = -1;
+            }
+            break;
+        }
+    }
+}
+
+/* when the read that brought in the byte before offset end came in */
+static chrono::steady_clock::time_point received_by(const Connection &c, size_t end) {
+    for (auto &r : c.reads) {
+        if (r.first >= end)
+            return r.second;
+    }
+    return chrono::steady_clock::now();
+}
+
+/* Execute every complete request in the input buffer, in arrival order. */
+void socket_server::process_input(Connection &c) {
+    size_t start = 0;
+    while (!c.busy && start < c.in.size()) {
+        json j;
+        size_t consumed;
+        int rc = decode_request(c.in.data() + start, c.in.size() - start,
+                                m_format, j, consumed, &c.in_scanned);
+        if (rc == 0)
+            break;
+        if (rc < 0) {
+            /* framing is lost, nothing after this point can be trusted */
+            c.in.clear();
+            c.in_scanned = 0;
+            c.reads.clear();
+            c.reading = false;
+            c.closing = true;
+            return;
+        }
+        start += consumed;
+        if (j.is_null())
+            continue;
+        /* deadlines count from here, however long it waits after */
+        auto received = received_by(c, start);
+        string fun = j.is_object() && j.size() == 1 ? j.begin().key() : "";
+        /* queries, and batches too long to hold up the loop, are queued */
+        uint64_t cost = 0;
+        if (fun == "query" || fun == "batch" || fun == "transaction")
+            cost = jsonEstimateCost(m_h, j, CHEAP_QUERY_COST);
+        bool queued = fun == "query" || cost > CHEAP_QUERY_COST;
+        if (queued && start_query(c, j, cost, received))
+            break;
+        json resp;
+        if (queued)
+            resp = json{{"ok", false}, {"error", "overloaded: query queue is full"}};
+        else if (fun == "scheduler_status")
+            resp = scheduler_status();
+        else
+            resp = j.is_discarded() ? m_h.fail :
+                jsonDecodeProcess(m_h, j, wire_row_format(m_format), received);
+        encode_response(resp, m_format, c.out);
+
+        /* stop decoding while the client is not keeping up */
+        if (c.out.size() - c.out_off > MAX_PENDING_OUT) {
+            c.reading = false;
+            break;
+        }
+    }
+    c.in.erase(0, start);
+    while (!c.reads.empty() && c.reads.front().first <= start)
+        c.reads.pop_front();
+    for (auto &r : c.reads)
+        r.first -= start;
+}
+
+void socket_server::handle_write(Connection &c) {
+    while (c.out_off < c.out.size()) {
+        ssize_t n = send(c.fd, c.out.data() + c.out_off, c.out.size() - c.out_off,
+                         MSG_NOSIGNAL);
+        if (n > 0) {
+            c.out_off += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                close(c.fd);
+                c.fd = -1;
+            }
+            break;
+        }
+    }
+    if (c.out_off == c.out.size()) {
+        c.out.clear();
+        c.out_off = 0;
+    }
+
+    /* backlog drained: resume the requests that were held back */
+    if (!c.reading && !c.closing && !c.busy && c.out.size() - c.out_off <= MAX_PENDING_OUT / 2) {
+        c.reading = true;
+        process_input(c);
+    }
+}
+
+void socket_server::update_events(Connection &c) {
+    /* try to flush right away, only wait for EPOLLOUT on a full socket */
+    if (c.out_off < c.out.size())
+        handle_write(c);
+    if (c.fd < 0)
+        return;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.data.fd = c.fd;
+    if (c.reading)
+        ev.events |= EPOLLIN;
+    if (c.out_off < c.out.size())
+        ev.events |= EPOLLOUT;
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, c.fd, &ev);
+}
+
+void socket_server::close_conn(int fd) {
+    auto it = m_conns.find(fd);
+    if (it == m_conns.end())
+        return;
+    /* a descriptor closed on error has already left the epoll set */
+    if (it->second.fd >= 0) {
+        epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, it->second.fd, nullptr);
+        close(it->second.fd);
+    }
+    m_conns.erase(it);
+}
@@ -0,0 +1,540 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <numeric>
+#include <pthread.h>
+#include <sched.h>
+#include "nlohmann/json.hpp"
+#include "hierarchy.h"
+#include "shards.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+const uint32_t shard_engine::NONE;
+const uint32_t shard_engine::ALL;
+
+/* shards held in a task until the coordinator is done with their trees */
+struct shard_engine::parking {
+    mutex lock;
+    condition_variable cv;
+    size_t parked = 0;
+    bool released = false;
+};
+
+shard_engine::shard_engine(int shards) {
+    for (int i = 0; i < shards; i++)
+        m_shards.emplace_back(new shard());
+}
+
+shard_engine::~shard_engine() {
+    stop();
+}
+
+/* n and everything below it, parents before children */
+static void subtree_ids(Node *n, vector<string> &ids) {
+    ids.push_back(n->id);
+    for (Node *c = n->child; c; c = c->next)
+        subtree_ids(c, ids);
+}
+
+void shard_engine::copy_subtree(Node *n, const string &parent_id, hierarchy &to, uint32_t s) {
+    to.add_node(n->name, n->id, parent_id);
+    set_route(n->id, s);
+    for (Node *c = n->child; c; c = c->next)
+        copy_subtree(c, n->id, to, s);
+}
+
+void shard_engine::start(hierarchy &h) {
+    /* the shards share the log; each logs the mutations it runs */
+    for (auto &sh : m_shards)
+        sh->h.m_wal = h.m_wal;
+    if (Node *root = h.root) {
+        for (auto &sh : m_shards)
+            sh->h.add_node(root->name, root->id, "");
+        set_route(root->id, ALL);
+        for (Node *c = root->child; c; c = c->next) {
+            uint32_t s = shard_for_name(c->name);
+            copy_subtree(c, root->id, m_shards[s]->h, s);
+        }
+    }
+    h.clear();
+
+    unsigned cores = thread::hardware_concurrency();
+    for (size_t s = 0; s < m_shards.size(); s++) {
+        m_shards[s]->worker = thread(&shard_engine::run, this, s);
+        if (cores > 0) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(s % cores, &cpus);
+            pthread_setaffinity_np(m_shards[s]->worker.native_handle(), sizeof(cpus), &cpus);
+        }
+    }
+}
+
+void shard_engine::stop() {
+    for (auto &sh : m_shards) {
+        lock_guard<mutex> lk(sh->lock);
+        sh->stop = true;
+        sh->wake.notify_one();
+    }
+    for (auto &sh : m_shards) {
+        if (sh->worker.joinable())
+            sh->worker.join();
+    }
+}
+
+/* a shard's thread: its tasks, one at a time, until stopped and drained */
+void shard_engine::run(size_t s) {
+    shard &sh = *m_shards[s];
+    for (;;) {
+        function<void()> task;
+        {
+            unique_lock<mutex> lk(sh.lock);
+            sh.wake.wait(lk, [&sh] { return sh.stop || !sh.tasks.empty(); });
+            if (sh.tasks.empty())
+                return;
+            task = move(sh.tasks.front());
+            sh.tasks.pop_front();
+        }
+        task();
+        sh.ops.fetch_add(1, memory_order_relaxed);
+    }
+}
+
+void shard_engine::post(size_t s, function<void()> task) {
+    shard &sh = *m_shards[s];
+    lock_guard<mutex> lk(sh.lock);
+    sh.tasks.push_back(move(task));
+    sh.wake.notify_one();
+}
+
+/* run fn on the shard's thread and wait for it */
+void shard_engine::call(size_t s, const function<void(hierarchy &)> &fn) {
+    mutex lock;
+    condition_variable cv;
+    bool done = false;
+    hierarchy &h = m_shards[s]->h;
+    post(s, [&]() {
+        fn(h);
+        lock_guard<mutex> lk(lock);
+        done = true;
+        cv.notify_one();
+    });
+    unique_lock<mutex> lk(lock);
+    cv.wait(lk, [&] { return done; });
+}
+
+/* run fn on every shard at once and wait for all of them */
+void shard_engine::call_all(const function<void(size_t, hierarchy &)> &fn) {
+    mutex lock;
+    condition_variable cv;
+    size_t left = m_shards.size();
+    for (size_t s = 0; s < m_shards.size(); s++) {
+        hierarchy &h = m_shards[s]->h;
+        post(s, [&, s]() {
+            fn(s, h);
+            lock_guard<mutex> lk(lock);
+            if (--left == 0)
+                cv.notify_one();
+        });
+    }
+    unique_lock<mutex> lk(lock);
+    cv.wait(lk, [&] { return left == 0; });
+}
+
+/* one at a time in ascending order, so two coordinators cannot deadlock */
+void shard_engine::park(parking &p, vector<size_t> shards) {
+    sort(shards.begin(), shards.end());
+    shards.erase(unique(shards.begin(), shards.end()), shards.end());
+    unique_lock<mutex> lk(p.lock);
+    for (size_t s : shards) {
+        size_t parked = p.parked + 1;
+        post(s, [&p]() {
+            unique_lock<mutex> lk(p.lock);
+            p.parked++;
+            p.cv.notify_all();
+            p.cv.wait(lk, [&p] { return p.released; });
+            p.parked--;
+            p.cv.notify_all();
+        });
+        p.cv.wait(lk, [&] { return p.parked == parked; });
+    }
+}
+
+void shard_engine::release(parking &p) {
+    unique_lock<mutex> lk(p.lock);
+    p.released = true;
+    p.cv.notify_all();
+    p.cv.wait(lk, [&p] { return p.parked == 0; });
+}
+
+shard_engine::route_stripe &shard_engine::routes(const string &id) {
+    return m_routes[hash<string>()(id) % ROUTE_STRIPES];
+}
+
+uint32_t shard_engine::route(const string &id) {
+    route_stripe &r = routes(id);
+    lock_guard<mutex> lk(r.lock);
+    auto it = r.shards.find(id);
+    return it == r.shards.end() ? NONE : it->second;
+}
+
+bool shard_engine::reserve(const string &id, uint32_t s) {
+    route_stripe &r = routes(id);
+    lock_guard<mutex> lk(r.lock);
+    return r.shards.emplace(id, s).second;
+}
+
+void shard_engine::set_route(const string &id, uint32_t s) {
+    route_stripe &r = routes(id);
+    lock_guard<mutex> lk(r.lock);
+    r.shards[id] = s;
+}
+
+void shard_engine::drop_route(const string &id, uint32_t s) {
+    route_stripe &r = routes(id);
+    lock_guard<mutex> lk(r.lock);
+    auto it = r.shards.find(id);
+    if (it != r.shards.end() && it->second == s)
+        r.shards.erase(it);
+}
+
+uint32_t shard_engine::shard_for_name(const string &name) const {
+    return hash<string>()(name) % m_shards.size();
+}
+
+bool shard_engine::apply(const wal_record &rec) {
+    switch (rec.op) {
+    case wal_op::add_node:
+        return rec.parent_id.empty() ? add_root(rec) : add_node(rec);
+    case wal_op::delete_node:
+        return delete_node(rec);
+    case wal_op::move_node:
+        return move_node(rec);
+    }
+    return false;
+}
+
+bool shard_engine::add_node(const wal_record &rec) {
+    if (rec.id.empty() || rec.name.empty())
+        return false;
+    for (;;) {
+        uint32_t p = route(rec.parent_id);
+        if (p == NONE)
+            return false;
+        uint32_t s = p == ALL ? shard_for_name(rec.name) : p;
+        if (!reserve(rec.id, s))
+            return false;
+        result r = result::failed;
+        call(s, [&](hierarchy &h) {
+            if (h.find(rec.parent_id) == nullptr) {
+                r = result::moved;
+            } else if (h.add_node(rec.name, rec.id, rec.parent_id)) {
+                wal_record logged = rec;
+                h.log(logged);
+                r = result::ok;
+            }
+        });
+        if (r == result::ok)
+            return true;
+        drop_route(rec.id, s);
+        if (r == result::failed || route(rec.parent_id) == p)
+            return false;
+        m_retries++;
+    }
+}
+
+bool shard_engine::delete_node(const wal_record &rec) {
+    for (;;) {
+        uint32_t s = route(rec.id);
+        if (s == NONE)
+            return false;
+        if (s == ALL)
+            return delete_root(rec);
+        result r = result::failed;
+        call(s, [&](hierarchy &h) {
+            if (h.find(rec.id) == nullptr) {
+                r = result::moved;
+            } else if (h.delete_node(rec.id)) {
+                wal_record logged = rec;
+                h.log(logged);
+                r = result::ok;
+            }
+        });
+        if (r == result::ok) {
+            drop_route(rec.id, s);
+            return true;
+        }
+        if (r == result::failed || route(rec.id) == s)
+            return false;
+        m_retries++;
+    }
+}
+
+bool shard_engine::move_node(const wal_record &rec) {
+    if (rec.id.empty() || rec.parent_id.empty() || rec.id == rec.parent_id)
+        return false;
+    for (;;) {
+        uint32_t from = route(rec.id);
+        uint32_t to = route(rec.parent_id);
+        if (from == NONE || from == ALL || to == NONE)
+            return false;
+
+        /* under the root, the node's name decides the shard */
+        uint32_t target = to;
+        if (to == ALL) {
+            string name;
+            call(from, [&](hierarchy &h) {
+                if (Node *n = h.find(rec.id))
+                    name = n->name;
+            });
+            target = name.empty() ? from : shard_for_name(name);
+        }
+
+        result r = result::failed;
+        if (target == from) {
+            call(from, [&](hierarchy &h) {
+                if (h.find(rec.id) == nullptr || h.find(rec.parent_id) == nullptr) {
+                    r = result::moved;
+                } else if (h.move_node(rec.id, rec.parent_id)) {
+                    wal_record logged = rec;
+                    h.log(logged);
+                    r = result::ok;
+                }
+            });
+        } else {
+            r = handoff(rec, from, target);
+        }
+        if (r != result::moved)
+            return r == result::ok;
+        if (route(rec.id) == from && route(rec.parent_id) == to)
+            return false;
+        m_retries++;
+    }
+}
+
+/*
+ * Move a subtree between shards: with both parked, rebuild it under the new
+ * parent in one and delete it from the other. No cycle is possible, since
+ * the new parent is not in the shard that holds the whole subtree.
+ */
+shard_engine::result shard_engine::handoff(const wal_record &rec, uint32_t from, uint32_t to) {
+    parking p;
+    park(p, {from, to});
+    hierarchy &src = m_shards[from]->h;
+    hierarchy &dst = m_shards[to]->h;
+    result r = result::moved;
+    Node *n = src.find(rec.id);
+    Node *parent = dst.find(rec.parent_id);
+    if (n && parent && n != src.root &&
+        (parent != dst.root || shard_for_name(n->name) == to)) {
+        r = result::failed;
+        if (dst.find_child(parent, n->name) == nullptr) {
+            vector<string> ids;
+            subtree_ids(n, ids);
+            copy_subtree(n, parent->id, dst, to);
+            for (auto it = ids.rbegin(); it != ids.rend(); ++it)
+                src.delete_node(*it);
+            wal_record logged = rec;
+            src.log(logged);
+            m_handoffs++;
+            r = result::ok;
+        }
+    }
+    release(p);
+    return r;
+}
+
+/* the root lives in every shard, so all of them are parked to change it */
+bool shard_engine::add_root(const wal_record &rec) {
+    if (rec.id.empty() || rec.name.empty() || !reserve(rec.id, ALL))
+        return false;
+    vector<size_t> all(m_shards.size());
+    iota(all.begin(), all.end(), 0);
+    parking p;
+    park(p, all);
+    bool ok = m_shards[0]->h.root == nullptr;
+    if (ok) {
+        for (auto &sh : m_shards)
+            sh->h.add_node(rec.name, rec.id, "");
+        wal_record logged = rec;
+        m_shards[0]->h.log(logged);
+    }
+    release(p);
+    if (!ok)
+        drop_route(rec.id, ALL);
+    return ok;
+}
+
+bool shard_engine::delete_root(const wal_record &rec) {
+    vector<size_t> all(m_shards.size());
+    iota(all.begin(), all.end(), 0);
+    parking p;
+    park(p, all);
+    bool ok = true;
+    for (auto &sh : m_shards) {
+        Node *root = sh->h.root;
+        if (root == nullptr || root->id != rec.id || root->child)
+            ok = false;
+    }
+    if (ok) {
+        for (auto &sh : m_shards)
+            sh->h.delete_node(rec.id);
+        wal_record logged = rec;
+        m_shards[0]->h.log(logged);
+    }
+    release(p);
+    if (ok)
+        drop_route(rec.id, ALL);
+    return ok;
+}
+
+/* this shard's top-level subtrees in pre-order, one segment each */
+void shard_engine::top_level(hierarchy &h, size_t s, partial &part) {
+    Node *root = h.root;
+    if (root == nullptr)
+        return;
+    part.has_root = true;
+    part.root_id = root->id;
+    part.root_name = root->name;
+    query_context &ctx = part.ctx;
+    if (ctx.max_depth < 1)
+        return;
+    for (Node *c = root->child; c && !ctx.interrupted(); c = c->next) {
+        segment seg{c->name, s, ctx.out.size(), 0};
+        if (ctx.min_depth <= 1 && (ctx.names.empty() || ctx.names.count(c->name)) &&
+            (ctx.ids.empty() || ctx.ids.count(c->id)))
+            query_row(ctx.out, ctx.rows, ctx.row_index, c->id, c->name, root->id);
+        if (ctx.max_depth > 1)
+            h.preOrder(ctx, c->child, c->id, 2);
+        seg.end = ctx.out.size();
+        if (seg.end > seg.begin)
+            part.segs.push_back(seg);
+    }
+}
+
+/* the whole tree from every shard, merged into out; false if there is no root */
+bool shard_engine::gather(query_context &out, bool with_root) {
+    vector<partial> parts(m_shards.size());
+    for (partial &part : parts) {
+        part.ctx.min_depth = out.min_depth;
+        part.ctx.max_depth = out.max_depth;
+        part.ctx.names = out.names;
+        part.ctx.ids = out.ids;
+        part.ctx.rows = row_format::array;
+        part.ctx.ctl = out.ctl;
+    }
+    call_all([&](size_t s, hierarchy &h) { top_level(h, s, parts[s]); });
+
+    auto root = find_if(parts.begin(), parts.end(), [](const partial &p) { return p.has_root; });
+    if (root == parts.end())
+        return false;
+    if (with_root && out.min_depth <= 0 &&
+        (out.names.empty() || out.names.count(root->root_name)) &&
+        (out.ids.empty() || out.ids.count(root->root_id)))
+        query_row(out.out, out.rows, out.row_index, root->root_id, root->root_name, "");
+
+    /* siblings are in name order, and a name lives in one shard only */
+    vector<const segment *> segs;
+    for (const partial &part : parts) {
+        for (const segment &seg : part.segs)
+            segs.push_back(&seg);
+    }
+    sort(segs.begin(), segs.end(), [](const segment *a, const segment *b) {
+        return a->name < b->name;
+    });
+    for (const segment *seg : segs) {
+        const json &rows = parts[seg->shard].ctx.out;
+        for (size_t i = seg->begin; i < seg->end; i++)
+            query_row(out.out, out.rows, out.row_index, rows[i][0].get_ref<const string &>(),
+                      rows[i][1].get_ref<const string &>(), rows[i][2].get_ref<const string &>());
+    }
+    return true;
+}
+
+/* same results as hierarchy::query() on the whole tree */
+json shard_engine::query(int min_depth, int max_depth, vector<string> &names,
+                         vector<string> &ids, vector<string> &root_ids, row_format rows,
+                         query_control *ctl) {
+    json j_arr;
+    json j;
+    if (rows == row_format::columnar)
+        j_arr = json{{"ids", json::array()}, {"names", json::array()},
+                     {"parents", json::array()}};
+
+    query_context out;
+    out.min_depth = min_depth;
+    out.max_depth = max_depth;
+    out.rows = rows;
+    out.ctl = ctl;
+    if (rows == row_format::columnar)
+        out.out = j_arr;
+    out.names.insert(names.begin(), names.end());
+    out.ids.insert(ids.begin(), ids.end());
+    set<string> root_ids_set(root_ids.begin(), root_ids.end());
+
+    bool found = max_depth >= min_depth;
+    if (found && root_ids_set.empty()) {
+        found = gather(out, true);
+    } else if (found) {
+        call(0, [&](hierarchy &h) { found = h.root != nullptr; });
+    }
+    if (!found) {
+        j["nodes"] = j_arr;
+        return j;
+    }
+
+    for (const string &id : root_ids_set) {
+        if (ctl && ctl->stopped)
+            break;
+        for (;;) {
+            uint32_t s = route(id);
+            if (s == ALL)
+                gather(out, false);
+            if (s == NONE || s == ALL)
+                break;
+            json part;
+            bool here = false;
+            call(s, [&](hierarchy &h) {
+                here = h.find(id) != nullptr;
+                vector<string> one{id};
+                if (here)
+                    part = h.query(min_depth, max_depth, names, ids, one, row_format::array,
+                                   ctl);
+            });
+            if (here) {
+                for (const json &row : part["nodes"])
+                    query_row(out.out, rows, out.row_index, row[0].get_ref<const string &>(),
+                              row[1].get_ref<const string &>(),
+                              row[2].get_ref<const string &>());
+                break;
+            }
+            if (route(id) == s)
+                break;
+            m_retries++;
+        }
+    }
+    j["nodes"] = move(out.out);
+    return j;
+}
+
+size_t shard_engine::size() {
+    size_t n = 0;
+    for (auto &sh : m_shards)
+        n += sh->h.m_index.size();
+    return n > m_shards.size() ? n - (m_shards.size() - 1) : n;
+}
+
+json shard_engine::status() {
+    json shards = json::array();
+    for (auto &sh : m_shards) {
+        /* the root is counted in every shard */
+        shards.push_back(json{{"nodes", sh->h.m_index.size()},
+                              {"tasks", sh->ops.load(memory_order_relaxed)}});
+    }
+    return json{{"shards", shards}, {"handoffs", m_handoffs.load()},
+                {"retries", m_retries.load()}};
+}
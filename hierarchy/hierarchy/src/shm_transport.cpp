@@ -0,0 +1,453 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "nlohmann/json.hpp"
+#include "hierarchy.h"
+#include "request.h"
+#include "codec.h"
+#include "shm_transport.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#endif
+}
+
+static int futex_wait(atomic<uint32_t> *word, uint32_t val, int timeout_ms) {
+    struct timespec ts;
+    struct timespec *pts = nullptr;
+    if (timeout_ms > 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        pts = &ts;
+    }
+    /* shared futex: the word lives in a mapping of another process */
+    return syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAIT,
+                   val, pts, nullptr, 0);
+}
+
+static void futex_wake(atomic<uint32_t> *word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAKE, INT_MAX,
+            nullptr, nullptr, 0);
+}
+
+static size_t data_offset() {
+    return (sizeof(shm_layout) + 63) & ~size_t(63);
+}
+
+shm_endpoint::~shm_endpoint() {
+    if (m_layout == nullptr)
+        return;
+    if (m_owner) {
+        close_channel();
+        shm_unlink(m_name.c_str());
+    } else {
+        uint32_t self = getpid();
+        m_layout->attached.compare_exchange_strong(self, 0);
+    }
+    munmap(m_layout, m_map_size);
+}
+
+int shm_endpoint::map_segment(int fd, size_t size) {
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        cerr << "shm: mmap: " << strerror(errno) << endl;
+        return -1;
+    }
+    m_layout = static_cast<shm_layout *>(p);
+    m_map_size = size;
+    return 0;
+}
+
+int shm_endpoint::create(const string &name, wire_format fmt, uint32_t capacity) {
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+        cerr << "shm: ring capacity must be a power of two" << endl;
+        return -1;
+    }
+    m_name = name[0] == '/' ? name : "/" + name;
+    shm_unlink(m_name.c_str());
+    int fd = shm_open(m_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        cerr << "shm: cannot create " << m_name << ": " << strerror(errno) << endl;
+        return -1;
+    }
+    size_t size = data_offset() + 2 * size_t(capacity);
+    if (ftruncate(fd, size) < 0) {
+        cerr << "shm: ftruncate: " << strerror(errno) << endl;
+        close(fd);
+        shm_unlink(m_name.c_str());
+        return -1;
+    }
+    if (map_segment(fd, size) < 0) {
+        shm_unlink(m_name.c_str());
+        return -1;
+    }
+    m_owner = true;
+
+    /* the fresh mapping is zero-filled, only the header needs setting */
+    m_layout->version = SHM_VERSION;
+    m_layout->capacity = capacity;
+    m_layout->format = uint32_t(fmt);
+    m_layout->server_pid = getpid();
+    atomic_thread_fence(memory_order_release);
+    m_layout->magic = SHM_MAGIC;
+
+    m_in = &m_layout->req;
+    m_out = &m_layout->resp;
+    m_in_data = reinterpret_cast<char *>(m_layout) + data_offset();
+    m_out_data = m_in_data + capacity;
+    return 0;
+}
+
+int shm_endpoint::attach(const string &name) {
+    m_name = name[0] == '/' ? name : "/" + name;
+    int fd = shm_open(m_name.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+        cerr << "shm: cannot open " << m_name << ": " << strerror(errno) << endl;
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || size_t(st.st_size) < data_offset()) {
+        cerr << "shm: " << m_name << " is not a hierarchy channel" << endl;
+        close(fd);
+        return -1;
+    }
+    if (map_segment(fd, st.st_size) < 0)
+        return -1;
+
+    uint32_t expected = 0;
+    if (m_layout->magic != SHM_MAGIC || m_layout->version != SHM_VERSION ||
+        data_offset() + 2 * size_t(m_layout->capacity) > m_map_size) {
+        cerr << "shm: " << m_name << " is not a hierarchy channel" << endl;
+        munmap(m_layout, m_map_size);
+        m_layout = nullptr;
+        return -1;
+    }
+    if (!m_layout->attached.compare_exchange_strong(expected, uint32_t(getpid()))) {
+        cerr << "shm: " << m_name << " already has a client" << endl;
+        munmap(m_layout, m_map_size);
+        m_layout = nullptr;
+        return -1;
+    }
+
+    m_in = &m_layout->resp;
+    m_out = &m_layout->req;
+    m_out_data = reinterpret_cast<char *>(m_layout) + data_offset();
+    m_in_data = m_out_data + m_layout->capacity;
+
+    /* the server is waiting for a request: wake it to reset the rings */
+    m_session = m_layout->session.fetch_add(1) + 1;
+    futex_wake(&m_layout->session);
+    futex_wake(&m_layout->req.head);
+    for (;;) {
+        uint32_t ready = m_layout->ready.load();
+        if (ready == m_session)
+            return 0;
+        if (m_layout->closed.load() || !peer_alive())
+            break;
+        futex_wait(&m_layout->ready, ready, PEER_CHECK_MS);
+    }
+    cerr << "shm: " << m_name << " has no server" << endl;
+    expected = getpid();
+    m_layout->attached.compare_exchange_strong(expected, 0);
+    munmap(m_layout, m_map_size);
+    m_layout = nullptr;
+    return -1;
+}
+
+bool shm_endpoint::accept_session(int timeout_ms) {
+    uint32_t session = m_layout->session.load();
+    if (session == m_session) {
+        if (m_layout->ready.load() == m_session)
+            return true;
+        /* the client was dropped: leave the rings alone until the next one */
+        futex_wait(&m_layout->session, session, timeout_ms);
+        return false;
+    }
+    shm_ring *rings[] = { &m_layout->req, &m_layout->resp };
+    for (shm_ring *r : rings) {
+        r->head.store(0);
+        r->tail.store(0);
+        r->consumer_waiting.store(0);
+        r->producer_waiting.store(0);
+    }
+    m_session = session;
+    m_layout->ready.store(session);
+    futex_wake(&m_layout->ready);
+    return true;
+}
+
+void shm_endpoint::drop_client(bool only_if_dead) {
+    uint32_t pid = m_layout->attached.load();
+    if (pid == 0 || (only_if_dead && peer_alive()))
+        return;
+    /* a client still waiting on a ring sees the session end */
+    m_layout->ready.store(0);
+    futex_wake(&m_layout->resp.head);
+    futex_wake(&m_layout->req.tail);
+    m_layout->attached.compare_exchange_strong(pid, 0);
+}
+
+/* the session was replaced or ended, or the channel closed */
+bool shm_endpoint::stale() const {
+    if (m_layout->closed.load(memory_order_relaxed))
+        return true;
+    const atomic<uint32_t> &current = m_owner ? m_layout->session : m_layout->ready;
+    return current.load(memory_order_relaxed) != m_session;
+}
+
+bool shm_endpoint::peer_alive() const {
+    pid_t pid = m_owner ? pid_t(m_layout->attached.load()) : pid_t(m_layout->server_pid);
+    return pid == 0 || kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+void shm_endpoint::close_channel() {
+    if (m_layout == nullptr)
+        return;
+    m_layout->closed.store(1);
+    futex_wake(&m_layout->req.head);
+    futex_wake(&m_layout->req.tail);
+    futex_wake(&m_layout->resp.head);
+    futex_wake(&m_layout->resp.tail);
+}
+
+/*
+ * Wait until *word moves away from seen. Returns false on timeout or when
+ * the session went stale.
+ */
+bool shm_endpoint::wait_change(atomic<uint32_t> *word, uint32_t seen,
+                               atomic<uint32_t> *waiting, int timeout_ms) {
+    auto start = chrono::steady_clock::now();
+    for (long i = 0; m_busy_poll || i < m_spin; i++) {
+        if (word->load(memory_order_acquire) != seen)
+            return true;
+        if (stale())
+            return false;
+        if (m_busy_poll && timeout_ms > 0 && (i & 4095) == 4095 &&
+            chrono::steady_clock::now() - start > chrono::milliseconds(timeout_ms))
+            return false;
+        cpu_relax();
+    }
+
+    /* pairs with the seq_cst store + waiting check on the other side */
+    waiting->store(1);
+    if (word->load() == seen && !stale())
+        futex_wait(word, seen, timeout_ms);
+    waiting->store(0, memory_order_relaxed);
+    return word->load(memory_order_acquire) != seen && !stale();
+}
+
+bool shm_endpoint::read_bytes(char *dst, size_t len, int timeout_ms) {
+    uint32_t mask = m_layout->capacity - 1;
+    size_t done = 0;
+    while (done < len) {
+        uint32_t tail = m_in->tail.load(memory_order_relaxed);
+        uint32_t head = m_in->head.load(memory_order_acquire);
+        uint32_t avail = head - tail;
+        if (avail == 0) {
+            /* only the start of a message may time out, the rest waits on the peer */
+            int t = done == 0 ? timeout_ms : PEER_CHECK_MS;
+            if (!wait_change(&m_in->head, head, &m_in->consumer_waiting, t) &&
+                (done == 0 || stale() || !peer_alive()))
+                return false;
+            continue;
+        }
+
+        uint32_t n = min<size_t>(avail, len - done);
+        uint32_t off = tail & mask;
+        uint32_t first = min(n, m_layout->capacity - off);
+        memcpy(dst + done, m_in_data + off, first);
+        memcpy(dst + done + first, m_in_data, n - first);
+        m_in->tail.store(tail + n);
+        if (m_in->producer_waiting.load())
+            futex_wake(&m_in->tail);
+        done += n;
+    }
+    return true;
+}
+
+bool shm_endpoint::write_bytes(const char *src, size_t len) {
+    uint32_t cap = m_layout->capacity;
+    uint32_t mask = cap - 1;
+    size_t done = 0;
+    while (done < len) {
+        uint32_t head = m_out->head.load(memory_order_relaxed);
+        uint32_t tail = m_out->tail.load(memory_order_acquire);
+        uint32_t space = cap - (head - tail);
+        if (space == 0) {
+            if (!wait_change(&m_out->tail, tail, &m_out->producer_waiting, PEER_CHECK_MS) &&
+                (stale() || !peer_alive()))
+                return false;
+            continue;
+        }
+
+        uint32_t n = min<size_t>(space, len - done);
+        uint32_t off = head & mask;
+        uint32_t first = min(n, cap - off);
+        memcpy(m_out_data + off, src + done, first);
+        memcpy(m_out_data, src + done + first, n - first);
+        m_out->head.store(head + n);
+        if (m_out->consumer_waiting.load())
+            futex_wake(&m_out->head);
+        done += n;
+    }
+    return true;
+}
+
+bool shm_endpoint::recv(string &payload, int timeout_ms) {
+    unsigned char hdr[4];
+    if (stale())
+        return false;
+    if (!read_bytes(reinterpret_cast<char *>(hdr), 4, timeout_ms))
+        return false;
+    uint32_t size = (uint32_t(hdr[0]) << 24) | (uint32_t(hdr[1]) << 16) |
+                    (uint32_t(hdr[2]) << 8) | uint32_t(hdr[3]);
+    if (size > MAX_FRAME_SIZE) {
+        /* framing is lost, nothing after this point can be trusted */
+        if (m_owner)
+            drop_client(false);
+        return false;
+    }
+    payload.resize(size);
+    if (read_bytes(&payload[0], size, 0))
+        return true;
+    if (m_owner)
+        drop_client(true);
+    return false;
+}
+
+bool shm_endpoint::send(const char *data, size_t len) {
+    if (stale())
+        return false;
+    char hdr[4] = { char(len >> 24), char(len >> 16), char(len >> 8), char(len) };
+    return write_bytes(hdr, 4) && write_bytes(data, len);
+}
+
+int shm_server::create(const string &name) {
+    if (m_ep.create(name, m_format) < 0)
+        return -1;
+    m_ep.set_spin(m_busy_poll);
+    return 0;
+}
+
+int shm_server::run() {
+    string req;
+    string resp_buf;
+    while (!m_stop) {
+        /* wake up regularly to notice stop() and a client that died */
+        if (!m_ep.accept_session(200))
+            continue;
+        if (!m_ep.recv(req, 200)) {
+            m_ep.drop_client(true);
+            continue;
+        }
+        json j = decode_payload(req.data(), req.size(), m_format);
+        json resp = j.is_discarded() ? m_h.fail :
+            jsonDecodeProcess(m_h, j, wire_row_format(m_format));
+        resp_buf.clear();
+        encode_payload(resp, m_format, resp_buf);
+        jsonCommitResponses(m_h);
+        if (!m_ep.send(resp_buf.data(), resp_buf.size()))
+            m_ep.drop_client(true);
+    }
+    return 0;
+}
+
+static void print_latency(const char *op, vector<double> &us) {
+    if (us.empty())
+        return;
+    sort(us.begin(), us.end());
+    double sum = 0;
+    for (double v : us)
+        sum += v;
+    fprintf(stderr, "%-12s n=%zu mean=%.2fus p50=%.2fus p99=%.2fus max=%.2fus\n",
+            op, us.size(), sum / us.size(), us[us.size() / 2],
+            us[us.size() * 99 / 100], us.back());
+}
+
+int shm_bench(const string &name, int count, bool busy_poll) {
+    shm_endpoint ep;
+    if (ep.attach(name) < 0)
+        return -1;
+    ep.set_spin(busy_poll);
+    wire_format fmt = ep.format();
+
+    string req;
+    string resp;
+    json r;
+    /* round trip time in us, or -1 if the call failed or was refused */
+    auto call = [&](const json &j) -> double {
+        req.clear();
+        encode_payload(j, fmt, req);
+        auto t0 = chrono::steady_clock::now();
+        if (!ep.send(req.data(), req.size()) || !ep.recv(resp)) {
+            cerr << "shm-bench: " << name << " went away" << endl;
+            return -1;
+        }
+        double us = chrono::duration<double, micro>(chrono::steady_clock::now() - t0).count();
+        r = decode_payload(resp.data(), resp.size(), fmt);
+        bool ok = r.is_object() && (j.begin().key() == "query" ? r.count("nodes") != 0 :
+                                    r.value("ok", false));
+        if (!ok) {
+            cerr << "shm-bench: " << j.dump() << " failed: " << r.dump() << endl;
+            return -1;
+        }
+        return us;
+    };
+
+    /* the bench nodes go below the root of a tree that is not empty */
+    string root = "shm-bench-root";
+    if (call(json{{"query", {{"max_depth", 0}}}}) < 0)
+        return -1;
+    json add_root = {{"id", root}, {"name", root}};
+    if (!r["nodes"].empty()) {
+        const json &row = r["nodes"][0];
+        add_root["parent_id"] = row.is_array() ? row[0] : row["id"];
+    }
+    if (call(json{{"add_node", add_root}}) < 0 ||
+        call(json{{"add_node", {{"id", root + "-a"}, {"name", "a"}, {"parent_id", root}}}}) < 0 ||
+        call(json{{"add_node", {{"id", root + "-b"}, {"name", "b"}, {"parent_id", root}}}}) < 0)
+        return -1;
+
+    vector<double> add_us, move_us, delete_us;
+    for (int i = 0; i < count; i++) {
+        string id = root + "-" + to_string(i);
+        double add = call(json{{"add_node", {{"id", id}, {"name", id}, {"parent_id", root + "-a"}}}});
+        double mv = add < 0 ? -1 :
+            call(json{{"move_node", {{"id", id}, {"new_parent_id", root + "-b"}}}});
+        double del = mv < 0 ? -1 : call(json{{"delete_node", {{"id", id}}}});
+        if (del < 0)
+            return -1;
+        add_us.push_back(add);
+        move_us.push_back(mv);
+        delete_us.push_back(del);
+    }
+    /* leave the tree as it was, so the bench can run again */
+    if (call(json{{"delete_node", {{"id", root + "-a"}}}}) < 0 ||
+        call(json{{"delete_node", {{"id", root + "-b"}}}}) < 0 ||
+        call(json{{"delete_node", {{"id", root}}}}) < 0)
+        return -1;
+    print_latency("add_node", add_us);
+    print_latency("move_node", move_us);
+    print_latency("delete_node", delete_us);
+    return 0;
+}
@@ -0,0 +1,402 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "nlohmann/json.hpp"
+#include "hierarchy.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "lazy.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+static uint32_t header_crc(snap_header hdr) {
+    hdr.header_crc = 0;
+    return wal_crc32(&hdr, sizeof(hdr));
+}
+
+io_throttle::io_throttle(uint64_t bytes_per_sec) :
+    m_rate(bytes_per_sec), m_start(chrono::steady_clock::now()) {}
+
+bool io_throttle::write(int fd, const void *data, size_t len) {
+    const size_t CHUNK = 256 << 10;
+    const char *p = static_cast<const char *>(data);
+    while (len > 0) {
+        if (m_rate) {
+            auto due = m_start + chrono::microseconds(m_written * 1000000 / m_rate);
+            this_thread::sleep_until(due);
+        }
+        ssize_t n = ::write(fd, p, m_rate ? min(len, CHUNK) : len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+        m_written += n;
+    }
+    return true;
+}
+
+int snapshot_write_fd(hierarchy &h, int fd, uint64_t wal_lsn, uint64_t bytes_per_sec) {
+    vector<snap_node> nodes;
+    string pool;
+
+    /* pre-order walk, linking each record to its parent and previous sibling */
+    struct frame {
+        Node *next;
+        uint32_t parent;
+        uint32_t prev;
+        uint32_t depth;
+    };
+    vector<frame> stack;
+    if (h.root)
+        stack.push_back({h.root, SNAP_NONE, SNAP_NONE, 0});
+    while (!stack.empty()) {
+        frame &f = stack.back();
+        if (f.next == nullptr) {
+            stack.pop_back();
+            continue;
+        }
+        Node *n = f.next;
+        f.next = n->next;
+
+        uint32_t idx = nodes.size();
+        snap_node rec;
+        rec.id_off = pool.size();
+        rec.id_len = n->id.size();
+        pool += n->id;
+        rec.name_off = pool.size();
+        rec.name_len = n->name.size();
+        pool += n->name;
+        rec.parent = f.parent;
+        rec.first_child = SNAP_NONE;
+        rec.next_sibling = SNAP_NONE;
+        rec.depth = f.depth;
+        nodes.push_back(rec);
+
+        if (f.prev != SNAP_NONE)
+            nodes[f.prev].next_sibling = idx;
+        else if (f.parent != SNAP_NONE)
+            nodes[f.parent].first_child = idx;
+        f.prev = idx;
+
+        uint32_t depth = f.depth;
+        h.expand(n);
+        if (n->child)
+            stack.push_back({n->child, idx, SNAP_NONE, depth + 1});
+    }
+
+    vector<uint32_t> index(nodes.size());
+    for (uint32_t i = 0; i < index.size(); i++)
+        index[i] = i;
+    sort(index.begin(), index.end(), [&](uint32_t a, uint32_t b) {
+        const snap_node &x = nodes[a];
+        const snap_node &y = nodes[b];
+        int c = memcmp(pool.data() + x.id_off, pool.data() + y.id_off,
+                       min(x.id_len, y.id_len));
+        return c < 0 || (c == 0 && x.id_len < y.id_len);
+    });
+
+    snap_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SNAP_MAGIC;
+    hdr.version = SNAP_VERSION;
+    hdr.node_count = nodes.size();
+    hdr.wal_lsn = wal_lsn;
+    hdr.nodes_off = sizeof(snap_header);
+    hdr.index_off = hdr.nodes_off + nodes.size() * sizeof(snap_node);
+    hdr.pool_off = hdr.index_off + index.size() * sizeof(uint32_t);
+    hdr.pool_size = pool.size();
+    hdr.root = nodes.empty() ? SNAP_NONE : 0;
+    hdr.header_crc = header_crc(hdr);
+
+    io_throttle out(bytes_per_sec);
+    bool ok = out.write(fd, &hdr, sizeof(hdr)) &&
+              out.write(fd, nodes.data(), nodes.size() * sizeof(snap_node)) &&
+              out.write(fd, index.data(), index.size() * sizeof(uint32_t)) &&
+              out.write(fd, pool.data(), pool.size());
+    return ok ? 0 : -1;
+}
+
+int snapshot_write(hierarchy &h, const string &path, uint64_t wal_lsn,
+                   uint64_t bytes_per_sec) {
+    string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        cerr << "snapshot: cannot create " << tmp << ": " << strerror(errno) << endl;
+        return -1;
+    }
+    bool ok = snapshot_write_fd(h, fd, wal_lsn, bytes_per_sec) == 0 && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp.c_str(), path.c_str()) < 0) {
+        cerr << "snapshot: cannot write " << path << ": " << strerror(errno) << endl;
+        unlink(tmp.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+int snapshot_map(const string &path, const char *&base, size_t &size) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        cerr << "snapshot: cannot open " << path << ": " << strerror(errno) << endl;
+        return -1;
+    }
+    int rc = snapshot_map_fd(fd, path, base, size);
+    close(fd);
+    return rc;
+}
+
+int snapshot_map_fd(int fd, const string &path, const char *&base, size_t &size) {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || size_t(st.st_size) < sizeof(snap_header)) {
+        cerr << "snapshot: " << path << " is not a snapshot" << endl;
+        return -1;
+    }
+    size = st.st_size;
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        cerr << "snapshot: cannot mmap " << path << ": " << strerror(errno) << endl;
+        return -1;
+    }
+
+    base = static_cast<const char *>(map);
+    const snap_header *hdr = reinterpret_cast<const snap_header *>(base);
+    uint64_t n = hdr->node_count;
+    if (hdr->magic != SNAP_MAGIC || hdr->version != SNAP_VERSION ||
+        hdr->header_crc != header_crc(*hdr) ||
+        hdr->nodes_off + n * sizeof(snap_node) > size ||
+        hdr->index_off + n * sizeof(uint32_t) > size ||
+        hdr->pool_off + hdr->pool_size > size ||
+        (n > 0 && hdr->root >= n)) {
+        cerr << "snapshot: " << path << " is corrupt" << endl;
+        munmap(map, size);
+        return -1;
+    }
+    return 0;
+}
+
+static int load_mapped(hierarchy &h, const string &path, const char *base, size_t size,
+                       uint64_t &wal_lsn);
+
+int snapshot_load(hierarchy &h, const string &path, uint64_t &wal_lsn) {
+    if (h.root != nullptr) {
+        cerr << "snapshot: the tree is not empty" << endl;
+        return -1;
+    }
+    if (h.m_lazy)
+        return h.m_lazy->open(h, path, wal_lsn);
+
+    const char *base;
+    size_t size;
+    if (snapshot_map(path, base, size) < 0)
+        return -1;
+    return load_mapped(h, path, base, size, wal_lsn);
+}
+
+int snapshot_load_fd(hierarchy &h, int fd, uint64_t &wal_lsn) {
+    const string path = "snapshot fd " + to_string(fd);
+    const char *base;
+    size_t size;
+    if (h.root != nullptr || snapshot_map_fd(fd, path, base, size) < 0)
+        return -1;
+    return load_mapped(h, path, base, size, wal_lsn);
+}
+
+static int load_mapped(hierarchy &h, const string &path, const char *base, size_t size,
+                       uint64_t &wal_lsn) {
+    void *map = const_cast<char *>(base);
+    const snap_header *hdr = reinterpret_cast<const snap_header *>(base);
+    uint64_t n = hdr->node_count;
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    const snap_node *recs = reinterpret_cast<const snap_node *>(base + hdr->nodes_off);
+    const char *pool = base + hdr->pool_off;
+
+    /*
+     * Records are in pre-order, so a parent is always built before its
+     * children and sibling links only ever point forward.
+     */
+    vector<Node *> built(n);
+    node_pool::reserve(n);
+    h.m_index.reserve(n);
+    for (uint64_t i = 0; i < n; i++) {
+        const snap_node &r = recs[i];
+        if (r.id_off + r.id_len > hdr->pool_size ||
+            r.name_off + r.name_len > hdr->pool_size ||
+            (r.parent != SNAP_NONE && r.parent >= i)) {
+            cerr << "snapshot: " << path << " is corrupt at node " << i << endl;
+            for (uint64_t k = 0; k < i; k++)
+                delete built[k];
+            h.m_index.clear();
+            munmap(map, size);
+            return -1;
+        }
+        Node *node = new Node();
+        node->id.assign(pool + r.id_off, r.id_len);
+        node->name.assign(pool + r.name_off, r.name_len);
+        if (r.parent != SNAP_NONE) {
+            Node *parent = built[r.parent];
+            node->parent_id = parent->id;
+            if (recs[r.parent].first_child == i)
+                parent->child = node;
+        }
+        built[i] = node;
+        h.m_index.insert(node);
+    }
+    for (uint64_t i = 0; i < n; i++) {
+        uint32_t next = recs[i].next_sibling;
+        if (next != SNAP_NONE && next > i && next < n)
+            built[i]->next = built[next];
+    }
+
+    h.root = n > 0 ? built[hdr->root] : nullptr;
+    wal_lsn = hdr->wal_lsn;
+    munmap(map, size);
+    return 0;
+}
+
+struct snapshot_child_report {
+    int32_t rc;
+    uint32_t pad;
+    double duration_ms;
+    uint64_t private_kb;
+};
+
+static mutex bg_lock;
+static condition_variable bg_done;
+static bool bg_running = false;
+static json bg_status = json{{"running", false}};
+
+/* memory private to this process, from /proc/self/smaps_rollup */
+static uint64_t private_kb() {
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (f == nullptr)
+        return 0;
+    char line[256];
+    uint64_t total = 0;
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long long kb;
+        if (sscanf(line, "Private_Clean: %llu kB", &kb) == 1 ||
+            sscanf(line, "Private_Dirty: %llu kB", &kb) == 1)
+            total += kb;
+    }
+    fclose(f);
+    return total;
+}
+
+static long minor_faults() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_minflt;
+}
+
+static void snapshot_reap(pid_t pid, int fd, string path, long faults_before) {
+    snapshot_child_report rep;
+    memset(&rep, 0, sizeof(rep));
+    rep.rc = -1;
+    size_t got = 0;
+    while (got < sizeof(rep)) {
+        ssize_t n = read(fd, reinterpret_cast<char *>(&rep) + got, sizeof(rep) - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        got += n;
+    }
+    close(fd);
+    int wstatus;
+    while (waitpid(pid, &wstatus, 0) < 0 && errno == EINTR)
+        ;
+    long copied = minor_faults() - faults_before;
+
+    bool ok = got == sizeof(rep) && rep.rc == 0 && WIFEXITED(wstatus) &&
+              WEXITSTATUS(wstatus) == 0;
+    json status = {{"running", false}, {"ok", ok}, {"path", path}, {"pid", pid},
+                   {"duration_ms", rep.duration_ms}, {"pages_copied", copied},
+                   {"rss_overhead_kb", rep.private_kb}};
+    cerr << "snapshot: " << status.dump() << endl;
+
+    lock_guard<mutex> lk(bg_lock);
+    bg_status = status;
+    bg_running = false;
+    bg_done.notify_all();
+}
+
+int snapshot_start(hierarchy &h, const string &path, uint64_t wal_lsn, json &resp,
+                   uint64_t bytes_per_sec) {
+    auto t0 = chrono::steady_clock::now();
+    {
+        lock_guard<mutex> lk(bg_lock);
+        if (bg_running)
+            return -1;
+        bg_running = true;
+    }
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        lock_guard<mutex> lk(bg_lock);
+        bg_running = false;
+        return -1;
+    }
+    /* make sure the child never has to run one-time initialisation */
+    wal_crc32("", 0);
+    long faults_before = minor_faults();
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        lock_guard<mutex> lk(bg_lock);
+        bg_running = false;
+        return -1;
+    }
+    if (pid == 0) {
+        /* child: the tree is frozen at the moment of the fork */
+        close(fds[0]);
+        snapshot_child_report rep;
+        memset(&rep, 0, sizeof(rep));
+        auto start = chrono::steady_clock::now();
+        rep.rc = snapshot_write(h, path, wal_lsn, bytes_per_sec);
+        rep.duration_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        rep.private_kb = private_kb();
+        ssize_t n = write(fds[1], &rep, sizeof(rep));
+        _exit(rep.rc == 0 && n == sizeof(rep) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    thread(snapshot_reap, pid, fds[0], path, faults_before).detach();
+    {
+        lock_guard<mutex> lk(bg_lock);
+        bg_status = json{{"running", true}, {"path", path}, {"pid", pid}};
+    }
+    double pause_us = chrono::duration<double, micro>(chrono::steady_clock::now() - t0).count();
+    resp = json{{"ok", true}, {"pid", pid}, {"pause_us", pause_us}};
+    return 0;
+}
+
+json snapshot_status() {
+    lock_guard<mutex> lk(bg_lock);
+    return bg_status;
+}
+
+bool snapshot_wait() {
+    unique_lock<mutex> lk(bg_lock);
+    bg_done.wait(lk, [] { return !bg_running; });
+    return bg_status.value("ok", false);
+}
@@ -0,0 +1,158 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "nlohmann/json.hpp"
+#include "hierarchy.h"
+#include "epoch.h"
+#include "subtree_locks.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+const size_t subtree_locks::STRIPES;
+const size_t subtree_locks::ROOT;
+
+string subtree_locks::parent_of(Node *n) {
+    shared_guard lk(m_stripes[stripe(n->id)]);
+    return n->parent_id;
+}
+
+/* merge the set, then lock it in ascending stripe order */
+void subtree_locks::lock(vector<want> &set) {
+    sort(set.begin(), set.end(), [](const want &a, const want &b) {
+        return a.stripe < b.stripe;
+    });
+    size_t k = 0;
+    for (size_t i = 0; i < set.size(); i++) {
+        if (k > 0 && set[k - 1].stripe == set[i].stripe)
+            set[k - 1].exclusive = set[k - 1].exclusive || set[i].exclusive;
+        else
+            set[k++] = set[i];
+    }
+    set.resize(k);
+    for (const want &w : set) {
+        if (w.exclusive)
+            m_stripes[w.stripe].lock();
+        else
+            m_stripes[w.stripe].lock_shared();
+    }
+}
+
+void subtree_locks::unlock(const vector<want> &set) {
+    for (auto it = set.rbegin(); it != set.rend(); ++it) {
+        if (it->exclusive)
+            m_stripes[it->stripe].unlock();
+        else
+            m_stripes[it->stripe].unlock_shared();
+    }
+}
+
+bool subtree_locks::lock_add(const wal_record &rec, vector<want> &set) {
+    set = {{stripe(rec.id), true},
+           {rec.parent_id.empty() ? ROOT : stripe(rec.parent_id), true}};
+    lock(set);
+    return true;
+}
+
+bool subtree_locks::lock_delete(const wal_record &rec, vector<want> &set) {
+    for (;;) {
+        Node *n = m_h.find(rec.id);
+        if (n == nullptr)
+            return false;
+        string parent_id = parent_of(n);
+        set = {{stripe(rec.id), true},
+               {parent_id.empty() ? ROOT : stripe(parent_id), true}};
+        lock(set);
+        n = m_h.find(rec.id);
+        if (n == nullptr) {
+            unlock(set);
+            return false;
+        }
+        if (n->parent_id == parent_id)
+            return true;
+        unlock(set);
+        m_retries++;
+    }
+}
+
+bool subtree_locks::lock_move(const wal_record &rec, vector<want> &set) {
+    for (;;) {
+        Node *n = m_h.find(rec.id);
+        Node *new_parent = m_h.find(rec.parent_id);
+        if (n == nullptr || new_parent == nullptr)
+            return false;
+        string old_parent_id = parent_of(n);
+        if (old_parent_id.empty())
+            return false;
+
+        /* the new parent's ancestors as they are now */
+        vector<string> up;
+        for (Node *cur = new_parent; cur; ) {
+            up.push_back(cur->id);
+            string parent_id = parent_of(cur);
+            if (parent_id.empty() || up.size() > m_h.m_index.size())
+                break;
+            cur = m_h.find(parent_id);
+        }
+        set = {{stripe(rec.id), true}, {stripe(old_parent_id), true},
+               {stripe(rec.parent_id), true}};
+        for (const string &id : up)
+            set.push_back({stripe(id), false});
+        lock(set);
+
+        /* still the same, now that none of them can move? */
+        n = m_h.find(rec.id);
+        Node *cur = m_h.find(rec.parent_id);
+        if (n == nullptr || cur == nullptr) {
+            unlock(set);
+            return false;
+        }
+        bool same = n->parent_id == old_parent_id;
+        for (size_t i = 0; same; i++) {
+            if (cur == nullptr || i == up.size() || cur->id != up[i]) {
+                same = false;
+            } else if (cur->parent_id.empty()) {
+                same = i + 1 == up.size();
+                break;
+            } else {
+                cur = m_h.find(cur->parent_id);
+            }
+        }
+        if (same)
+            return true;
+        unlock(set);
+        m_retries++;
+    }
+}
+
+bool subtree_locks::apply(wal_record &rec, bool logged) {
+    /* writers hold node pointers outside the locks too */
+    epoch_guard pin(m_h.m_epochs);
+    vector<want> set;
+    bool locked = false;
+    switch (rec.op) {
+    case wal_op::add_node:
+        locked = lock_add(rec, set);
+        break;
+    case wal_op::delete_node:
+        locked = lock_delete(rec, set);
+        break;
+    case wal_op::move_node:
+        locked = lock_move(rec, set);
+        break;
+    }
+    if (!locked)
+        return false;
+    m_ops++;
+    bool ok = m_h.apply(rec);
+    if (ok && logged)
+        m_h.log(rec);
+    unlock(set);
+    return ok;
+}
+
+json subtree_locks::status() {
+    return json{{"stripes", STRIPES}, {"mutations", m_ops.load()},
+                {"retries", m_retries.load()}};
+}
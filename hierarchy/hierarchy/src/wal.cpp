@@ -0,0 +1,376 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "wal.h"
+
+using namespace std;
+
+static uint32_t crc_table[256];
+static once_flag crc_once;
+
+static void crc_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+uint32_t wal_crc32(const void *data, size_t len, uint32_t crc) {
+    call_once(crc_once, crc_init);
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    crc = ~crc;
+    while (len--)
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void put_u32(string &out, uint32_t v) {
+    char b[4] = { char(v), char(v >> 8), char(v >> 16), char(v >> 24) };
+    out.append(b, 4);
+}
+
+static uint32_t get_u32(const char *p) {
+    const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+    return uint32_t(u[0]) | (uint32_t(u[1]) << 8) | (uint32_t(u[2]) << 16) |
+           (uint32_t(u[3]) << 24);
+}
+
+static void put_varint(string &out, uint64_t v) {
+    while (v >= 0x80) {
+        out += char((v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    out += char(v);
+}
+
+static bool get_varint(const char *&p, const char *end, uint64_t &v) {
+    v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        unsigned char b = *p++;
+        v |= uint64_t(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static void put_str(string &out, const string &s) {
+    put_varint(out, s.size());
+    out += s;
+}
+
+static bool get_str(const char *&p, const char *end, string &s) {
+    uint64_t len;
+    if (!get_varint(p, end, len) || len > uint64_t(end - p))
+        return false;
+    s.assign(p, len);
+    p += len;
+    return true;
+}
+
+void write_ahead_log::encode(const wal_record &rec, string &out) {
+    size_t head = out.size();
+    out.append(8, '\0');
+    out += char(rec.op);
+    put_varint(out, rec.lsn);
+    put_str(out, rec.id);
+    put_str(out, rec.name);
+    put_str(out, rec.parent_id);
+
+    uint32_t len = out.size() - head - 8;
+    uint32_t crc = wal_crc32(out.data() + head + 8, len);
+    string hdr;
+    put_u32(hdr, len);
+    put_u32(hdr, crc);
+    out.replace(head, 8, hdr);
+}
+
+static bool decode_body(const char *p, const char *end, wal_record &rec) {
+    if (p >= end)
+        return false;
+    uint8_t op = *p++;
+    if (op < uint8_t(wal_op::add_node) || op > uint8_t(wal_op::move_node))
+        return false;
+    rec.op = wal_op(op);
+    return get_varint(p, end, rec.lsn) && get_str(p, end, rec.id) &&
+           get_str(p, end, rec.name) && get_str(p, end, rec.parent_id) && p == end;
+}
+
+bool write_ahead_log::decode(const char *p, const char *end, wal_record &rec, size_t &len) {
+    len = 0;
+    if (end - p < 8)
+        return false;
+    uint32_t body_len = get_u32(p);
+    uint32_t crc = get_u32(p + 4);
+    if (body_len > uint64_t(end - p - 8))
+        return false;
+    const char *body = p + 8;
+    if (wal_crc32(body, body_len) != crc || !decode_body(body, body + body_len, rec))
+        return false;
+    len = 8 + body_len;
+    return true;
+}
+
+int write_ahead_log::replay(const string &path, const function<void(const wal_record &)> &fn,
+                            uint64_t &last_lsn, uint64_t &valid_end) {
+    last_lsn = 0;
+    valid_end = 0;
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        ::close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    if (size == 0) {
+        ::close(fd);
+        return 0;
+    }
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    const char *data = static_cast<const char *>(map);
+    if (size < 8 || get_u32(data) != WAL_MAGIC || get_u32(data + 4) != WAL_VERSION) {
+        munmap(map, size);
+        return -1;
+    }
+
+    size_t off = 8;
+    wal_record rec;
+    size_t len;
+    while (decode(data + off, data + size, rec, len)) {
+        fn(rec);
+        last_lsn = rec.lsn;
+        off += len;
+    }
+    valid_end = off;
+    munmap(map, size);
+    return 0;
+}
+
+void write_ahead_log::encode_header(string &out) {
+    put_u32(out, WAL_MAGIC);
+    put_u32(out, WAL_VERSION);
+}
+
+/* empty the file down to a bare header */
+static bool init_log(int fd) {
+    string hdr;
+    write_ahead_log::encode_header(hdr);
+    return ftruncate(fd, 0) == 0 && pwrite(fd, hdr.data(), hdr.size(), 0) == 8;
+}
+
+void wal_sync_dir(const string &path) {
+    size_t slash = path.rfind('/');
+    string dir = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        ::close(fd);
+    }
+}
+
+int write_ahead_log::open(const string &path, wal_sync policy, int interval_ms,
+                          uint64_t min_lsn) {
+    uint64_t last_lsn;
+    uint64_t valid_end;
+    if (replay(path, [](const wal_record &) {}, last_lsn, valid_end) < 0) {
+        cerr << "wal: " << path << " is not a write-ahead log" << endl;
+        return -1;
+    }
+
+    m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (m_fd < 0) {
+        cerr << "wal: cannot open " << path << ": " << strerror(errno) << endl;
+        return -1;
+    }
+
+    /* drop a torn tail left by a crash, then append after the last record */
+    if (valid_end == 0) {
+        if (!init_log(m_fd)) {
+            cerr << "wal: cannot initialise " << path << ": " << strerror(errno) << endl;
+            ::close(m_fd);
+            m_fd = -1;
+            return -1;
+        }
+        valid_end = 8;
+    } else if (ftruncate(m_fd, valid_end) < 0) {
+        cerr << "wal: cannot truncate " << path << ": " << strerror(errno) << endl;
+        ::close(m_fd);
+        m_fd = -1;
+        return -1;
+    }
+    lseek(m_fd, valid_end, SEEK_SET);
+    fsync(m_fd);
+
+    m_path = path;
+    m_policy = policy;
+    m_interval_ms = interval_ms > 0 ? interval_ms : 1;
+    if (last_lsn < min_lsn)
+        last_lsn = min_lsn;
+    m_next_lsn = last_lsn + 1;
+    m_durable_lsn = last_lsn;
+    m_stop = false;
+    m_flusher = thread(&write_ahead_log::flush_loop, this);
+    return 0;
+}
+
+void write_ahead_log::close() {
+    if (m_fd < 0)
+        return;
+    {
+        lock_guard<mutex> lk(m_lock);
+        m_stop = true;
+    }
+    m_flush_cv.notify_all();
+    m_flusher.join();
+    fsync(m_fd);
+    ::close(m_fd);
+    m_fd = -1;
+}
+
+uint64_t write_ahead_log::append(wal_record &rec) {
+    lock_guard<mutex> lk(m_lock);
+    rec.lsn = m_next_lsn++;
+    encode(rec, m_buf);
+    if (m_policy != wal_sync::interval)
+        m_flush_cv.notify_one();
+    return rec.lsn;
+}
+
+void write_ahead_log::append(vector<wal_record> &recs) {
+    lock_guard<mutex> lk(m_lock);
+    for (wal_record &rec : recs) {
+        rec.lsn = m_next_lsn++;
+        encode(rec, m_buf);
+    }
+    if (m_policy != wal_sync::interval)
+        m_flush_cv.notify_one();
+}
+
+uint64_t write_ahead_log::last_lsn() {
+    lock_guard<mutex> lk(m_lock);
+    return m_next_lsn - 1;
+}
+
+void write_ahead_log::commit() {
+    if (m_policy == wal_sync::per_op)
+        wait_durable(last_lsn());
+}
+
+void write_ahead_log::wait_durable(uint64_t lsn) {
+    unique_lock<mutex> lk(m_lock);
+    m_durable_cv.wait(lk, [&] { return m_durable_lsn >= lsn; });
+}
+
+int write_ahead_log::rotate(const string &seg_path) {
+    unique_lock<mutex> lk(m_lock);
+    m_flush_cv.notify_one();
+    m_durable_cv.wait(lk, [&] { return m_buf.empty() && !m_writing; });
+
+    /* the flusher cannot start another batch while we hold m_lock */
+    int fd = ::open((m_path + ".tmp").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || !init_log(fd) || fsync(fd) < 0) {
+        cerr << "wal: cannot create a new log: " << strerror(errno) << endl;
+        if (fd >= 0)
+            ::close(fd);
+        return -1;
+    }
+    fsync(m_fd);
+    if (rename(m_path.c_str(), seg_path.c_str()) < 0 ||
+        rename((m_path + ".tmp").c_str(), m_path.c_str()) < 0) {
+        cerr << "wal: cannot rotate " << m_path << ": " << strerror(errno) << endl;
+        abort();
+    }
+    wal_sync_dir(m_path);
+    ::close(m_fd);
+    m_fd = fd;
+    lseek(m_fd, 8, SEEK_SET);
+    m_durable_lsn = m_next_lsn - 1;
+    return 0;
+}
+
+int write_ahead_log::quiesce() {
+    unique_lock<mutex> lk(m_lock);
+    m_flush_cv.notify_one();
+    m_durable_cv.wait(lk, [&] { return m_buf.empty() && !m_writing; });
+    fsync(m_fd);
+    m_durable_lsn = m_next_lsn - 1;
+    return m_fd;
+}
+
+int write_ahead_log::adopt(int fd, const string &path, wal_sync policy, int interval_ms,
+                           uint64_t last_lsn) {
+    if (lseek(fd, 0, SEEK_END) < 8) {
+        cerr << "wal: handed over descriptor is not a log" << endl;
+        return -1;
+    }
+    m_fd = fd;
+    m_path = path;
+    m_policy = policy;
+    m_interval_ms = interval_ms > 0 ? interval_ms : 1;
+    m_next_lsn = last_lsn + 1;
+    m_durable_lsn = last_lsn;
+    m_stop = false;
+    m_flusher = thread(&write_ahead_log::flush_loop, this);
+    return 0;
+}
+
+void write_ahead_log::flush_loop() {
+    unique_lock<mutex> lk(m_lock);
+    while (true) {
+        if (m_policy == wal_sync::interval)
+            m_flush_cv.wait_for(lk, chrono::milliseconds(m_interval_ms));
+        else
+            m_flush_cv.wait(lk, [&] { return m_stop || !m_buf.empty(); });
+
+        if (m_buf.empty()) {
+            if (m_stop)
+                break;
+            continue;
+        }
+
+        /* everything appended so far goes out in one write and one sync */
+        m_flushing.swap(m_buf);
+        uint64_t upto = m_next_lsn - 1;
+        m_writing = true;
+        lk.unlock();
+
+        const char *p = m_flushing.data();
+        size_t left = m_flushing.size();
+        while (left > 0) {
+            ssize_t n = write(m_fd, p, left);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                cerr << "wal: write failed: " << strerror(errno) << endl;
+                abort();
+            }
+            p += n;
+            left -= n;
+        }
+        if (m_policy != wal_sync::os && fdatasync(m_fd) < 0) {
+            cerr << "wal: fdatasync failed: " << strerror(errno) << endl;
+            abort();
+        }
+        m_flushing.clear();
+
+        lk.lock();
+        m_writing = false;
+        m_durable_lsn = upto;
+        m_durable_cv.notify_all();
+    }
+}